@@ -0,0 +1,813 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/* for struct ucred */
+#define _GNU_SOURCE
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "common.h"
+#include "config.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * ldapvi --agent: connect and bind once, then lend the connections to
+ * other ldapvi processes with the same server and bind options.
+ *
+ * The agent listens on a UNIX socket in ~/.ldapvi-agent, named after a
+ * hash of the connection options.  A client sends the options as a
+ * string, and the agent answers '+' if they match its own and it has a
+ * connection to spare, or '-' otherwise, in which case the client
+ * connects by itself.  After the '+', the client speaks LDAP on the
+ * socket, and the agent copies messages between it and the bound
+ * connection without looking further into them than the message ID and
+ * the operation, which is how TLS and SASL security layers keep working.
+ * Bind requests are refused, and an unbind ends the session without
+ * being sent on.
+ *
+ * Since the options do not include the password, anyone who can talk to
+ * the agent gets its bound connections.  So the directory has to belong
+ * to us and have mode 0700, and both sides check that the other one
+ * runs as the same user, where the system can tell.
+ *
+ * A connection goes back to the pool once the client has disconnected
+ * and nothing it asked for is outstanding.  Otherwise the server might
+ * still be sending results for message IDs the next client uses again,
+ * so the connection is closed and made again.
+ *
+ * The agent needs ldap_init_fd() and direct access to the Sockbuf of a
+ * connection, which libldap offers since OpenLDAP 2.4.  Older versions
+ * get a build without it.
+ */
+#ifndef ENABLE_AGENT
+
+#warning agent support disabled
+
+LDAP *
+agent_connect(cmdline *cmdline)
+{
+	return 0;
+}
+
+void
+agent_main(cmdline *cmdline, tconnector connector, char *dir)
+{
+	yourfault("Error: ldapvi compiled without agent support.");
+}
+
+#else
+
+#define AGENT_DIRECTORY ".ldapvi-agent"
+#define AGENT_MAX_IDENTITY 4096
+
+/*
+ * Sessions run in threads only if each thread can have its own error
+ * catcher, see error.c.
+ */
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_TLS)
+#define AGENT_THREADS
+#endif
+
+typedef struct tagent {
+	cmdline *cmdline;
+	tconnector connector;
+	char *dir;
+	char *identity;
+	GPtrArray *idle;	/* bound connections not lent out */
+	int missing;		/* connections closed and not made again */
+#ifdef AGENT_THREADS
+	pthread_mutex_t lock;
+	pthread_mutex_t connect_lock;
+	pthread_cond_t returned;
+#endif
+} tagent;
+
+typedef struct tsession {
+	tagent *agent;
+	int fd;
+} tsession;
+
+static char *agent_socket = 0;
+static int agent_stop[2];	/* written to by agent_signal() */
+
+/*
+ * The options that decide which server and identity a connection has.
+ */
+static char *
+agent_identity(cmdline *cmdline)
+{
+	bind_options *bo = &cmdline->bind_options;
+	GString *str = g_string_new("");
+	char *result;
+
+	g_string_printf(str, "server=%s\nstarttls=%d\ntls=%d\nauth=%lu\n"
+			 "user=%s\nmech=%s\nrealm=%s\nauthcid=%s\n"
+			 "authzid=%s\nsecprops=%s\n",
+			 cmdline->server ? cmdline->server : "",
+			 cmdline->starttls,
+			 cmdline->tls,
+			 (unsigned long) bo->authmethod,
+			 bo->user ? bo->user : "",
+			 bo->sasl_mech ? bo->sasl_mech : "",
+			 bo->sasl_realm ? bo->sasl_realm : "",
+			 bo->sasl_authcid ? bo->sasl_authcid : "",
+			 bo->sasl_authzid ? bo->sasl_authzid : "",
+			 bo->sasl_secprops ? bo->sasl_secprops : "");
+	result = str->str;
+	g_string_free(str, 0);
+	return result;
+}
+
+static char *
+agent_path(char *identity)
+{
+	char *dir = home_filename(AGENT_DIRECTORY);
+	char name[16];
+	char *result;
+
+	if (!dir)
+		return 0;
+	sprintf(name, "/%08x", g_str_hash(identity));
+	result = append(dir, name);
+	free(dir);
+	return result;
+}
+
+static int
+agent_address(char *path, struct sockaddr_un *sa)
+{
+	if (strlen(path) >= sizeof(sa->sun_path))
+		return -1;
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, path);
+	return 0;
+}
+
+/*
+ * Check that ~/.ldapvi-agent is a directory of ours with mode 0700.
+ */
+static int
+agent_directory_private(void)
+{
+	char *dir = home_filename(AGENT_DIRECTORY);
+	struct stat st;
+	int rc;
+
+	if (!dir)
+		return 0;
+	rc = lstat(dir, &st) != -1
+		&& S_ISDIR(st.st_mode)
+		&& st.st_uid == geteuid()
+		&& (st.st_mode & 07777) == 0700;
+	free(dir);
+	return rc;
+}
+
+/*
+ * Check that the process at the other end of FD has our user ID.
+ */
+static int
+agent_peer_ours(int fd)
+{
+#if defined(HAVE_GETPEEREID)
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid) == -1)
+		return 0;
+	return uid == geteuid();
+#elif defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return 0;
+	return cred.uid == geteuid();
+#else
+	/* nobody else can enter the directory */
+	return 1;
+#endif
+}
+
+static int
+write_all(int fd, char *ptr, int n)
+{
+	while (n > 0) {
+		int m = write(fd, ptr, n);
+		if (m == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += m;
+		n -= m;
+	}
+	return 0;
+}
+
+/*
+ * Connect to the agent for the server and bind options in CMDLINE.
+ * Return 0 if there is none, or if it cannot help us.
+ */
+LDAP *
+agent_connect(cmdline *cmdline)
+{
+	char *identity = agent_identity(cmdline);
+	char *path = agent_path(identity);
+	struct sockaddr_un sa;
+	LDAP *ld = 0;
+	int drei = 3;
+	char c;
+	int fd;
+
+	if (!path || agent_address(path, &sa) == -1
+	    || !agent_directory_private())
+		goto cleanup;
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) syserr();
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1
+	    || !agent_peer_ours(fd)
+	    || write_all(fd, identity, strlen(identity) + 1) == -1
+	    || read(fd, &c, 1) != 1
+	    || c != '+'
+	    || ldap_init_fd(fd, LDAP_PROTO_IPC, "ldapi://", &ld))
+	{
+		close(fd);
+		ld = 0;
+		goto cleanup;
+	}
+
+	if (ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &drei))
+		ldaperr(ld, "ldap_set_option(LDAP_OPT_PROTOCOL_VERSION)");
+	if (ldap_set_option(ld, LDAP_OPT_REFERRALS,
+			    cmdline->referrals ? LDAP_OPT_ON : LDAP_OPT_OFF))
+		ldaperr(ld, "ldap_set_option(LDAP_OPT_REFERRALS)");
+	if (ldap_set_option(ld, LDAP_OPT_DEREF, (void *) &cmdline->deref))
+		ldaperr(ld, "ldap_set_option(LDAP_OPT_DEREF)");
+	/* as after a bind in do_connect() */
+	cmdline->bind_options.dialog = BD_ALWAYS;
+
+cleanup:
+	free(identity);
+	if (path) free(path);
+	return ld;
+}
+
+
+/*
+ * The connection pool
+ */
+static int
+agent_stale(LDAP *ld)
+{
+	struct pollfd pfd;
+
+	/* the server has nothing to say between sessions, except goodbye */
+	if (ldap_get_option(ld, LDAP_OPT_DESC, &pfd.fd))
+		return 1;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/*
+ * Connect and bind.  Errors on the way must not end the agent, so they
+ * are caught and reported as a missing connection.
+ */
+static LDAP *
+agent_new_connection(tagent *agent)
+{
+	terrorcatcher catcher;
+	LDAP *ld;
+
+#ifdef AGENT_THREADS
+	pthread_mutex_lock(&agent->connect_lock);
+#endif
+	error_catch(&catcher);
+	if (setjmp(catcher.jmp)) {
+		fprintf(stderr, "%s\n", catcher.message);
+		ld = 0;
+	} else {
+		ld = agent->connector(agent->cmdline, agent->dir);
+		error_uncatch(&catcher);
+	}
+	/* ask only for the first connection */
+	agent->cmdline->bind_options.dialog = BD_NEVER;
+#ifdef AGENT_THREADS
+	pthread_mutex_unlock(&agent->connect_lock);
+#endif
+	return ld;
+}
+
+/*
+ * Take a bound connection from the pool, waiting for one if all are
+ * lent out.  Return 0 if we cannot connect.
+ */
+static LDAP *
+agent_lease(tagent *agent)
+{
+	LDAP *ld = 0;
+
+#ifdef AGENT_THREADS
+	pthread_mutex_lock(&agent->lock);
+	while (!agent->idle->len && !agent->missing)
+		pthread_cond_wait(&agent->returned, &agent->lock);
+#endif
+	while (!ld && agent->idle->len) {
+		ld = g_ptr_array_remove_index(
+			agent->idle, agent->idle->len - 1);
+		if (agent_stale(ld)) {
+			ldap_unbind_ext(ld, 0, 0);
+			ld = 0;
+			agent->missing++;
+		}
+	}
+	if (!ld)
+		/* make it ourselves */
+		agent->missing--;
+#ifdef AGENT_THREADS
+	pthread_mutex_unlock(&agent->lock);
+#endif
+	if (ld)
+		return ld;
+
+	if ( (ld = agent_new_connection(agent)))
+		return ld;
+#ifdef AGENT_THREADS
+	pthread_mutex_lock(&agent->lock);
+#endif
+	agent->missing++;
+#ifdef AGENT_THREADS
+	pthread_cond_signal(&agent->returned);
+	pthread_mutex_unlock(&agent->lock);
+#endif
+	return 0;
+}
+
+/*
+ * Put LD back into the pool, or close it if it is not REUSABLE.
+ */
+static void
+agent_return(tagent *agent, LDAP *ld, int reusable)
+{
+	if (!reusable)
+		ldap_unbind_ext(ld, 0, 0);
+#ifdef AGENT_THREADS
+	pthread_mutex_lock(&agent->lock);
+#endif
+	if (reusable)
+		g_ptr_array_add(agent->idle, ld);
+	else
+		agent->missing++;
+#ifdef AGENT_THREADS
+	pthread_cond_signal(&agent->returned);
+	pthread_mutex_unlock(&agent->lock);
+#endif
+}
+
+
+/*
+ * Sessions
+ */
+static int
+wait_readable(Sockbuf *sb)
+{
+	struct pollfd pfd;
+
+	if (ber_sockbuf_ctrl(sb, LBER_SB_OPT_GET_FD, &pfd.fd) != 1)
+		return -1;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+/*
+ * Read an LDAP message from SB into BER.  Return -1 at the end of the
+ * stream or on error.
+ */
+static int
+agent_read(Sockbuf *sb, BerElement *ber, ber_int_t *msgid, ber_tag_t *op)
+{
+	ber_len_t len;
+
+	for (;;) {
+		if (ber_get_next(sb, &len, ber) == LBER_SEQUENCE)
+			break;
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+			return -1;
+		if (wait_readable(sb) == -1)
+			return -1;
+	}
+	if (ber_get_int(ber, msgid) == LBER_ERROR)
+		return -1;
+	if ( (*op = ber_peek_tag(ber, &len)) == LBER_ERROR)
+		return -1;
+	return 0;
+}
+
+/*
+ * Write the message read into BER to SB as it is.
+ */
+static int
+agent_write(Sockbuf *sb, BerElement *ber)
+{
+	BerElement *out = ber_alloc_t(LBER_USE_DER);
+	struct berval bv;
+
+	/* ber_get_next() has left out the sequence tag and length */
+	ber_reset(ber, 0);
+	if (ber_flatten2(ber, &bv, 0) == -1
+	    || ber_printf(out, "{") == -1
+	    || ber_write(out, bv.bv_val, bv.bv_len, 0) == -1
+	    || ber_printf(out, "}") == -1)
+	{
+		ber_free(out, 1);
+		return -1;
+	}
+	return ber_flush2(sb, out, LBER_FLUSH_FREE_ALWAYS);
+}
+
+static int
+agent_refuse_bind(Sockbuf *sb, ber_int_t msgid)
+{
+	BerElement *out = ber_alloc_t(LBER_USE_DER);
+
+	if (ber_printf(out, "{it{ess}}", msgid, (ber_tag_t) LDAP_RES_BIND,
+		       (ber_int_t) LDAP_UNWILLING_TO_PERFORM, "",
+		       "cannot bind through ldapvi --agent") == -1)
+	{
+		ber_free(out, 1);
+		return -1;
+	}
+	return ber_flush2(sb, out, LBER_FLUSH_FREE_ALWAYS);
+}
+
+static void
+forget_msgid(GArray *pending, ber_int_t msgid)
+{
+	int i;
+
+	for (i = 0; i < pending->len; i++)
+		if (g_array_index(pending, ber_int_t, i) == msgid) {
+			g_array_remove_index_fast(pending, i);
+			return;
+		}
+}
+
+/*
+ * Copy messages between CLIENT and the connection LD until the client
+ * is done.  Return 0 if LD can be lent out again, -1 otherwise.
+ */
+static int
+agent_relay(Sockbuf *client, LDAP *ld)
+{
+	GArray *pending = g_array_new(0, 0, sizeof(ber_int_t));
+	struct pollfd fds[2];
+	Sockbuf *server;
+	int rc = -1;
+
+	if (ldap_get_option(ld, LDAP_OPT_SOCKBUF, &server)
+	    || ldap_get_option(ld, LDAP_OPT_DESC, &fds[1].fd)
+	    || ber_sockbuf_ctrl(client, LBER_SB_OPT_GET_FD, &fds[0].fd) != 1)
+		goto cleanup;
+	fds[0].events = POLLIN;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		BerElement *ber;
+		ber_int_t msgid;
+		ber_tag_t op;
+
+		fds[0].revents = fds[1].revents = 0;
+		/* a TLS layer may hold a message we would not poll for */
+		if (!ber_sockbuf_ctrl(server, LBER_SB_OPT_DATA_READY, 0))
+			if (poll(fds, 2, -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				goto cleanup;
+			}
+
+		if (!fds[0].revents) {
+			ber = ber_alloc_t(0);
+			if (agent_read(server, ber, &msgid, &op) == -1) {
+				ber_free(ber, 1);
+				goto cleanup;
+			}
+			if (!msgid) {
+				/* notice of disconnection */
+				agent_write(client, ber);
+				ber_free(ber, 1);
+				goto cleanup;
+			}
+			if (op != LDAP_RES_SEARCH_ENTRY
+			    && op != LDAP_RES_SEARCH_REFERENCE
+			    && op != LDAP_RES_INTERMEDIATE)
+				forget_msgid(pending, msgid);
+			if (agent_write(client, ber) == -1) {
+				ber_free(ber, 1);
+				goto cleanup;
+			}
+			ber_free(ber, 1);
+			continue;
+		}
+
+		ber = ber_alloc_t(0);
+		if (agent_read(client, ber, &msgid, &op) == -1
+		    || op == LDAP_REQ_UNBIND)
+		{
+			ber_free(ber, 1);
+			break;
+		}
+		if (op == LDAP_REQ_BIND) {
+			ber_free(ber, 1);
+			if (agent_refuse_bind(client, msgid) == -1)
+				break;
+			continue;
+		}
+		if (op != LDAP_REQ_ABANDON)
+			g_array_append_val(pending, msgid);
+		if (agent_write(server, ber) == -1) {
+			ber_free(ber, 1);
+			goto cleanup;
+		}
+		ber_free(ber, 1);
+	}
+	if (!pending->len)
+		rc = 0;
+
+cleanup:
+	g_array_free(pending, 1);
+	return rc;
+}
+
+/*
+ * Read the client's connection options, up to the null byte.
+ */
+static char *
+agent_read_identity(int fd)
+{
+	char *result = xalloc(AGENT_MAX_IDENTITY);
+	int n = 0;
+
+	for (;;) {
+		int m = read(fd, result + n, AGENT_MAX_IDENTITY - n);
+		if (m == -1 && errno == EINTR)
+			continue;
+		if (m <= 0)
+			break;
+		n += m;
+		if (!result[n - 1])
+			return result;
+		if (n == AGENT_MAX_IDENTITY)
+			break;
+	}
+	free(result);
+	return 0;
+}
+
+static void
+agent_session(tagent *agent, int fd)
+{
+	char *identity;
+	Sockbuf *client;
+	LDAP *ld;
+
+	if (!agent_peer_ours(fd)) {
+		close(fd);
+		return;
+	}
+	identity = agent_read_identity(fd);
+	if (!identity || strcmp(identity, agent->identity)
+	    || !(ld = agent_lease(agent)))
+	{
+		write_all(fd, "-", 1);
+		close(fd);
+		if (identity) free(identity);
+		return;
+	}
+	free(identity);
+	if (write_all(fd, "+", 1) == -1) {
+		close(fd);
+		agent_return(agent, ld, 1);
+		return;
+	}
+
+	client = ber_sockbuf_alloc();
+	ber_sockbuf_add_io(
+		client, &ber_sockbuf_io_fd, LBER_SBIOD_LEVEL_PROVIDER, &fd);
+	agent_return(agent, ld, agent_relay(client, ld) == 0);
+	/* closes fd */
+	ber_sockbuf_free(client);
+}
+
+#ifdef AGENT_THREADS
+static void *
+agent_session_thread(void *arg)
+{
+	tsession *session = arg;
+
+	agent_session(session->agent, session->fd);
+	free(session);
+	return 0;
+}
+#endif
+
+/*
+ * Accept clients until agent_signal() asks us to stop.
+ */
+static void
+agent_serve(tagent *agent, int listener)
+{
+	struct pollfd fds[2];
+
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	fds[1].fd = agent_stop[0];
+	fds[1].events = POLLIN;
+	for (;;) {
+		int fd;
+#ifdef AGENT_THREADS
+		tsession *session;
+		pthread_t thread;
+#endif
+
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			syserr();
+		}
+		if (fds[1].revents)
+			return;
+		if (!fds[0].revents)
+			continue;
+		if ( (fd = accept(listener, 0, 0)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			syserr();
+		}
+#ifdef AGENT_THREADS
+		session = xalloc(sizeof(tsession));
+		session->agent = agent;
+		session->fd = fd;
+		if (pthread_create(&thread, 0, agent_session_thread, session))
+			syserr();
+		pthread_detach(thread);
+#else
+		agent_session(agent, fd);
+#endif
+	}
+}
+
+
+/*
+ * Startup
+ */
+static void
+agent_cleanup(void)
+{
+	if (agent_socket)
+		unlink(agent_socket);
+}
+
+/*
+ * Only note the signal here.  The main thread returns from agent_serve()
+ * and exits, which removes the socket.
+ */
+static void
+agent_signal(int n)
+{
+	int error = errno;
+	write(agent_stop[1], "", 1);
+	errno = error;
+}
+
+/*
+ * Make a socket at PATH, replacing that of an agent that has gone away.
+ */
+static int
+agent_listen(char *path)
+{
+	struct sockaddr_un sa;
+	char *dir = home_filename(AGENT_DIRECTORY);
+	int fd;
+
+	if (agent_address(path, &sa) == -1)
+		yourfault("Path of the agent socket is too long.");
+	if (mkdir(dir, 0700) == -1) {
+		if (errno != EEXIST) syserr();
+	} else if (chmod(dir, 0700) == -1)
+		/* in case the umask took away our own permissions */
+		syserr();
+	if (!agent_directory_private()) {
+		fprintf(stderr, "%s must be a directory of ours with mode"
+			" 0700.\n", dir);
+		exit(1);
+	}
+	free(dir);
+
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) syserr();
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) != -1) {
+		fprintf(stderr, "An agent is already listening on %s.\n",
+			path);
+		exit(1);
+	}
+	if (errno != ENOENT && errno != ECONNREFUSED) syserr();
+	if (errno == ECONNREFUSED && unlink(path) == -1) syserr();
+	close(fd);
+
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) syserr();
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1) syserr();
+	if (listen(fd, SOMAXCONN) == -1) syserr();
+	return fd;
+}
+
+/*
+ * ldapvi --agent: make cmdline->agent connections using CONNECTOR, then
+ * fork and serve them in the background.
+ */
+void
+agent_main(cmdline *cmdline, tconnector connector, char *dir)
+{
+	int n = cmdline->agent;
+	tagent agent;
+	char *path;
+	int listener;
+	int null;
+	int pid;
+	int i;
+
+	agent.cmdline = cmdline;
+	agent.connector = connector;
+	agent.dir = dir;
+	agent.identity = agent_identity(cmdline);
+	agent.idle = g_ptr_array_new();
+	agent.missing = 0;
+	/* keep our sockets off the fds that the daemon sets to /dev/null */
+	while ( (null = open("/dev/null", O_RDWR)) != -1 && null <= 2)
+		;
+	if (null == -1) syserr();
+	close(null);
+#ifdef AGENT_THREADS
+	pthread_mutex_init(&agent.lock, 0);
+	pthread_mutex_init(&agent.connect_lock, 0);
+	pthread_cond_init(&agent.returned, 0);
+#else
+	n = 1;
+#endif
+	if ( !(path = agent_path(agent.identity)))
+		yourfault("Cannot run an agent without $HOME.");
+	listener = agent_listen(path);
+
+	for (i = 0; i < n; i++) {
+		LDAP *ld = agent_new_connection(&agent);
+		if (!ld) {
+			unlink(path);
+			exit(1);
+		}
+		g_ptr_array_add(agent.idle, ld);
+	}
+
+	fflush(stdout);
+	if ( (pid = fork()) == -1) syserr();
+	if (pid) {
+		fprintf(stderr, "Agent listening on %s, pid %d.\n", path, pid);
+		/* the child has the connections and cleans up */
+		_exit(0);
+	}
+
+	agent_socket = path;
+	if (atexit(agent_cleanup)) syserr();
+	if (pipe(agent_stop) == -1) syserr();
+	if (fcntl(agent_stop[1], F_SETFL, O_NONBLOCK) == -1) syserr();
+	signal(SIGTERM, agent_signal);
+	signal(SIGINT, agent_signal);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	if (setsid() == -1) syserr();
+	if ( (null = open("/dev/null", O_RDWR)) == -1) syserr();
+	for (i = 0; i < 3; i++)
+		if (dup2(null, i) == -1) syserr();
+	close(null);
+
+	agent_serve(&agent, listener);
+	exit(0);
+}
+#endif
@@ -69,6 +69,8 @@ static void parse_configuration(char *, cmdline *, GPtrArray *);
 "  -o, --class OBJCLASS   Class to add.  Can be repeated.  Implies -A.\n"     \
 "      --config           Print parameters in ldap.conf syntax.\n"	      \
 "  -c  --continue         Ignore LDAP errors and continue processing.\n"      \
+"      --compress gzip|zstd[:LEVEL]\n"					      \
+"                         (Only with --out:) Compress the output.\n"	      \
 "      --deleteoldrdn     (Only with --rename:) Delete the old RDN.\n"	      \
 "  -a, --deref            never|searching|finding|always\n"		      \
 "  -d, --discover         Auto-detect naming contexts.              [2]\n"    \
@@ -85,6 +87,11 @@ static void parse_configuration(char *, cmdline *, GPtrArray *);
 "  -R, --read DN          Same as -b DN -s base '(objectclass=*)' + *\n"      \
 "  -Z, --starttls         Require startTLS.\n"				      \
 "      --tls [never|allow|try|strict]  Level of TLS strictess.\n"	      \
+"      --stats[=json]     Print timings and counters to stderr on exit.\n"    \
+"      --agent[=N]        Keep N bound connections (4) for other ldapvi\n"    \
+"                         processes to use.                         [3]\n"    \
+"      --no-agent         Connect directly even if an agent is running.\n"    \
+"      --tmpdir DIR       Keep temporary files in DIR, e.g. a tmpfs.\n"       \
 "  -v, --verbose          Note every update.\n"				      \
 "\n"									      \
 "Shortcuts:\n"								      \
@@ -93,7 +100,7 @@ static void parse_configuration(char *, cmdline *, GPtrArray *);
 "      --ldapdelete       Short for --noninteractive --delete\n"	      \
 "      --ldapmoddn        Short for --noninteractive --rename\n"	      \
 "\n"									      \
-"Environment variables: VISUAL, EDITOR, PAGER.\n"			      \
+"Environment variables: VISUAL, EDITOR, PAGER, TMPDIR.\n"		      \
 "\n"									      \
 "[1] User names can be specified as distinguished names:\n"		      \
 "      uid=foo,ou=bar,dc=acme,dc=com\n"					      \
@@ -108,6 +115,10 @@ static void parse_configuration(char *, cmdline *, GPtrArray *);
 "    concatenation of all search results.  Conflicts with --base.\n"	      \
 "    With --config, show a BASE configuration line for each context.\n"	      \
 "\n"									      \
+"[3] The agent binds, then serves ldapvi processes with the same server\n"    \
+"    and bind options over a socket in ~/.ldapvi-agent, so that they\n"	      \
+"    need not connect and bind themselves.  Stop it with kill(1).\n"	      \
+"\n"									      \
 "A special (offline) option is --diff, which compares two files\n"	      \
 "and writes any changes to standard output in LDIF format.\n"		      \
 "\n"									      \
@@ -119,7 +130,8 @@ enum ldapvi_option_numbers {
 	OPTION_NOQUESTIONS, OPTION_LDAPSEARCH, OPTION_LDAPMODIFY,
 	OPTION_LDAPDELETE, OPTION_LDAPMODDN, OPTION_LDAPMODRDN, OPTION_ADD,
 	OPTION_CONFIG, OPTION_READ, OPTION_LDAP_CONF, OPTION_BIND,
-	OPTION_BIND_DIALOG, OPTION_UNPAGED_HELP
+	OPTION_BIND_DIALOG, OPTION_UNPAGED_HELP, OPTION_COMPRESS,
+	OPTION_TMPDIR, OPTION_STATS, OPTION_AGENT, OPTION_NO_AGENT
 };
 
 static struct poptOption options[] = {
@@ -146,6 +158,13 @@ static struct poptOption options[] = {
 	{"encoding",	  0, POPT_ARG_STRING, 0, OPTION_ENCODING, 0, 0},
 	{"bind",	  0, POPT_ARG_STRING, 0, OPTION_BIND, 0, 0},
 	{"bind-dialog",	  0, POPT_ARG_STRING, 0, OPTION_BIND_DIALOG, 0, 0},
+	{"compress",	  0, POPT_ARG_STRING, 0, OPTION_COMPRESS, 0, 0},
+	{"tmpdir",	  0, POPT_ARG_STRING, 0, OPTION_TMPDIR, 0, 0},
+	{"stats",	  0, POPT_ARG_STRING | POPT_ARGFLAG_OPTIONAL, 0,
+	 OPTION_STATS, 0, 0},
+	{"agent",	  0, POPT_ARG_STRING | POPT_ARGFLAG_OPTIONAL, 0,
+	 OPTION_AGENT, 0, 0},
+	{"no-agent",	  0, 0, 0, OPTION_NO_AGENT, 0, 0},
 	{"continuous",	'c', 0, 0, 'c', 0, 0},
 	{"continue",	'c', 0, 0, 'c', 0, 0},
 	{"empty",	'A', 0, 0, 'A', 0, 0},
@@ -227,6 +246,12 @@ init_cmdline(cmdline *cmdline)
 	cmdline->schema_comments = 0;
 	cmdline->continuous = 0;
 	cmdline->profileonlyp = 0;
+	cmdline->compress = COMPRESS_NONE;
+	cmdline->compress_level = 0;
+	cmdline->tmpdir = 0;
+	cmdline->stats = STATS_OFF;
+	cmdline->agent = 0;
+	cmdline->noagent = 0;
 
         cmdline->bind_options.authmethod = LDAP_AUTH_SIMPLE;
         cmdline->bind_options.dialog = BD_AUTO;
@@ -517,6 +542,43 @@ parse_argument(int c, char *arg, cmdline *result, GPtrArray *ctrls)
 	case OPTION_UNPAGED_HELP:
 		usage_pagerp = 0;
 		break;
+	case OPTION_COMPRESS:
+		if (compress_parse(arg, &result->compress,
+				   &result->compress_level) == -1)
+		{
+			fprintf(stderr, "invalid or unsupported compression:"
+				" %s\n", arg);
+			usage(2, 1);
+		}
+		break;
+	case OPTION_TMPDIR:
+		result->tmpdir = arg;
+		break;
+	case OPTION_STATS:
+		if (!arg || !strcmp(arg, "text"))
+			result->stats = STATS_TEXT;
+		else if (!strcmp(arg, "json"))
+			result->stats = STATS_JSON;
+		else {
+			/* popt takes the next argument if it can */
+			fprintf(stderr, "invalid --stats format: %s"
+				" (use --stats=json)\n", arg);
+			usage(2, 1);
+		}
+		break;
+	case OPTION_AGENT:
+		if (!arg)
+			result->agent = 4;
+		else if ( (result->agent = atoi(arg)) < 1) {
+			fprintf(stderr, "invalid --agent connections: %s"
+				" (use --agent=N)\n", arg);
+			usage(2, 1);
+		}
+		result->noagent = 1;
+		break;
+	case OPTION_NO_AGENT:
+		result->noagent = 1;
+		break;
 	case 'p':
 		parse_configuration(arg, result, ctrls);
 		break;
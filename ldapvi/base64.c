@@ -56,12 +56,13 @@ void
 print_base64(
 	unsigned char const *src,
 	size_t srclength,
-	FILE *s)
+	tobuffer *b)
 {
 	unsigned char input[3];
 	unsigned char output[4];
 	size_t i;
 	int col = 0;
+	char *out;
 
 	while (2 < srclength) {
 		input[0] = *src++;
@@ -74,16 +75,19 @@ print_base64(
 		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
 		output[3] = input[2] & 0x3f;
 
+		out = obuffer_reserve(b, 6);
 		if (col >= 76) {
-			fputs("\n ", s);
+			*out++ = '\n';
+			*out++ = ' ';
 			col = 0;
 		}
 		col += 4;
 
-		fputc(Base64[output[0]], s);
-		fputc(Base64[output[1]], s);
-		fputc(Base64[output[2]], s);
-		fputc(Base64[output[3]], s);
+		*out++ = Base64[output[0]];
+		*out++ = Base64[output[1]];
+		*out++ = Base64[output[2]];
+		*out++ = Base64[output[3]];
+		b->len = out - b->data;
 	}
     
 	/* Now we worry about padding. */
@@ -97,13 +101,15 @@ print_base64(
 		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
 		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
 
-		fputc(Base64[output[0]], s);
-		fputc(Base64[output[1]], s);
+		out = obuffer_reserve(b, 4);
+		*out++ = Base64[output[0]];
+		*out++ = Base64[output[1]];
 		if (srclength == 1)
-			fputc(Pad64, s);
+			*out++ = Pad64;
 		else
-			fputc(Base64[output[2]], s);
-		fputc(Pad64, s);
+			*out++ = Base64[output[2]];
+		*out++ = Pad64;
+		b->len = out - b->data;
 	}
 }
 
@@ -0,0 +1,395 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Time the parser, compare_streams(), the printer and base64 on a clean
+ * and a data file written by gendata, and the same through the public
+ * interface of libldapvi, and print one tab-separated line per benchmark:
+ *
+ *   label  benchmark  entries  bytes  seconds  MB/s
+ *
+ * Each benchmark is run several times and the fastest run is reported,
+ * which is the least noisy figure on a busy machine.
+ */
+#include "../common.h"
+#include "../libldapvi.h"
+
+#define BASE64_SIZE (1 << 20)
+#define BASE64_ROUNDS 32
+
+static int repeat = 5;
+static char *label = "-";
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	if (gettimeofday(&tv, 0) == -1) syserr();
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+report(char *name, long entries, long bytes, double seconds)
+{
+	printf("%s\t%s\t%ld\t%ld\t%.6f\t%.2f\n",
+	       label, name, entries, bytes, seconds,
+	       seconds > 0 ? bytes / seconds / 1e6 : 0);
+	fflush(stdout);
+}
+
+static long
+file_size(FILE *s)
+{
+	struct stat st;
+
+	if (fstat(fileno(s), &st) == -1) syserr();
+	return st.st_size;
+}
+
+/*
+ * Parse all entries of S.  Keep them in ENTRIES if not null.
+ */
+static long
+parse_all(tparser *p, FILE *s, GPtrArray *entries, GArray *offsets)
+{
+	long n = 0;
+
+	if (fseek(s, 0, SEEK_SET) == -1) syserr();
+	for (;;) {
+		char *key = 0;
+		tentry *entry;
+		long pos;
+
+		if (p->entry(s, -1, &key, &entry, &pos) == -1) exit(1);
+		if (!key) break;
+		free(key);
+		if (offsets)
+			g_array_append_val(offsets, pos);
+		if (entries)
+			g_ptr_array_add(entries, entry);
+		else
+			entry_free(entry);
+		n++;
+	}
+	return n;
+}
+
+static void
+bench_parse(tparser *p, FILE *clean)
+{
+	double best = -1;
+	long n = 0;
+	int i;
+
+	for (i = 0; i < repeat; i++) {
+		double start = now();
+		double t;
+
+		n = parse_all(p, clean, 0, 0);
+		t = now() - start;
+		if (best < 0 || t < best) best = t;
+	}
+	report("parse", n, file_size(clean), best);
+}
+
+static int
+count_change(int key, char *labeldn, char *dn, LDAPMod **mods, void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static int
+count_rename(int key, char *olddn, tentry *entry, void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static int
+count_add(int key, char *dn, LDAPMod **mods, void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static int
+count_delete(int key, char *dn, void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static int
+count_rename0(int key, char *olddn, char *newdn, int deleteoldrdn,
+	      void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static thandler count_handler = {
+	count_change,
+	count_rename,
+	count_add,
+	count_delete,
+	count_rename0
+};
+
+static void
+bench_compare(tparser *p, FILE *clean, FILE *data)
+{
+	GArray *offsets = g_array_new(0, 0, sizeof(long));
+	double best = -1;
+	long changes = 0;
+	int i;
+
+	parse_all(p, clean, 0, offsets);
+	for (i = 0; i < repeat; i++) {
+		long errpos, syntaxpos;
+		double start = now();
+		double t;
+
+		changes = 0;
+		if (fseek(data, 0, SEEK_SET) == -1) syserr();
+		if (compare_streams(p, &count_handler, &changes, offsets,
+				    clean, data, &errpos, &syntaxpos))
+		{
+			fputs("bench: compare_streams failed\n", stderr);
+			exit(1);
+		}
+		t = now() - start;
+		if (best < 0 || t < best) best = t;
+	}
+	report("compare", offsets->len, file_size(clean) + file_size(data),
+	       best);
+	fprintf(stderr, "%s: %ld changes\n", label, changes);
+	g_array_free(offsets, 1);
+}
+
+static void
+bench_print(tparser *p, FILE *clean)
+{
+	GPtrArray *entries = g_ptr_array_new();
+	double best = -1;
+	FILE *null;
+	int i, j;
+
+	if ( !(null = fopen("/dev/null", "w"))) syserr();
+	parse_all(p, clean, entries, 0);
+	for (i = 0; i < repeat; i++) {
+		double start = now();
+		double t;
+
+		for (j = 0; j < entries->len; j++) {
+			char key[16];
+			sprintf(key, "%d", j);
+			p->print(null, g_ptr_array_index(entries, j), key, 0);
+		}
+		t = now() - start;
+		if (best < 0 || t < best) best = t;
+	}
+	report("print", entries->len, file_size(clean), best);
+	for (j = 0; j < entries->len; j++)
+		entry_free(g_ptr_array_index(entries, j));
+	g_ptr_array_free(entries, 1);
+	if (fclose(null) == EOF) syserr();
+}
+
+static int
+count_entry(char *key, char *dn, LDAPMod **attrs, void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static int
+count_change_api(int key, char *olddn, char *newdn, LDAPMod **mods,
+		 void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static int
+count_rename_api(int key, char *olddn, char *newdn, int deleteoldrdn,
+		 void *userdata)
+{
+	(*(long *) userdata)++;
+	return 0;
+}
+
+static ldapvi_handler count_api_handler = {
+	count_entry,
+	count_change_api,
+	count_rename_api,
+	count_add,
+	count_delete
+};
+
+/*
+ * ldapvi_stream() and ldapvi_diff(), including the offsets that
+ * bench_compare() computes only once.
+ */
+static void
+bench_api(int syntax, FILE *clean, FILE *data)
+{
+	double stream = -1;
+	double diff = -1;
+	long n = 0;
+	int i;
+
+	for (i = 0; i < repeat; i++) {
+		double start = now();
+		double t;
+
+		n = 0;
+		if (fseek(clean, 0, SEEK_SET) == -1) syserr();
+		if (ldapvi_stream(clean, syntax, 1, &count_api_handler, &n)) {
+			fprintf(stderr, "bench: %s\n", ldapvi_error());
+			exit(1);
+		}
+		t = now() - start;
+		if (stream < 0 || t < stream) stream = t;
+	}
+	report("api-stream", n, file_size(clean), stream);
+	for (i = 0; i < repeat; i++) {
+		double start = now();
+		double t;
+		long changes = 0;
+
+		if (fseek(clean, 0, SEEK_SET) == -1) syserr();
+		if (fseek(data, 0, SEEK_SET) == -1) syserr();
+		if (ldapvi_diff(clean, data, syntax, &count_api_handler,
+				&changes, 0))
+		{
+			fprintf(stderr, "bench: %s\n", ldapvi_error());
+			exit(1);
+		}
+		t = now() - start;
+		if (diff < 0 || t < diff) diff = t;
+	}
+	report("api-diff", n, file_size(clean) + file_size(data), diff);
+}
+
+static void
+bench_base64(void)
+{
+	unsigned char *bytes = xalloc(BASE64_SIZE);
+	unsigned char *target = xalloc(BASE64_SIZE + 1);
+	double encode = -1;
+	double decode = -1;
+	tobuffer b;
+	int i, j;
+
+	for (i = 0; i < BASE64_SIZE; i++)
+		bytes[i] = (i ^ i >> 8) * 31;
+	obuffer_init(&b, 0);
+	for (i = 0; i < repeat; i++) {
+		double start = now();
+		double t;
+
+		for (j = 0; j < BASE64_ROUNDS; j++) {
+			b.len = 0;
+			print_base64(bytes, BASE64_SIZE, &b);
+		}
+		t = now() - start;
+		if (encode < 0 || t < encode) encode = t;
+	}
+	obuffer_putc(&b, 0);
+	for (i = 0; i < repeat; i++) {
+		double start = now();
+		double t;
+
+		for (j = 0; j < BASE64_ROUNDS; j++)
+			/* one spare byte, see read_base64() */
+			if (read_base64(b.data, target, BASE64_SIZE + 1)
+			    != BASE64_SIZE)
+			{
+				fputs("bench: read_base64 failed\n", stderr);
+				exit(1);
+			}
+		t = now() - start;
+		if (decode < 0 || t < decode) decode = t;
+	}
+	report("base64-encode", 0, (long) BASE64_SIZE * BASE64_ROUNDS, encode);
+	report("base64-decode", 0, (long) BASE64_SIZE * BASE64_ROUNDS, decode);
+	obuffer_free(&b);
+	free(bytes);
+	free(target);
+}
+
+static void
+bench_usage(int rc)
+{
+	fputs("Usage: bench [-l] [-r REPEAT] [-t LABEL] CLEAN DATA\n"
+	      "       bench -6 [-r REPEAT] [-t LABEL]\n"
+	      "  -l       files are in LDIF\n"
+	      "  -6       time base64 only\n",
+	      rc ? stderr : stdout);
+	exit(rc);
+}
+
+int
+main(int argc, char **argv)
+{
+	tparser *p = &ldapvi_parser;
+	int syntax = LDAPVI_SYNTAX_LDAPVI;
+	FILE *clean;
+	FILE *data;
+	int base64 = 0;
+	int c;
+
+	while ( (c = getopt(argc, argv, "hl6r:t:")) != -1)
+		switch (c) {
+		case 'l':
+			p = &ldif_parser;
+			syntax = LDAPVI_SYNTAX_LDIF;
+			break;
+		case '6':
+			base64 = 1;
+			break;
+		case 'r':
+			if ( (repeat = atoi(optarg)) < 1) bench_usage(1);
+			break;
+		case 't':
+			label = optarg;
+			break;
+		case 'h':
+			bench_usage(0);
+		default:
+			bench_usage(1);
+		}
+	if (base64) {
+		bench_base64();
+		return 0;
+	}
+	if (argc - optind != 2)
+		bench_usage(1);
+
+	if ( !(clean = fopen(argv[optind], "r"))) syserr();
+	if ( !(data = fopen(argv[optind + 1], "r"))) syserr();
+	bench_parse(p, clean);
+	bench_compare(p, clean, data);
+	bench_print(p, clean);
+	bench_api(syntax, clean, data);
+	if (fclose(clean) == EOF) syserr();
+	if (fclose(data) == EOF) syserr();
+	return 0;
+}
@@ -0,0 +1,253 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Write a synthetic directory as a clean file, as ldapvi would have
+ * written it after a search, and a data file with a given fraction of
+ * the entries edited, renamed, deleted, and added, as if a user had
+ * changed it in the editor.  The output only depends on the options,
+ * so that benchmark results can be compared between runs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int ldif = 0;
+static long nentries = 10000;
+static int width = 32;
+static int nvalues = 3;
+static double binary = 0.1;
+static double edit = 0.1;
+static double add = 0.02;
+static double delete = 0.02;
+static double rename_ = 0.02;
+static unsigned long seed = 1;
+
+static void
+usage(int rc)
+{
+	fputs("Usage: gendata [OPTION]... CLEAN DATA\n"
+	      "  -l       write LDIF instead of ldapvi syntax\n"
+	      "  -n N     number of entries (10000)\n"
+	      "  -w N     characters per attribute value (32)\n"
+	      "  -v N     values of the multi-valued attribute (3)\n"
+	      "  -b F     fraction of entries with a binary value (0.1)\n"
+	      "  -e F     fraction of entries edited (0.1)\n"
+	      "  -a F     entries added, as a fraction of N (0.02)\n"
+	      "  -d F     fraction of entries deleted (0.02)\n"
+	      "  -r F     fraction of entries renamed (0.02)\n"
+	      "  -s N     random seed (1)\n",
+	      rc ? stderr : stdout);
+	exit(rc);
+}
+
+static void
+syserr(void)
+{
+	perror("gendata");
+	exit(1);
+}
+
+/* xorshift, so that the files are the same on every platform */
+static unsigned long
+rnd(void)
+{
+	seed ^= (seed << 13) & 0xffffffffUL;
+	seed ^= seed >> 17;
+	seed ^= (seed << 5) & 0xffffffffUL;
+	return seed;
+}
+
+static int
+chance(double f)
+{
+	return rnd() % 1000000 < f * 1000000;
+}
+
+static void
+random_text(char *buf, int n)
+{
+	static char *alphabet
+		= "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		  "0123456789 ";
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = alphabet[rnd() % 63];
+	/* no leading or trailing space, so that LDIF does not need base64 */
+	if (n) {
+		buf[0] = 'x';
+		buf[n - 1] = 'x';
+	}
+	buf[n] = 0;
+}
+
+/*
+ * Write N random bytes in base64.  They depend on X only, so that the
+ * clean and data files agree.
+ */
+static void
+write_base64(FILE *s, int n, unsigned long x)
+{
+	static char *digits
+		= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+		  "0123456789+/";
+	int i;
+
+	/* random bytes encode to random digits; round N up to 3 bytes */
+	n = (n + 2) / 3 * 4;
+	for (i = 0; i < n; i++) {
+		x ^= (x << 13) & 0xffffffffUL;
+		x ^= x >> 17;
+		x ^= (x << 5) & 0xffffffffUL;
+		putc(digits[x % 64], s);
+	}
+}
+
+static void
+write_header(FILE *s, char *key, char *cn)
+{
+	if (ldif) {
+		fprintf(s, "\ndn: cn=%s,ou=people,dc=example,dc=com\n", cn);
+		if (key)
+			fprintf(s, "ldapvi-key: %s\n", key);
+	} else
+		fprintf(s, "\n%s cn=%s,ou=people,dc=example,dc=com\n",
+			key ? key : "add", cn);
+}
+
+/*
+ * Write an entry, with a binary value if BIN is not 0.
+ */
+static void
+write_entry(FILE *s, char *key, char *cn, char *sn, char *text,
+	    unsigned long bin)
+{
+	int i;
+
+	write_header(s, key, cn);
+	fputs("objectClass: top\n"
+	      "objectClass: person\n"
+	      "objectClass: inetOrgPerson\n", s);
+	fprintf(s, "cn: %s\n", cn);
+	fprintf(s, "sn: %s\n", sn);
+	for (i = 0; i < nvalues; i++)
+		fprintf(s, "description: %d %s\n", i, text);
+	fprintf(s, "mail: %s@example.com\n", cn);
+	if (bin) {
+		fputs("jpegPhoto:: ", s);
+		write_base64(s, width, bin);
+		putc('\n', s);
+	}
+}
+
+static double
+fraction(char *arg)
+{
+	char *ptr;
+	double f = strtod(arg, &ptr);
+
+	if (*ptr || f < 0 || f > 1) {
+		fprintf(stderr, "gendata: invalid fraction: %s\n", arg);
+		exit(1);
+	}
+	return f;
+}
+
+static long
+number(char *arg)
+{
+	char *ptr;
+	long n = strtol(arg, &ptr, 10);
+
+	if (*ptr || n < 0) {
+		fprintf(stderr, "gendata: invalid number: %s\n", arg);
+		exit(1);
+	}
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *clean;
+	FILE *data;
+	char *sn;
+	char *text;
+	char key[32];
+	char cn[64];
+	long i;
+	int c;
+
+	while ( (c = getopt(argc, argv, "hln:w:v:b:e:a:d:r:s:")) != -1)
+		switch (c) {
+		case 'l': ldif = 1; break;
+		case 'n': nentries = number(optarg); break;
+		case 'w': width = number(optarg); break;
+		case 'v': nvalues = number(optarg); break;
+		case 'b': binary = fraction(optarg); break;
+		case 'e': edit = fraction(optarg); break;
+		case 'a': add = fraction(optarg); break;
+		case 'd': delete = fraction(optarg); break;
+		case 'r': rename_ = fraction(optarg); break;
+		case 's': seed = number(optarg) | 1; break;
+		case 'h': usage(0);
+		default: usage(1);
+		}
+	if (argc - optind != 2)
+		usage(1);
+
+	if ( !(clean = fopen(argv[optind], "w"))) syserr();
+	if ( !(data = fopen(argv[optind + 1], "w"))) syserr();
+	if ( !(sn = malloc(width + 1))) syserr();
+	if ( !(text = malloc(width + 1))) syserr();
+
+	if (ldif) {
+		fputs("version: 1\n", clean);
+		fputs("version: 1\n", data);
+	}
+	for (i = 0; i < nentries; i++) {
+		unsigned long bin = chance(binary) ? i + 1 : 0;
+
+		sprintf(key, "%ld", i);
+		sprintf(cn, "user%06ld", i);
+		random_text(sn, width);
+		random_text(text, width);
+		write_entry(clean, key, cn, sn, text, bin);
+
+		if (chance(delete))
+			continue;
+		if (chance(rename_))
+			sprintf(cn, "renamed%06ld", i);
+		if (chance(edit))
+			random_text(sn, width);
+		write_entry(data, key, cn, sn, text, bin);
+	}
+	for (i = 0; i < nentries * add; i++) {
+		sprintf(cn, "added%06ld", i);
+		random_text(sn, width);
+		random_text(text, width);
+		write_entry(data, 0, cn, sn, text,
+			    chance(binary) ? nentries + i + 1 : 0);
+	}
+
+	if (fclose(clean) == EOF) syserr();
+	if (fclose(data) == EOF) syserr();
+	return 0;
+}
@@ -0,0 +1,149 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ *
+ * Copyright (c) 2007 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdarg.h>
+#define ALLOC_CATEGORY ALLOC_OUTPUT
+#include "common.h"
+
+/*
+ * Output buffers sit between the printers and stdio.  Values are
+ * copied in with memcpy and handed to fwrite in large chunks, so that
+ * we neither pay for one stdio call per byte nor have to check
+ * ferror() after every line.  Errors are detected once per flush.
+ *
+ * A buffer without a stream never writes anything.  It grows instead
+ * of flushing, and the caller takes the result from b->data, b->len.
+ */
+void
+obuffer_init(tobuffer *b, FILE *s)
+{
+	b->s = s;
+	b->size = OBUFFER_SIZE;
+	b->data = xalloc(b->size);
+	b->len = 0;
+}
+
+void
+obuffer_free(tobuffer *b)
+{
+	free(b->data);
+	b->data = 0;
+}
+
+static void
+obuffer_grow(tobuffer *b, size_t n)
+{
+	char *data;
+
+	while (b->size - b->len < n)
+		b->size *= 2;
+	data = xalloc(b->size);
+	memcpy(data, b->data, b->len);
+	free(b->data);
+	b->data = data;
+}
+
+void
+obuffer_flush(tobuffer *b)
+{
+	if (!b->s) {
+		if (b->len == b->size)
+			obuffer_grow(b, 1);
+		return;
+	}
+	if (b->len && fwrite(b->data, 1, b->len, b->s) != b->len)
+		syserr();
+	b->len = 0;
+}
+
+/*
+ * Make room for at least N more bytes, which must not be larger than
+ * the buffer itself, and return a pointer to the free space.
+ */
+char *
+obuffer_reserve(tobuffer *b, size_t n)
+{
+	if (b->size - b->len < n) {
+		if (b->s)
+			obuffer_flush(b);
+		else
+			obuffer_grow(b, n);
+	}
+	return b->data + b->len;
+}
+
+void
+obuffer_write(tobuffer *b, const char *ptr, size_t n)
+{
+	if (b->size - b->len >= n) {
+		memcpy(b->data + b->len, ptr, n);
+		b->len += n;
+		return;
+	}
+	if (!b->s) {
+		obuffer_grow(b, n);
+		memcpy(b->data + b->len, ptr, n);
+		b->len += n;
+		return;
+	}
+	obuffer_flush(b);
+	if (n >= b->size) {
+		/* no point in copying huge values */
+		if (fwrite(ptr, 1, n, b->s) != n) syserr();
+		return;
+	}
+	memcpy(b->data, ptr, n);
+	b->len = n;
+}
+
+void
+obuffer_puts(tobuffer *b, const char *str)
+{
+	obuffer_write(b, str, strlen(str));
+}
+
+void
+obuffer_printf(tobuffer *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+	va_end(ap);
+	if (n < 0) syserr();
+	if (n < b->size - b->len) {
+		b->len += n;
+		return;
+	}
+
+	if (b->s)
+		obuffer_flush(b);
+	else
+		obuffer_grow(b, n + 1);
+	if (n < b->size - b->len) {
+		va_start(ap, fmt);
+		vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		b->len += n;
+	} else {
+		va_start(ap, fmt);
+		if (vfprintf(b->s, fmt, ap) < 0) syserr();
+		va_end(ap);
+	}
+}
@@ -25,6 +25,7 @@
 #define LDAP_DEPRECATED 1
 #include <ldap.h>
 #include <ldap_schema.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,6 +47,10 @@
 typedef struct tschema {
 	GHashTable *classes;
 	GHashTable *types;
+	struct tdefinition *class_defs;
+	struct tdefinition *type_defs;
+	char **class_values;
+	char **type_values;
 } tschema;
 
 typedef struct tentroid {
@@ -58,6 +63,21 @@ typedef struct tentroid {
 	GString *error;
 } tentroid;
 
+/*
+ * A search result entry decoded in place: the DN, attribute
+ * descriptions and values point into the BER buffer of the message.
+ */
+typedef struct tberattribute {
+	struct berval ad;
+	struct berval *values;	/* terminated by a null bv_val, or null */
+	void *data;
+} tberattribute;
+
+typedef struct tberentry {
+	BerElement *ber;
+	struct berval dn;
+	GArray *attributes;
+} tberentry;
 
 
 /*
@@ -69,6 +89,15 @@ void do_syserr(char *file, int line);
 void yourfault(char *str);
 void ldaperr(LDAP *ld, char *str);
 
+typedef struct terrorcatcher {
+	jmp_buf jmp;
+	char message[256];
+	struct terrorcatcher *next;
+} terrorcatcher;
+
+void error_catch(terrorcatcher *catcher);
+void error_uncatch(terrorcatcher *catcher);
+
 /*
  * arguments.c
  */
@@ -130,6 +159,12 @@ typedef struct cmdline {
 	int schema_comments;
 	int continuous;
 	int profileonlyp;
+	int compress;
+	int compress_level;
+	char *tmpdir;
+	int stats;
+	int agent;
+	int noagent;
 } cmdline;
 
 void init_cmdline(cmdline *cmdline);
@@ -169,6 +204,7 @@ int named_array_ptr_cmp(const void *aa, const void *bb);
 
 LDAPMod *attribute2mods(tattribute *attribute);
 LDAPMod **entry2mods(tentry *entry);
+LDAPMod **copy_mods(LDAPMod **mods);
 tattribute *entry_find_attribute(tentry *entry, char *ad, int createp);
 void attribute_append_value(tattribute *attribute, char *data, int n);
 int attribute_find_value(tattribute *attribute, char *data, int n);
@@ -178,6 +214,18 @@ struct berval *string2berval(GArray *s);
 struct berval *gstring2berval(GString *s);
 char *array2string(GArray *av);
 void xfree_berval(struct berval *bv);
+int carray_cmp(GArray *a, GArray *b);
+int carray_ptr_cmp(const void *aa, const void *bb);
+void *do_xalloc(size_t size, int category);
+char *do_xdup(char *str, int category);
+/* a file can define ALLOC_CATEGORY before including common.h */
+#ifndef ALLOC_CATEGORY
+#define ALLOC_CATEGORY ALLOC_OTHER
+#endif
+#define xalloc(size) do_xalloc(size, ALLOC_CATEGORY)
+#define xdup(str) do_xdup(str, ALLOC_CATEGORY)
+int adjoin_str(GPtrArray *, char *);
+int adjoin_ptr(GPtrArray *, void *);
 
 /*
  * parse.c
@@ -213,6 +261,8 @@ int read_modify(FILE *s, long offset, char **dn, LDAPMod ***mods);
 int read_delete(FILE *s, long offset, char **dn);
 int skip_entry(FILE *s, long offset, char **key);
 int read_profile(FILE *s, tentry **entry);
+int scan_entry(const char *map, long size, long *pos, long *start,
+	       const char **key, int *keylen);
 
 /*
  * diff.c
@@ -222,6 +272,9 @@ typedef int (*handler_rename)(int, char *, tentry *, void *);
 typedef int (*handler_add)(int, char *, LDAPMod **, void *);
 typedef int (*handler_delete)(int, char *, void *);
 typedef int (*handler_rename0)(int, char *, char *, int, void *);
+typedef int (*handler_nonleaf)(char *, int, void *);
+typedef int (*handler_delete_tree)(char **, int *, int, char *, void *);
+typedef int (*handler_entry)(char *, tentry *, void *);
 
 typedef struct thandler {
 	handler_change change;
@@ -229,6 +282,8 @@ typedef struct thandler {
 	handler_add add;
 	handler_delete delete;
 	handler_rename0 rename0;
+	handler_nonleaf nonleaf;	/* optional */
+	handler_delete_tree delete_tree; /* optional */
 } thandler;
 
 int compare_streams(
@@ -245,7 +300,22 @@ enum frob_rdn_mode {
 	FROB_RDN_CHECK, FROB_RDN_REMOVE, FROB_RDN_ADD, FROB_RDN_CHECK_NONE
 };
 int frob_rdn(tentry *entry, char *dn, int mode);
+int dn_depth(char *dn);
 int process_immediate(tparser *, thandler *, void *, FILE *, long, char *);
+int process_stream(FILE *, tparser *, thandler *, void *,
+		   handler_entry, void *, int, int);
+
+typedef struct tplan tplan;
+tplan *plan_new(FILE *data);
+void plan_free(tplan *plan);
+int plan_stale_p(tplan *plan, FILE *data);
+int plan_record(tplan *plan, tplan *old, tparser *parser,
+		thandler *handler, void *userdata, GArray *offsets,
+		FILE *clean, FILE *data, long *error_position,
+		long *syntax_error_position);
+int plan_replay(tplan *plan, tparser *parser, thandler *handler,
+		void *userdata, GArray *offsets, FILE *clean, FILE *data,
+		long *error_position);
 
 
 /*
@@ -260,12 +330,25 @@ typedef struct dialog {
 	char *value;
 } tdialog;
 
-int carray_cmp(GArray *a, GArray *b);
-int carray_ptr_cmp(const void *aa, const void *bb);
+#define LINE_INDEX_STEP (1 << 20)
+typedef struct tlineindex {
+	char *pathname;
+	GArray *offsets;
+	GArray *counts;
+	long pos;
+	long nl;
+	long last;
+	struct stat st;
+} tlineindex;
+
 void cp(char *src, char *dst, off_t skip, int append);
 void fcopy(FILE *src, FILE *dst);
 char choose(char *prompt, char *charbag, char *help);
 void edit_pos(char *pathname, long pos);
+long count_newlines(const char *ptr, size_t n);
+tlineindex *line_index_new(char *pathname, long pos, long nl);
+void line_index_note(tlineindex *index, const char *ptr, size_t n);
+void line_index_install(tlineindex *index);
 void edit(char *pathname, long line);
 void view(char *pathname);
 int pipeview(int *fd);
@@ -276,10 +359,6 @@ void write_ldapvi_history(void);
 char *ldapvi_getline(char *prompt, char *value);
 char *get_password();
 char *append(char *a, char *b);
-void *xalloc(size_t size);
-char *xdup(char *str);
-int adjoin_str(GPtrArray *, char *);
-int adjoin_ptr(GPtrArray *, void *);
 void init_dialog(tdialog *, enum dialog_mode, char *, char *);
 void dialog(char *header, tdialog *, int, int);
 
@@ -290,6 +369,9 @@ char *objectclass_name(LDAPObjectClass *);
 char *attributetype_name(LDAPAttributeType *);
 
 tschema *schema_new(LDAP *ld);
+char *subschema_dn(LDAP *ld, LDAPMessage *rootdse);
+int schema_request(LDAP *ld, char *dn);
+tschema *schema_receive(LDAP *ld, int msgid);
 void schema_free(tschema *schema);
 LDAPObjectClass *schema_get_objectclass(tschema *, char *);
 LDAPAttributeType *schema_get_attributetype(tschema *, char *);
@@ -302,6 +384,48 @@ LDAPAttributeType *entroid_get_attributetype(tentroid *, char *);
 LDAPObjectClass *entroid_request_class(tentroid *, char *);
 int entroid_remove_ad(tentroid *, char *);
 int compute_entroid(tentroid *);
+int get_entry_request(LDAP *ld, char *dn, char **attrs);
+LDAPMessage *get_entry_receive(LDAP *ld, int msgid, LDAPMessage **result);
+LDAPMessage *get_entry(LDAP *ld, char *dn, LDAPMessage **result);
+
+/*
+ * buffer.c
+ */
+#define OBUFFER_SIZE 65536
+
+typedef struct tobuffer {
+	FILE *s;
+	char *data;
+	size_t len;
+	size_t size;
+} tobuffer;
+
+#define obuffer_putc(b, c)					\
+	do {							\
+		if ((b)->len >= (b)->size) obuffer_flush(b);	\
+		(b)->data[(b)->len++] = (c);			\
+	} while (0)
+
+void obuffer_init(tobuffer *b, FILE *s);
+void obuffer_free(tobuffer *b);
+void obuffer_flush(tobuffer *b);
+char *obuffer_reserve(tobuffer *b, size_t n);
+void obuffer_write(tobuffer *b, const char *ptr, size_t n);
+void obuffer_puts(tobuffer *b, const char *str);
+void obuffer_printf(tobuffer *b, const char *fmt, ...);
+
+/*
+ * compress.c
+ */
+enum compress_method { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD };
+typedef struct tcompressor tcompressor;
+
+int compress_parse(char *arg, int *method, int *level);
+tcompressor *compressor_new(FILE *s, int method, int level);
+void compressor_write(tcompressor *c, const char *ptr, size_t n);
+void compressor_finish(tcompressor *c);
+int compressed_stream_p(FILE *s);
+void uncompress_copy(FILE *src, FILE *dst);
 
 /*
  * print.c
@@ -312,28 +436,39 @@ typedef enum t_print_binary_mode {
 extern t_print_binary_mode print_binary_mode;
 
 void print_ldapvi_entry(FILE *s, tentry *entry, char *key, tentroid *);
+void format_ldapvi_entry(tobuffer *, tentry *, char *key, tentroid *);
 void print_ldapvi_modify(FILE *s, char *dn, LDAPMod **mods);
 void print_ldapvi_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn);
 void print_ldapvi_add(FILE *s, char *dn, LDAPMod **mods);
 void print_ldapvi_delete(FILE *s, char *dn);
 void print_ldapvi_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn);
-void print_ldapvi_message(FILE *, LDAP *, LDAPMessage *, int key, tentroid *);
+void print_ldapvi_message(tobuffer *, tberentry *, int key, tentroid *);
 void print_ldif_entry(FILE *s, tentry *entry, char *key, tentroid *);
+void format_ldif_entry(tobuffer *, tentry *, char *key, tentroid *);
 void print_ldif_modify(FILE *s, char *dn, LDAPMod **mods);
 void print_ldif_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn);
 void print_ldif_add(FILE *s, char *dn, LDAPMod **mods);
 void print_ldif_delete(FILE *s, char *dn);
 void print_ldif_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn);
-void print_ldif_message(FILE *, LDAP *, LDAPMessage *, int key, tentroid *);
+void print_ldif_message(tobuffer *, tberentry *, int key, tentroid *);
 
 /*
  * search.c
  */
-void discover_naming_contexts(LDAP *ld, GPtrArray *basedns);
+#define PIPELINE_WORKERS 4
+
+void discover_naming_contexts(
+	LDAP *ld, LDAPMessage *rootdse, GPtrArray *basedns);
+void search_begin(LDAP *ld, cmdline *cmdline, LDAPControl **ctrls);
 GArray *search(
 	FILE *s, LDAP *ld, cmdline *cmdline, LDAPControl **ctrls, int notty,
-	int ldif);
-LDAPMessage *get_entry(LDAP *ld, char *dn, LDAPMessage **result);
+	int ldif, tlineindex *lineindex, tschema *schema);
+int pipeline_workers(void);
+void berentry_init(tberentry *entry);
+void berentry_read(tberentry *entry, LDAP *ld, LDAPMessage *message);
+void berentry_clear(tberentry *entry);
+void berentry_free(tberentry *entry);
+struct berval *berentry_values(tberentry *entry, char *ad);
 
 /*
  * port.c
@@ -347,7 +482,7 @@ int g_string_append_smd5(GString *string, char *key);
 /*
  * base64.c
  */
-void print_base64(unsigned char const *src, size_t srclength, FILE *s);
+void print_base64(unsigned char const *src, size_t srclength, tobuffer *b);
 void g_string_append_base64(
 	GString *string, unsigned char const *src, size_t srclength);
 int read_base64(char const *src, unsigned char *target, size_t targsize);
@@ -370,3 +505,50 @@ void finish_sasl_redirection(tsasl_defaults *);
 tsasl_defaults *sasl_defaults_new(bind_options *bind_options);
 void sasl_defaults_free(tsasl_defaults *sd);
 int ldapvi_sasl_interact(LDAP *ld, unsigned flags, void *defaults, void *p);
+
+/*
+ * stats.c
+ */
+enum stats_format { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+enum stats_phase {
+	STATS_CONNECT, STATS_SCHEMA, STATS_SEARCH, STATS_WRITE, STATS_EDITOR,
+	STATS_ANALYZE, STATS_COMMIT, STATS_NPHASES
+};
+
+enum stats_op {
+	STATS_ENTRY, STATS_MODIFY, STATS_ADD, STATS_DELETE, STATS_RENAME,
+	STATS_NOPS
+};
+
+enum alloc_category {
+	ALLOC_OTHER, ALLOC_PARSER, ALLOC_ENTRY, ALLOC_MODS, ALLOC_SCHEMA,
+	ALLOC_OUTPUT, ALLOC_POOL, ALLOC_NCATEGORIES
+};
+
+void stats_init(int format);
+void stats_begin(int phase);
+void stats_end(int phase);
+double stats_start(void);
+void stats_latency(int op, double start);
+void stats_count(tberentry *entry, long bytes);
+void stats_entry_created(void);
+void stats_alloc(int category, size_t size);
+
+
+/*
+ * pool.c
+ */
+void *pool_alloc(size_t size);
+void pool_free(void *ptr, size_t size);
+char *pool_dup(char *str);
+void pool_free_string(char *str);
+
+
+/*
+ * agent.c
+ */
+typedef LDAP *(*tconnector)(cmdline *, char *);
+
+LDAP *agent_connect(cmdline *cmdline);
+void agent_main(cmdline *cmdline, tconnector connector, char *dir);
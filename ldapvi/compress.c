@@ -0,0 +1,477 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ *
+ * Copyright (c) 2007 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define ALLOC_CATEGORY ALLOC_OUTPUT
+#include "common.h"
+#include "config.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Output is cut into blocks of COMPRESS_BLOCK_SIZE bytes, which worker
+ * threads compress independently: each block becomes one gzip member
+ * or one zstd frame.  Concatenations of those are valid files, which
+ * gunzip, zstd -d, and uncompress_copy() read as a whole.
+ *
+ * The caller fills one block at a time and writes finished blocks in
+ * order; the ring of COMPRESS_BLOCKS blocks bounds memory use.
+ */
+#define COMPRESS_BLOCK_SIZE (1 << 20)
+#define COMPRESS_BLOCKS 16
+#define COMPRESS_WORKERS 4
+
+enum block_state { BLOCK_EMPTY, BLOCK_FULL, BLOCK_DONE };
+
+typedef struct tblock {
+	enum block_state state;
+	char *in;
+	size_t inlen;
+	char *out;
+	size_t outlen;
+	size_t outsize;
+} tblock;
+
+struct tcompressor {
+	FILE *s;
+	int method;
+	int level;
+	tblock blocks[COMPRESS_BLOCKS];
+	int submitted;
+	int taken;
+	int written;
+	int finishing;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t workers[COMPRESS_WORKERS];
+	int nworkers;
+#endif
+};
+
+int
+compress_parse(char *arg, int *method, int *level)
+{
+	char *colon = strchr(arg, ':');
+	int n = colon ? colon - arg : strlen(arg);
+	int max;
+
+	if (n == 4 && !strncasecmp(arg, "gzip", 4)) {
+#ifndef HAVE_LIBZ
+		return -1;
+#else
+		*method = COMPRESS_GZIP;
+		*level = 6;
+		max = 9;
+#endif
+	} else if (n == 4 && !strncasecmp(arg, "zstd", 4)) {
+#ifndef HAVE_LIBZSTD
+		return -1;
+#else
+		*method = COMPRESS_ZSTD;
+		*level = 3;
+		max = ZSTD_maxCLevel();
+#endif
+	} else
+		return -1;
+
+	if (colon) {
+		char *end;
+		*level = strtol(colon + 1, &end, 10);
+		if (*end || end == colon + 1 || *level < 1 || *level > max)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+compress_block(tcompressor *c, tblock *block)
+{
+	switch (c->method) {
+#ifdef HAVE_LIBZ
+	case COMPRESS_GZIP: {
+		z_stream z;
+
+		memset(&z, 0, sizeof(z));
+		/* 16 + MAX_WBITS asks for a gzip header and trailer */
+		if (deflateInit2(&z, c->level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK)
+			abort();
+		block->outlen = deflateBound(&z, block->inlen) + 32;
+		if (block->outlen > block->outsize) {
+			free(block->out);
+			block->outsize = block->outlen;
+			block->out = xalloc(block->outsize);
+		}
+		z.next_in = (Bytef *) block->in;
+		z.avail_in = block->inlen;
+		z.next_out = (Bytef *) block->out;
+		z.avail_out = block->outsize;
+		if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+			abort();
+		block->outlen = z.total_out;
+		deflateEnd(&z);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case COMPRESS_ZSTD: {
+		size_t n = ZSTD_compressBound(block->inlen);
+
+		if (n > block->outsize) {
+			free(block->out);
+			block->outsize = n;
+			block->out = xalloc(block->outsize);
+		}
+		n = ZSTD_compress(block->out, block->outsize,
+				  block->in, block->inlen, c->level);
+		if (ZSTD_isError(n)) {
+			fprintf(stderr, "Error: zstd: %s\n",
+				ZSTD_getErrorName(n));
+			exit(1);
+		}
+		block->outlen = n;
+		break;
+	}
+#endif
+	default:
+		abort();
+	}
+}
+
+static void
+write_block(tcompressor *c, tblock *block)
+{
+	if (fwrite(block->out, 1, block->outlen, c->s) != block->outlen)
+		syserr();
+	block->inlen = 0;
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *
+compressor_worker(void *arg)
+{
+	tcompressor *c = arg;
+	tblock *block;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (c->taken == c->submitted && !c->finishing)
+			pthread_cond_wait(&c->work, &c->lock);
+		if (c->taken == c->submitted)
+			break;
+		block = &c->blocks[c->taken++ % COMPRESS_BLOCKS];
+		pthread_mutex_unlock(&c->lock);
+		compress_block(c, block);
+		pthread_mutex_lock(&c->lock);
+		block->state = BLOCK_DONE;
+		pthread_cond_signal(&c->done);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+/*
+ * Write blocks in order until LIMIT of them have been written, waiting
+ * for the workers as needed.
+ */
+static void
+write_blocks(tcompressor *c, int limit)
+{
+	tblock *block;
+
+	pthread_mutex_lock(&c->lock);
+	while (c->written < limit) {
+		block = &c->blocks[c->written % COMPRESS_BLOCKS];
+		if (block->state != BLOCK_DONE) {
+			pthread_cond_wait(&c->done, &c->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&c->lock);
+		write_block(c, block);
+		pthread_mutex_lock(&c->lock);
+		block->state = BLOCK_EMPTY;
+		c->written++;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void
+submit_block(tcompressor *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->blocks[c->submitted % COMPRESS_BLOCKS].state = BLOCK_FULL;
+	c->submitted++;
+	pthread_cond_signal(&c->work);
+	pthread_mutex_unlock(&c->lock);
+
+	/* make sure the next block is free */
+	write_blocks(c, c->submitted - COMPRESS_BLOCKS + 1);
+}
+#else
+static void
+submit_block(tcompressor *c)
+{
+	tblock *block = &c->blocks[0];
+	compress_block(c, block);
+	write_block(c, block);
+	c->submitted++;
+}
+#endif
+
+static tblock *
+current_block(tcompressor *c)
+{
+#ifdef HAVE_LIBPTHREAD
+	tblock *block = &c->blocks[c->submitted % COMPRESS_BLOCKS];
+#else
+	tblock *block = &c->blocks[0];
+#endif
+	if (!block->in)
+		block->in = xalloc(COMPRESS_BLOCK_SIZE);
+	return block;
+}
+
+tcompressor *
+compressor_new(FILE *s, int method, int level)
+{
+	tcompressor *c = xalloc(sizeof(tcompressor));
+#ifdef HAVE_LIBPTHREAD
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+#endif
+
+	memset(c, 0, sizeof(tcompressor));
+	c->s = s;
+	c->method = method;
+	c->level = level;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&c->lock, 0);
+	pthread_cond_init(&c->work, 0);
+	pthread_cond_init(&c->done, 0);
+	c->nworkers = n < 1 ? 1 : n > COMPRESS_WORKERS ? COMPRESS_WORKERS : n;
+	for (i = 0; i < c->nworkers; i++)
+		if (pthread_create(&c->workers[i], 0, compressor_worker, c))
+			syserr();
+#endif
+	return c;
+}
+
+void
+compressor_write(tcompressor *c, const char *ptr, size_t n)
+{
+	while (n) {
+		tblock *block = current_block(c);
+		size_t m = COMPRESS_BLOCK_SIZE - block->inlen;
+
+		if (m > n) m = n;
+		memcpy(block->in + block->inlen, ptr, m);
+		block->inlen += m;
+		ptr += m;
+		n -= m;
+		if (block->inlen == COMPRESS_BLOCK_SIZE)
+			submit_block(c);
+	}
+}
+
+/*
+ * Compress and write any remaining output, then free C.
+ */
+void
+compressor_finish(tcompressor *c)
+{
+	int i;
+
+	/* an empty file is not valid gzip, so write at least one block */
+	if (current_block(c)->inlen || !c->submitted)
+		submit_block(c);
+
+#ifdef HAVE_LIBPTHREAD
+	write_blocks(c, c->submitted);
+	pthread_mutex_lock(&c->lock);
+	c->finishing = 1;
+	pthread_cond_broadcast(&c->work);
+	pthread_mutex_unlock(&c->lock);
+	for (i = 0; i < c->nworkers; i++)
+		pthread_join(c->workers[i], 0);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->work);
+	pthread_cond_destroy(&c->done);
+#endif
+	if (fflush(c->s) == EOF) syserr();
+
+	for (i = 0; i < COMPRESS_BLOCKS; i++) {
+		free(c->blocks[i].in);
+		free(c->blocks[i].out);
+	}
+	free(c);
+}
+
+/*
+ * Look at the magic number of seekable stream S without moving it.
+ */
+int
+compressed_stream_p(FILE *s)
+{
+	unsigned char magic[4];
+	long pos = ftell(s);
+	int n;
+
+	if (pos == -1) syserr();
+	n = fread(magic, 1, sizeof(magic), s);
+	if (ferror(s)) syserr();
+	if (fseek(s, pos, SEEK_SET) == -1) syserr();
+
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return COMPRESS_GZIP;
+	if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5
+	    && magic[2] == 0x2f && magic[3] == 0xfd)
+		return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+#ifdef HAVE_LIBZ
+static void
+gunzip_stream(FILE *src, FILE *dst, unsigned char *head, int nhead)
+{
+	unsigned char in[65536];
+	unsigned char out[65536];
+	z_stream z;
+	int rc = Z_STREAM_END;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) abort();
+	memcpy(in, head, nhead);
+	z.next_in = in;
+	z.avail_in = nhead;
+	for (;;) {
+		if (!z.avail_in) {
+			z.avail_in = fread(in, 1, sizeof(in), src);
+			if (ferror(src)) syserr();
+			z.next_in = in;
+			if (!z.avail_in) break;
+		}
+		/* concatenated members: start over after each one */
+		if (rc == Z_STREAM_END && z.total_in)
+			if (inflateReset(&z) != Z_OK) abort();
+		z.next_out = out;
+		z.avail_out = sizeof(out);
+		rc = inflate(&z, Z_NO_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			fprintf(stderr, "Error: gzip: %s\n",
+				z.msg ? z.msg : "invalid data");
+			exit(1);
+		}
+		if (fwrite(out, 1, sizeof(out) - z.avail_out, dst)
+		    != sizeof(out) - z.avail_out)
+			syserr();
+	}
+	if (rc != Z_STREAM_END) {
+		fputs("Error: gzip: unexpected end of file\n", stderr);
+		exit(1);
+	}
+	inflateEnd(&z);
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static void
+unzstd_stream(FILE *src, FILE *dst, unsigned char *head, int nhead)
+{
+	size_t insize = ZSTD_DStreamInSize();
+	size_t outsize = ZSTD_DStreamOutSize();
+	char *inbuf = xalloc(insize);
+	char *outbuf = xalloc(outsize);
+	ZSTD_DStream *z = ZSTD_createDStream();
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t rc = 0;
+
+	ZSTD_initDStream(z);
+	memcpy(inbuf, head, nhead);
+	in.src = inbuf;
+	in.size = nhead;
+	in.pos = 0;
+	for (;;) {
+		if (in.pos == in.size) {
+			in.size = fread(inbuf, 1, insize, src);
+			if (ferror(src)) syserr();
+			in.pos = 0;
+			if (!in.size) break;
+		}
+		out.dst = outbuf;
+		out.size = outsize;
+		out.pos = 0;
+		rc = ZSTD_decompressStream(z, &out, &in);
+		if (ZSTD_isError(rc)) {
+			fprintf(stderr, "Error: zstd: %s\n",
+				ZSTD_getErrorName(rc));
+			exit(1);
+		}
+		if (fwrite(outbuf, 1, out.pos, dst) != out.pos) syserr();
+	}
+	if (rc) {
+		fputs("Error: zstd: unexpected end of file\n", stderr);
+		exit(1);
+	}
+	ZSTD_freeDStream(z);
+	free(inbuf);
+	free(outbuf);
+}
+#endif
+
+/*
+ * Copy SRC to DST like fcopy(), decompressing gzip or zstd input.
+ * SRC need not be seekable.
+ */
+void
+uncompress_copy(FILE *src, FILE *dst)
+{
+	unsigned char head[4];
+	int n = fread(head, 1, sizeof(head), src);
+
+	if (ferror(src)) syserr();
+	if (n >= 2 && head[0] == 0x1f && head[1] == 0x8b) {
+#ifdef HAVE_LIBZ
+		gunzip_stream(src, dst, head, n);
+		return;
+#else
+		yourfault("Cannot read gzip input, compiled without zlib.");
+#endif
+	}
+	if (n == 4 && head[0] == 0x28 && head[1] == 0xb5
+	    && head[2] == 0x2f && head[3] == 0xfd)
+	{
+#ifdef HAVE_LIBZSTD
+		unzstd_stream(src, dst, head, n);
+		return;
+#else
+		yourfault("Cannot read zstd input, compiled without libzstd.");
+#endif
+	}
+	if (fwrite(head, 1, n, dst) != n) syserr();
+	fcopy(src, dst);
+}
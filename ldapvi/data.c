@@ -15,12 +15,13 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define ALLOC_CATEGORY ALLOC_ENTRY
 #include "common.h"
 
 static named_array *
 named_array_new(char *name)
 {
-	named_array *result = xalloc(sizeof(named_array));
+	named_array *result = pool_alloc(sizeof(named_array));
 	result->name = name;
 	result->array = g_ptr_array_new();
 	return result;
@@ -29,9 +30,8 @@ named_array_new(char *name)
 static void
 named_array_free(named_array *na)
 {
-	free(na->name);
 	g_ptr_array_free(na->array, 1);
-	free(na);
+	pool_free(na, sizeof(named_array));
 }
 
 static int
@@ -54,6 +54,7 @@ named_array_ptr_cmp(const void *aa, const void *bb)
 tentry *
 entry_new(char *dn)
 {
+	stats_entry_created();
 	return (tentry *) named_array_new(dn);
 }
 
@@ -66,6 +67,7 @@ entry_free(tentry *entry)
 
 	for (i = 0; i < n; i++)
 		attribute_free(g_ptr_array_index(attributes, i));
+	free(entry_dn(entry));
 	named_array_free((named_array *) entry);
 }
 
@@ -82,6 +84,9 @@ entry_cmp(tentry *e, tentry *f)
 /*
  * attribute
  */
+/*
+ * AD must come from pool_dup().
+ */
 tattribute *
 attribute_new(char *ad)
 {
@@ -97,6 +102,7 @@ attribute_free(tattribute *attribute)
 
 	for (i = 0; i < n; i++)
 		g_array_free(g_ptr_array_index(values, i), 1);
+	pool_free_string(attribute_ad(attribute));
 	named_array_free((named_array *) attribute);
 }
 
@@ -125,7 +131,7 @@ entry_find_attribute(tentry *entry, char *ad, int createp)
 		}
 	}
 	if (!attribute && createp) {
-		attribute = attribute_new(xdup(ad));
+		attribute = attribute_new(pool_dup(ad));
 		g_ptr_array_add(attributes, attribute);
 	}
 
@@ -135,7 +141,8 @@ entry_find_attribute(tentry *entry, char *ad, int createp)
 void
 attribute_append_value(tattribute *attribute, char *data, int n)
 {
-	GArray *value = g_array_sized_new(0, 0, 1, n);
+	/* zero-terminated, so that names can be used as C strings */
+	GArray *value = g_array_sized_new(1, 0, 1, n);
 	g_array_append_vals(value, data, n);
 	g_ptr_array_add(attribute_values(attribute), value);
 }
@@ -162,6 +169,80 @@ attribute_remove_value(tattribute *a, char *data, int n)
 	return 0;
 }
 
+int
+carray_cmp(GArray *a, GArray *b)
+{
+	int d = memcmp(a->data, b->data, MIN(a->len, b->len));
+	if (d) return d;
+	if (a->len < b->len)
+		return -1;
+	else if (a->len == b->len)
+		return 0;
+	else
+		return 1;
+}
+
+int
+carray_ptr_cmp(const void *aa, const void *bb)
+{
+	GArray *a = *((GArray **) aa);
+	GArray *b = *((GArray **) bb);
+	return carray_cmp(a ,b);
+}
+
+/*
+ * Use xalloc() and xdup() instead, which pass the ALLOC_CATEGORY of the
+ * calling file for --stats.
+ */
+void *
+do_xalloc(size_t size, int category)
+{
+	void *result = malloc(size);
+	if (!result) {
+		write(2, "\nmalloc error\n", sizeof("\nmalloc error\n") - 1);
+		_exit(2);
+	}
+	stats_alloc(category, size);
+	return result;
+}
+
+char *
+do_xdup(char *str, int category)
+{
+	char *result;
+
+	if (!str)
+		return str;
+	if (!(result = strdup(str))) {
+		write(2, "\nstrdup error\n", sizeof("\nstrdup error\n") - 1);
+		_exit(2);
+	}
+	stats_alloc(category, strlen(str) + 1);
+	return result;
+}
+
+int
+adjoin_str(GPtrArray *strs, char *str)
+{
+	int i;
+	for (i = 0; i < strs->len; i++)
+		if (!strcmp(str, g_ptr_array_index(strs, i)))
+			return -1;
+	g_ptr_array_add(strs, str);
+	return i;
+}
+
+int
+adjoin_ptr(GPtrArray *a, void *p)
+{
+	int i;
+	for (i = 0; i < a->len; i++)
+		if (g_ptr_array_index(a, i) == p)
+			return -1;
+	g_ptr_array_add(a, p);
+	return i;
+}
+
 /*
  * Aus irgendwelchen Gruenden habe ich mal beschlossen, GArrays mit chars drin
  * statt GStrings zu nehmen fuer die Attributwerte.  Wie unpraktisch.
@@ -239,3 +320,40 @@ entry2mods(tentry *entry)
 	result[i] = 0;
 	return result;
 }
+
+/*
+ * Return a deep copy of MODS, which must use LDAP_MOD_BVALUES.
+ */
+LDAPMod **
+copy_mods(LDAPMod **mods)
+{
+	LDAPMod **result;
+	int i, j;
+
+	for (i = 0; mods[i]; i++)
+		;
+	result = xalloc((i + 1) * sizeof(LDAPMod *));
+	for (i = 0; mods[i]; i++) {
+		LDAPMod *m = mods[i];
+		LDAPMod *n = xalloc(sizeof(LDAPMod));
+
+		n->mod_op = m->mod_op;
+		n->mod_type = xdup(m->mod_type);
+		n->mod_bvalues = 0;
+		if (m->mod_bvalues) {
+			for (j = 0; m->mod_bvalues[j]; j++)
+				;
+			n->mod_bvalues
+				= xalloc((j + 1) * sizeof(struct berval *));
+			for (j = 0; m->mod_bvalues[j]; j++) {
+				struct berval *bv = m->mod_bvalues[j];
+				n->mod_bvalues[j]
+					= dup2berval(bv->bv_val, bv->bv_len);
+			}
+			n->mod_bvalues[j] = 0;
+		}
+		result[i] = n;
+	}
+	result[i] = 0;
+	return result;
+}
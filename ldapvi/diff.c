@@ -15,8 +15,11 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#include <sys/mman.h>
+#define ALLOC_CATEGORY ALLOC_MODS
 #include "common.h"
 #include "config.h"
+#include "probes.h"
 
 typedef void (*note_function)(void *, void *, void *);
 
@@ -112,7 +115,7 @@ note_attributes(tattribute *a1, tattribute *a2, GPtrArray *mods)
 }
 
 static LDAPMod **
-compare_entries(tentry *eclean, tentry *enew)
+compare_entries(int key, tentry *eclean, tentry *enew)
 {
 	GPtrArray *mods = g_ptr_array_new();
 	compare_ptr_arrays(entry_attributes(eclean),
@@ -120,6 +123,7 @@ compare_entries(tentry *eclean, tentry *enew)
 			   named_array_ptr_cmp,
 			   (note_function) note_attributes,
 			   mods);
+	PROBE3(diff__mods, key, strlen(entry_dn(enew)), mods->len);
 	if (!mods->len) {
 		g_ptr_array_free(mods, 1);
 		return 0;
@@ -329,6 +333,194 @@ update_clean_copy(
 	p->print(s, cleanentry, key, 0);
 }
 
+/*
+ * Return the DN of the superior of DN, as a pointer into DN, or 0 for a
+ * single RDN.
+ */
+static char *
+dn_parent(char *dn)
+{
+	for (; *dn; dn++)
+		if (*dn == '\\') {
+			if (dn[1]) dn++;
+		} else if (*dn == ',')
+			return dn + 1;
+	return 0;
+}
+
+int
+dn_depth(char *dn)
+{
+	int n = 1;
+	while ( (dn = dn_parent(dn))) n++;
+	return n;
+}
+
+/*
+ * Renaming an entry moves its subtree along with it.  When a branch is
+ * renamed in the editor, its entries below all get new DNs, but only
+ * the root needs a moddn request, so we remember each rename and, before
+ * comparing an entry, rewrite its clean DN to where the renames done so
+ * far have taken it.  Entries below a renamed root then show no rename
+ * of their own, just their attribute changes.
+ *
+ * Renames are applied in the order they happened, each at most once: an
+ * entry moved into a subtree that is renamed later was not in it yet.
+ */
+typedef struct tmove {
+	char *olddn;
+	char *newdn;
+	int n;
+	struct tmove *next;	/* later rename of the same DN */
+} tmove;
+
+typedef struct tsubtrees {
+	GHashTable *table;	/* old DN -> first tmove */
+	GPtrArray *moves;
+} tsubtrees;
+
+static tsubtrees *
+subtrees_new(void)
+{
+	tsubtrees *s = xalloc(sizeof(tsubtrees));
+	s->table = g_hash_table_new(g_str_hash, g_str_equal);
+	s->moves = g_ptr_array_new();
+	return s;
+}
+
+static void
+subtrees_free(tsubtrees *s)
+{
+	int i;
+
+	for (i = 0; i < s->moves->len; i++) {
+		tmove *m = g_ptr_array_index(s->moves, i);
+		free(m->olddn);
+		free(m->newdn);
+		free(m);
+	}
+	g_ptr_array_free(s->moves, 1);
+	g_hash_table_destroy(s->table);
+	free(s);
+}
+
+static void
+subtrees_note(tsubtrees *s, char *olddn, char *newdn)
+{
+	tmove *m = xalloc(sizeof(tmove));
+	tmove *prev;
+
+	m->olddn = xdup(olddn);
+	m->newdn = xdup(newdn);
+	m->n = s->moves->len;
+	m->next = 0;
+	g_ptr_array_add(s->moves, m);
+	if ( (prev = g_hash_table_lookup(s->table, olddn))) {
+		while (prev->next) prev = prev->next;
+		prev->next = m;
+	} else
+		g_hash_table_insert(s->table, m->olddn, m);
+}
+
+/*
+ * Return the DN that renames of superior entries have given DN, or 0 if
+ * there were none.
+ */
+static char *
+subtrees_moved_dn(tsubtrees *s, char *dn)
+{
+	char *cur = dn;
+	int last = -1;
+
+	if (!s->moves->len)
+		return 0;
+	for (;;) {
+		tmove *best = 0;
+		char *at = 0;
+		char *ptr;
+		char *new;
+
+		/* the earliest rename not applied yet of any superior */
+		for (ptr = dn_parent(cur); ptr; ptr = dn_parent(ptr)) {
+			tmove *m;
+			for (m = g_hash_table_lookup(s->table, ptr);
+			     m;
+			     m = m->next)
+				if (m->n > last) {
+					if (!best || m->n < best->n) {
+						best = m;
+						at = ptr;
+					}
+					break;
+				}
+		}
+		if (!best)
+			break;
+		new = xalloc(at - cur + strlen(best->newdn) + 1);
+		memcpy(new, cur, at - cur);
+		strcpy(new + (at - cur), best->newdn);
+		if (cur != dn) free(cur);
+		cur = new;
+		last = best->n;
+	}
+	return cur == dn ? 0 : cur;
+}
+
+/*
+ * Give ENTRY the DN it has now.  Return 1 if that changed it, else 0.
+ */
+static int
+subtrees_move_entry(tsubtrees *s, tentry *entry)
+{
+	char *dn = subtrees_moved_dn(s, entry_dn(entry));
+
+	if (!dn)
+		return 0;
+	free(entry_dn(entry));
+	entry_dn(entry) = dn;
+	return 1;
+}
+
+/*
+ * After a handler failure, rewrite the clean copies of all entries not
+ * processed yet that have been moved, so that the next attempt looks
+ * for them in the right place.  Clean copies found at CLEANEND or later
+ * were written during this run and are up to date already.
+ */
+static void
+subtrees_update_clean(tparser *p, tsubtrees *s, GArray *offsets,
+		      FILE *clean, long cleanend)
+{
+	tentry *cleanentry;
+	char key[32];
+	long pos;
+	int n;
+
+	if (!s->moves->len)
+		return;
+	for (n = 0; n < offsets->len; n++) {
+		pos = g_array_index(offsets, long, n);
+		if (pos < 0 || pos >= cleanend)
+			continue;
+		if (p->entry(clean, pos, 0, &cleanentry, 0) == -1) abort();
+		if (subtrees_move_entry(s, cleanentry)) {
+			sprintf(key, "%d", n);
+			update_clean_copy(offsets, key, clean, cleanentry, p);
+		}
+		entry_free(cleanentry);
+	}
+}
+
+static long
+file_end(FILE *s)
+{
+	long pos;
+
+	if (fseek(s, 0, SEEK_END) == -1) syserr();
+	if ( (pos = ftell(s)) == -1) syserr();
+	return pos;
+}
+
 /*
  * read a changerecord of type `key' from `data', handle it, and return
  *    0 on success
@@ -401,13 +593,14 @@ process_immediate(tparser *p, thandler *handler, void *userdata, FILE *data,
 	} else if (!strcmp(key, "modify")) {
 		char *dn;
 		LDAPMod **mods;
+		int rc;
 		if (p->modify(data, datapos, &dn, &mods) ==-1)
 			return -1;
-		if (handler->change(-1, dn, dn, mods, userdata) == -1) {
-			free(dn);
-			ldap_mods_free(mods, 1);
+		rc = handler->change(-1, dn, dn, mods, userdata);
+		free(dn);
+		ldap_mods_free(mods, 1);
+		if (rc == -1)
 			return -2;
-		}
 	} else {
 		fprintf(stderr, "Error: Invalid key: `%s'.\n", key);
 		return -1;
@@ -415,6 +608,252 @@ process_immediate(tparser *p, thandler *handler, void *userdata, FILE *data,
 	return 0;
 }
 
+/*
+ * Modify records for the same DN, as generated by feeds, are merged into
+ * a single modify request.  Up to MODIFY_WINDOW DNs can be waiting for
+ * more records at a time; other records flush all of them first, so
+ * that modifications only move ahead of modifications of other entries.
+ *
+ * The merged request succeeds or fails as a whole, which is why ldapvi
+ * does not merge with --continuous.
+ */
+#define MODIFY_WINDOW 16
+
+typedef struct tpending {
+	char *dn;
+	char *key;		/* for spotting other spellings of DN */
+	GPtrArray *mods;
+} tpending;
+
+static int
+strcmp_pointers(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * Without the schema we cannot tell whether two spellings of a DN name
+ * the same entry, e.g. with cn and commonName, or with different escapes.
+ * So the key of a DN is just its unescaped attribute values in lower
+ * case, RDN by RDN.  We only merge records for DNs spelled the same, but
+ * keep the order of all DNs with the same key.  DNs that do not parse
+ * are keyed as they are, in lower case.
+ */
+static char *
+pending_key(char *dn)
+{
+	GString *key = g_string_new("");
+	GPtrArray *values = g_ptr_array_new();
+#ifdef LIBLDAP21
+	LDAPDN *ldn = 0;
+#else
+	LDAPDN ldn = 0;
+#endif
+	LDAPRDN rdn;
+	char *result;
+	int i, j;
+
+	safe_str2dn(dn, &ldn, LDAP_DN_FORMAT_LDAPV3);
+	if (!ldn)
+		g_string_assign(key, dn);
+	for (i = 0; ldn; i++) {
+#ifdef LIBLDAP21
+		rdn = (**ldn)[i];
+#else
+		rdn = ldn[i];
+#endif
+		if (!rdn)
+			break;
+		for (j = 0; rdn[j]; j++) {
+			struct berval *bv = &rdn[j]->la_value;
+			char *value = xalloc(bv->bv_len + 1);
+			memcpy(value, bv->bv_val, bv->bv_len);
+			value[bv->bv_len] = 0;
+			g_ptr_array_add(values, value);
+		}
+		/* the order of AVAs within an RDN does not matter */
+		qsort(values->pdata, values->len, sizeof(char *),
+		      strcmp_pointers);
+		for (j = 0; j < values->len; j++) {
+			g_string_append(key, g_ptr_array_index(values, j));
+			g_string_append_c(key, '+');
+			free(g_ptr_array_index(values, j));
+		}
+		g_ptr_array_set_size(values, 0);
+		g_string_append_c(key, ',');
+	}
+	if (ldn)
+		ldap_dnfree(ldn);
+	g_ptr_array_free(values, 1);
+
+	for (i = 0; i < key->len; i++)
+		key->str[i] = tolower((unsigned char) key->str[i]);
+	result = xdup(key->str);
+	g_string_free(key, 1);
+	return result;
+}
+
+/*
+ * Pass PENDING to HANDLER, unless it is null, and free it.
+ */
+static int
+flush_modify(thandler *handler, void *userdata, tpending *pending)
+{
+	int rc = 0;
+
+	g_ptr_array_add(pending->mods, 0);
+	if (handler && pending->mods->len > 1
+	    && handler->change(-1,
+			       pending->dn,
+			       pending->dn,
+			       (LDAPMod **) pending->mods->pdata,
+			       userdata)
+	    == -1)
+		rc = -2;
+	ldap_mods_free((LDAPMod **) pending->mods->pdata, 0);
+	g_ptr_array_free(pending->mods, 1);
+	free(pending->dn);
+	free(pending->key);
+	free(pending);
+	return rc;
+}
+
+/*
+ * Pass the first N modifications waiting in WINDOW to HANDLER.  After
+ * an error, or if HANDLER is null, just drop them.
+ */
+static int
+flush_window(thandler *handler, void *userdata, GPtrArray *window, int n)
+{
+	int rc = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		tpending *pending = g_ptr_array_index(window, i);
+		if (rc)
+			flush_modify(0, 0, pending);
+		else
+			rc = flush_modify(handler, userdata, pending);
+	}
+	while (n--)
+		g_ptr_array_remove_index(window, 0);
+	return rc;
+}
+
+/*
+ * Add the modification of DN by MODS to WINDOW, taking ownership of
+ * both.
+ */
+static int
+queue_modify(thandler *handler, void *userdata, GPtrArray *window,
+	     char *dn, LDAPMod **mods)
+{
+	char *key = pending_key(dn);
+	tpending *pending;
+	int rc = 0;
+	int i;
+
+	for (i = 0; i < window->len; i++) {
+		pending = g_ptr_array_index(window, i);
+		if (strcmp(pending->key, key))
+			continue;
+		if (!strcmp(pending->dn, dn)) {
+			free(key);
+			free(dn);
+			for (i = 0; mods[i]; i++)
+				g_ptr_array_add(pending->mods, mods[i]);
+			free(mods);
+			return 0;
+		}
+		rc = flush_window(handler, userdata, window, i + 1);
+		break;
+	}
+	if (!rc && window->len == MODIFY_WINDOW)
+		rc = flush_window(handler, userdata, window, 1);
+
+	pending = xalloc(sizeof(tpending));
+	pending->dn = dn;
+	pending->key = key;
+	pending->mods = g_ptr_array_new();
+	for (i = 0; mods[i]; i++)
+		g_ptr_array_add(pending->mods, mods[i]);
+	free(mods);
+	g_ptr_array_add(window, pending);
+	return rc;
+}
+
+/*
+ * Read all records of IN.  Pass numbered entries to HENTRY, if given,
+ * and change records to HANDLER.  If ADDP is false, "add" records are
+ * treated as "replace".  If COALESCE is true, modify records for the
+ * same DN are merged as described above.  Return
+ *    0 on success
+ *   -1 on syntax error
+ *   -2 on handler error
+ */
+int
+process_stream(FILE *in, tparser *p, thandler *handler, void *userdata,
+	       handler_entry hentry, void *entrydata, int addp, int coalesce)
+{
+	GPtrArray *window = g_ptr_array_new();
+	char *key = 0;
+	char *ptr;
+	int rc = 0;
+
+	while (!rc) {
+		long pos;
+
+		if (p->peek(in, -1, &key, &pos) == -1) {
+			rc = -1;
+			break;
+		}
+		if (!key) {
+			rc = flush_window(
+				handler, userdata, window, window->len);
+			break;
+		}
+
+		if (coalesce && !strcmp(key, "modify")) {
+			char *dn;
+			LDAPMod **mods;
+			if (p->modify(in, pos, &dn, &mods) == -1)
+				rc = -1;
+			else
+				rc = queue_modify(
+					handler, userdata, window, dn, mods);
+			free(key);
+			key = 0;
+			continue;
+		}
+		rc = flush_window(handler, userdata, window, window->len);
+		if (rc)
+			break;
+
+		strtol(key, &ptr, 10);
+		if (!*ptr) {
+			tentry *entry;
+			if (p->entry(in, pos, 0, &entry, 0) == -1)
+				rc = -1;
+			else {
+				if (hentry && hentry(key, entry, entrydata))
+					rc = -2;
+				entry_free(entry);
+			}
+		} else {
+			char *k = key;
+			if (!strcmp(key, "add") && !addp)
+				k = "replace";
+			rc = process_immediate(p, handler, userdata, in, pos, k);
+		}
+		free(key);
+		key = 0;
+	}
+	if (key) free(key);
+	flush_window(0, 0, window, window->len);
+	g_ptr_array_free(window, 1);
+	return rc;
+}
+
 /*
  * read the next entry from `data', its clean copy from `clean', process
  * them as described for compare_streams, and return
@@ -425,7 +864,7 @@ process_immediate(tparser *p, thandler *handler, void *userdata, FILE *data,
 static int
 process_next_entry(
 	tparser *p, thandler *handler, void *userdata, GArray *offsets,
-	FILE *clean, FILE *data, char *key, long datapos)
+	FILE *clean, FILE *data, char *key, long datapos, tsubtrees *subtrees)
 {
 	tentry *entry = 0;
 	tentry *cleanentry = 0;
@@ -459,6 +898,7 @@ process_next_entry(
 		if (next >= 0
 		    && !fastcmp(clean, data, pos, datapos, next-pos+1))
 		{
+			PROBE3(diff__fastpath, n, 1, next - pos + 1);
 			datapos += next - pos;
 			long_array_invert(offsets, n);
 			if (fseek(data, datapos, SEEK_SET) == -1)
@@ -469,9 +909,11 @@ process_next_entry(
 
 	/* if we get here, a quick scan found a difference in the
 	 * files, so we need to read the entries and compare them */
+	PROBE3(diff__fastpath, n, 0, 0);
 	if (p->entry(data, datapos, 0, &entry, 0) == -1)
 		goto cleanup;
 	if (p->entry(clean, pos, 0, &cleanentry, 0) == -1) abort();
+	subtrees_move_entry(subtrees, cleanentry);
 
 	/* compare and update */
 	if ( (rename = strcmp(entry_dn(cleanentry), entry_dn(entry)))){
@@ -485,9 +927,10 @@ process_next_entry(
 			rc = -2;
 			goto cleanup;
 		}
+		subtrees_note(subtrees, entry_dn(cleanentry), entry_dn(entry));
 		rename_entry(cleanentry, entry_dn(entry), deleteoldrdn);
 	}
-	if ( (mods = compare_entries(cleanentry, entry))) {
+	if ( (mods = compare_entries(n, cleanentry, entry))) {
 		if (handler->change(n,
 				    entry_dn(cleanentry),
 				    entry_dn(entry),
@@ -524,42 +967,127 @@ cleanup:
 	return rc;
 }
 
+/*
+ * Ask the handler what to do about a non-leaf entry that could not be
+ * deleted: 0 to give up, 1 to go on with the other deletions, 2 to go
+ * on and skip further non-leaf entries without asking.  Without a
+ * nonleaf callback, go on and retry them after the others.
+ */
 static int
-nonleaf_action(tentry *entry, GArray *offsets, int n)
+nonleaf_action(thandler *handler, void *userdata, char *dn, int more)
 {
-	int i;
+	if (!handler->nonleaf)
+		return 2;
+	return handler->nonleaf(dn, more, userdata);
+}
 
-	printf("Error: Cannot delete non-leaf entry: %s\n", entry_dn(entry));
+typedef struct tdeletion {
+	int n;
+	int depth;
+	char *dn;
+} tdeletion;
 
-	for (i = n + 1; i < offsets->len; i++) {
-		if (g_array_index(offsets, long, n) >= 0)
-			goto more_deletions;
+/* subordinates first, else by key */
+static int
+deletion_cmp(const void *a, const void *b)
+{
+	const tdeletion *x = a;
+	const tdeletion *y = b;
+
+	if (x->depth != y->depth)
+		return y->depth - x->depth;
+	return x->n - y->n;
+}
+
+/*
+ * Is any of DELETIONS from index I on still to be done?
+ */
+static int
+pending_p(GArray *offsets, GArray *deletions, int i)
+{
+	for (; i < deletions->len; i++) {
+		tdeletion *d = &g_array_index(deletions, tdeletion, i);
+		if (g_array_index(offsets, long, d->n) >= 0)
+			return 1;
 	}
-	/* no more deletions anyway, so no need to ignore this one */
 	return 0;
+}
 
-more_deletions:
-	switch (choose("Continue?", "yn!Q?", "(Type '?' for help.)")) {
-	case 'y':
-		return 1;
-	case '!':
-		return 2;
-	case 'n':
-		return 0;
-	case 'Q':
-		exit(0);
-	case '?':
-		puts("Commands:\n"
-		     "  y -- continue deleting other entries\n"
-		     "  ! -- continue and assume 'y' until done\n"
-		     "  n -- abort deletions\n"
-		     "  Q -- discard changes and quit\n"
-		     "  ? -- this help");
-		goto more_deletions;
-	}
-
-	/* notreached */
-	return 0;
+/*
+ * Hand each branch whose entries all are to be deleted, as far as the
+ * clean copy knows, to handler->delete_tree, and mark the entries it
+ * got rid of as done.  DELETIONS are sorted as by deletion_cmp(), so
+ * that the root of each branch comes after its subordinates.
+ *
+ * Return -1 if the handler failed, else 0.
+ */
+static int
+delete_trees(thandler *handler, void *userdata, GArray *offsets,
+	     GArray *deletions)
+{
+	GHashTable *index = g_hash_table_new(g_str_hash, g_str_equal);
+	int len = deletions->len;
+	int *root = xalloc(len * sizeof(int));
+	int *first = xalloc(len * sizeof(int));
+	int *last = xalloc(len * sizeof(int));
+	int *next = xalloc(len * sizeof(int));
+	char **dns = xalloc(len * sizeof(char *));
+	int *keys = xalloc(len * sizeof(int));
+	char *done = xalloc(len);
+	int rc = 0;
+	int i, j, m;
+
+	for (i = 0; i < len; i++) {
+		tdeletion *d = &g_array_index(deletions, tdeletion, i);
+		g_hash_table_insert(index, d->dn, GINT_TO_POINTER(i + 1));
+	}
+
+	/* the uppermost deleted superior of each entry, linked by root */
+	for (i = 0; i < len; i++)
+		first[i] = -1;
+	for (i = 0; i < len; i++) {
+		tdeletion *d = &g_array_index(deletions, tdeletion, i);
+		char *ptr;
+
+		root[i] = i;
+		for (ptr = dn_parent(d->dn); ptr; ptr = dn_parent(ptr))
+			if ( (j = GPOINTER_TO_INT(
+				       g_hash_table_lookup(index, ptr))))
+				root[i] = j - 1;
+		next[i] = -1;
+		if (first[root[i]] == -1)
+			first[root[i]] = i;
+		else
+			next[last[root[i]]] = i;
+		last[root[i]] = i;
+	}
+
+	for (i = 0; i < len && rc != -1; i++) {
+		if (first[i] == -1 || next[first[i]] == -1)
+			continue;
+		m = 0;
+		for (j = first[i]; j != -1; j = next[j]) {
+			tdeletion *d = &g_array_index(deletions, tdeletion, j);
+			dns[m] = d->dn;
+			keys[m] = d->n;
+			m++;
+		}
+		memset(done, 0, m);
+		rc = handler->delete_tree(dns, keys, m, done, userdata);
+		for (j = 0; j < m; j++)
+			if (done[j])
+				long_array_invert(offsets, keys[j]);
+	}
+
+	g_hash_table_destroy(index);
+	free(root);
+	free(first);
+	free(last);
+	free(next);
+	free(dns);
+	free(keys);
+	free(done);
+	return rc == -1 ? -1 : 0;
 }
 
 /*
@@ -571,44 +1099,73 @@ process_deletions(tparser *p,
 		  thandler *handler,
 		  void *userdata,
 		  GArray *offsets,
-		  FILE *clean)
+		  FILE *clean,
+		  tsubtrees *subtrees)
 {
-	tentry *cleanentry = 0;
+	GArray *deletions = g_array_new(0, 0, sizeof(tdeletion));
+	tentry *cleanentry;
+	tdeletion del;
 	long pos;
-	int n;
+	int i;
 	int ignore_nonleaf = 0;
 	int n_leaf;
-	int n_nonleaf;
+	int n_nonleaf = 0;
+	int rc = 0;
+
+	for (del.n = 0; del.n < offsets->len; del.n++) {
+		if ( (pos = g_array_index(offsets, long, del.n)) < 0)
+			continue;
+		if (p->entry(clean, pos, 0, &cleanentry, 0) == -1)
+			abort();
+		subtrees_move_entry(subtrees, cleanentry);
+		del.dn = xdup(entry_dn(cleanentry));
+		del.depth = dn_depth(del.dn);
+		g_array_append_val(deletions, del);
+		entry_free(cleanentry);
+	}
+	qsort(deletions->data, deletions->len, sizeof(tdeletion),
+	      deletion_cmp);
+
+	if (handler->delete_tree
+	    && delete_trees(handler, userdata, offsets, deletions) == -1)
+	{
+		rc = -2;
+		goto cleanup;
+	}
 
 	do {
-		if (ignore_nonleaf)
+		if (ignore_nonleaf && handler->nonleaf)
 			printf("Retrying %d failed deletion%s...\n",
 			       n_nonleaf,
 			       n_nonleaf == 1 ? "" : "s");
 		n_leaf = 0;
 		n_nonleaf = 0;
-		for (n = 0; n < offsets->len; n++) {
-			if ( (pos = g_array_index(offsets, long, n)) < 0)
+		for (i = 0; i < deletions->len; i++) {
+			tdeletion *d = &g_array_index(deletions, tdeletion, i);
+
+			if (g_array_index(offsets, long, d->n) < 0)
 				continue;
-			if (p->entry(clean, pos, 0, &cleanentry, 0) == -1)
-				abort();
-			switch (handler->delete(
-					n, entry_dn(cleanentry), userdata))
-			{
+			switch (handler->delete(d->n, d->dn, userdata)) {
 			case -1:
-				entry_free(cleanentry);
-				return -2;
+				rc = -2;
+				goto cleanup;
 			case -2:
 				if (ignore_nonleaf) {
-					printf("Skipping non-leaf entry: %s\n",
-					       entry_dn(cleanentry));
+					if (handler->nonleaf)
+						printf("Skipping non-leaf"
+						       " entry: %s\n",
+						       d->dn);
 					n_nonleaf++;
 					break;
 				}
-				switch (nonleaf_action(cleanentry,offsets,n)) {
+				switch (nonleaf_action(
+						handler, userdata, d->dn,
+						pending_p(offsets, deletions,
+							  i + 1)))
+				{
 				case 0:
-					entry_free(cleanentry);
-					return -2;
+					rc = -2;
+					goto cleanup;
 				case 2:
 					ignore_nonleaf = 1;
 					/* fall through */
@@ -618,13 +1175,191 @@ process_deletions(tparser *p,
 				break;
 			default:
 				n_leaf++;
-				long_array_invert(offsets, n);
+				long_array_invert(offsets, d->n);
 			}
-			entry_free(cleanentry);
 		}
 	} while (ignore_nonleaf && n_nonleaf > 0 && n_leaf > 0);
+	if (n_nonleaf)
+		rc = -2;
 
-	return n_nonleaf ? -2 : 0;
+cleanup:
+	for (i = 0; i < deletions->len; i++)
+		free(g_array_index(deletions, tdeletion, i).dn);
+	g_array_free(deletions, 1);
+	return rc;
+}
+
+/*
+ * A change plan is the list of handler calls made by one successful
+ * compare_streams() run, so that further runs over the same files can
+ * replay them instead of parsing and comparing every entry again.
+ *
+ * Deletions are not recorded as operations.  Instead, the plan keeps
+ * the numbers of all deleted entries and replays the deletion pass
+ * through process_deletions(), including its handling of non-leaf
+ * entries.
+ *
+ * The plan also remembers where each numbered record was found in the
+ * data file and a hash of its bytes.  When the file has been edited,
+ * the next analysis replays the operations of every record that is
+ * still byte for byte the same, and only parses and compares the rest.
+ */
+enum plan_op_type {
+	PLAN_CHANGE, PLAN_RENAME, PLAN_ADD, PLAN_DELETE, PLAN_RENAME0
+};
+
+typedef struct tplanop {
+	int type;
+	int n;
+	long datapos;
+	char *dn1;
+	char *dn2;
+	LDAPMod **mods;
+	int deleteoldrdn;
+} tplanop;
+
+/*
+ * A numbered record of the data file, with the operations it led to.
+ */
+typedef struct trecord {
+	long start;
+	long len;
+	guint64 hash;
+	int first_op;
+	int nops;
+} trecord;
+
+struct tplan {
+	struct stat st;
+	GArray *ops;
+	GArray *deletions;
+	GArray *records;
+	GArray *by_key;
+	long end;
+	int complete;
+	char *map;
+	long size;
+};
+
+typedef struct trecorder {
+	tplan *plan;
+	thandler *handler;
+	void *userdata;
+	long *datapos;
+} trecorder;
+
+static int replay_op(tparser *, thandler *, void *, FILE *, tplanop *,
+		     tsubtrees *);
+
+static guint64
+hash_bytes(const char *ptr, long n)
+{
+	guint64 hash = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+	const unsigned char *p = (const unsigned char *) ptr;
+	const unsigned char *end = p + n;
+
+	while (p < end) {
+		hash ^= *p++;
+		hash *= G_GUINT64_CONSTANT(0x100000001b3);
+	}
+	return hash;
+}
+
+/*
+ * Remember the record with key KEY between START and END, for which
+ * operations starting at index FIRST_OP have been recorded.
+ */
+static void
+note_record(tplan *plan, char *key, long start, long end, int first_op)
+{
+	trecord r;
+	char *ptr;
+	int n = strtol(key, &ptr, 10);
+
+	/*
+	 * A record that ran up to the end of the file might continue in
+	 * a longer file, so it cannot be reused.
+	 */
+	if (*ptr || !plan->map || end >= plan->size)
+		return;
+	r.start = start;
+	r.len = end - start;
+	r.hash = hash_bytes(plan->map + start, r.len);
+	r.first_op = first_op;
+	r.nops = plan->ops->len - first_op;
+	g_array_append_val(plan->records, r);
+	g_array_index(plan->by_key, int, n) = plan->records->len - 1;
+}
+
+/*
+ * If the record KEY at DATAPOS is byte for byte the same as it was for
+ * the analysis that recorded OLD, call HANDLER with the operations found
+ * back then instead of parsing and comparing it again.  Return 1 and
+ * set *RC if so, else return 0.
+ *
+ * Once an entry has been renamed, the operations for the entries below
+ * it depend on that, so records are only reused before the first rename.
+ */
+static int
+reuse_record(tplan *old, tplan *plan, tparser *p, thandler *handler,
+	     void *userdata, GArray *offsets, FILE *data, char *key,
+	     long datapos, tsubtrees *subtrees, int *rc)
+{
+	trecord *r;
+	char *ptr;
+	int first_op = plan->ops->len;
+	int n = strtol(key, &ptr, 10);
+	int i;
+
+	if (*ptr || n < 0 || n >= offsets->len || n >= old->by_key->len)
+		return 0;
+	if (subtrees->moves->len)
+		return 0;
+	if ( (i = g_array_index(old->by_key, int, n)) == -1)
+		return 0;
+	if (g_array_index(offsets, long, n) < 0)
+		return 0;
+	r = &g_array_index(old->records, trecord, i);
+	if (datapos + r->len > plan->size
+	    || hash_bytes(plan->map + datapos, r->len) != r->hash)
+		return 0;
+
+	*rc = 0;
+	for (i = 0; i < r->nops; i++) {
+		tplanop op = g_array_index(old->ops, tplanop, r->first_op + i);
+		op.datapos = datapos;
+		if (replay_op(p, handler, userdata, data, &op, subtrees)
+		    == -1)
+		{
+			*rc = -2;
+			return 1;
+		}
+	}
+	long_array_invert(offsets, n);
+	if (fseek(data, datapos + r->len, SEEK_SET) == -1) syserr();
+	note_record(plan, key, datapos, datapos + r->len, first_op);
+	return 1;
+}
+
+static void
+plan_map(tplan *plan, FILE *data)
+{
+	struct stat st;
+
+	plan->map = 0;
+	if (fstat(fileno(data), &st) == -1) syserr();
+	plan->size = st.st_size;
+	if (!plan->size)
+		return;
+	plan->map = mmap(0, plan->size, PROT_READ, MAP_SHARED, fileno(data), 0);
+	if (plan->map == MAP_FAILED) syserr();
+}
+
+static void
+plan_unmap(tplan *plan)
+{
+	if (plan->map && munmap(plan->map, plan->size) == -1) syserr();
+	plan->map = 0;
 }
 
 /*
@@ -645,7 +1380,8 @@ process_deletions(tparser *p,
  * For each change, call the appropriate handler method with arguments
  * described below.  Handler methods must return 0 on success, or -1 on
  * failure.  (As a special case, return value -2 on a deletion indicates
- * an attempt to delete a non-leaf entry, which is non-fatal.)
+ * an attempt to delete a non-leaf entry, which is non-fatal.  The
+ * optional handler->nonleaf decides how to go on, see nonleaf_action().)
  *
  * For each new entry (labeled with "add"), call
  *   handler->add(dn, mods, USERDATA)
@@ -654,6 +1390,13 @@ process_deletions(tparser *p,
  * For each entry present in CLEAN but not DATA, call
  *   handler->delete(dn, USERDATA)
  * (This step can be repeated in the case of non-leaf entries.)
+ * Subordinate entries are deleted before their superiors.  If there is
+ * a handler->delete_tree, each branch deleted as a whole is offered to
+ * it first, as
+ *   handler->delete_tree(dns, keys, n, done, USERDATA)
+ * with the N entries of the branch subordinates first and its root last.
+ * The handler sets DONE[i] for each entry it has deleted, and returns 0
+ * if the others are to be deleted one by one, or -1 on failure.
  *
  * For each entry present in both files, handler can be called two times.
  * If the distinguished names of the old and new entry disagree, call
@@ -665,6 +1408,10 @@ process_deletions(tparser *p,
  * component values have to be added, and old RDN values be removed),
  * and MODS describes the changes between RENAMED_ENTRY and NEW_ENTRY.
  *
+ * An entry below one that has been renamed already is compared as moved
+ * along with it, so a renamed branch takes only one rename of its root.
+ * (This relies on superiors coming first in DATA, as for additions.)
+ *
  * Entries labeled "delete" are changerecords for which the handler is
  * called as described above.
  *
@@ -677,22 +1424,29 @@ process_deletions(tparser *p,
  * If an error occured, *error_position is the offset in DATA after
  * which the erroneous entry can be found.
  */
-int
-compare_streams(tparser *p,
-		thandler *handler,
-		void *userdata,
-		GArray *offsets,
-		FILE *clean,
-		FILE *data,
-		long *error_position,
-		long *syntax_error_position)
+static int
+compare_streams_1(tparser *p,
+		  thandler *handler,
+		  void *userdata,
+		  GArray *offsets,
+		  FILE *clean,
+		  FILE *data,
+		  long *error_position,
+		  long *syntax_error_position,
+		  tplan *old,
+		  tplan *plan)
 {
+	tsubtrees *subtrees = subtrees_new();
+	long cleanend = file_end(clean);
 	char *key = 0;
 	int n;
 	int rc;
 
+	if (plan) plan_map(plan, data);
 	for (;;) {
 		long datapos;
+		int first_op;
+		int renamed;
 
 		/* read updated entry */
 		if (key) { free(key); key = 0; }
@@ -700,24 +1454,44 @@ compare_streams(tparser *p,
 		*error_position = datapos;
 		if (!key) break;
 
+		/* unchanged since the last analysis? */
+		if (old && plan->map
+		    && reuse_record(old, plan, p, handler, userdata, offsets,
+				    data, key, datapos, subtrees, &rc))
+		{
+			if (rc) goto cleanup;
+			continue;
+		}
+
 		/* and do something with it */
+		first_op = plan ? plan->ops->len : 0;
+		renamed = subtrees->moves->len;
 		if ( (rc = process_next_entry(
 			      p, handler, userdata, offsets, clean, data,
-			      key, datapos)))
+			      key, datapos, subtrees)))
 			goto cleanup;
+		/* see reuse_record() */
+		if (plan && !renamed)
+			note_record(plan, key, datapos, ftell(data), first_op);
 	}
 	if ( (*error_position = ftell(data)) == -1) syserr();
 
-	rc = process_deletions(p, handler, userdata, offsets, clean);
+	rc = process_deletions(p, handler, userdata, offsets, clean, subtrees);
 
 cleanup:
 	if (key) free(key);
+	if (plan) plan_unmap(plan);
 
 	if (syntax_error_position)
 		if ( (*syntax_error_position = ftell(data)) == -1) syserr();
 
 	/* on user error, return now and keep state for recovery */
-	if (rc == -2) return rc;
+	if (rc == -2) {
+		subtrees_update_clean(p, subtrees, offsets, clean, cleanend);
+		subtrees_free(subtrees);
+		return rc;
+	}
+	subtrees_free(subtrees);
 
 	/* else some cleanup: unmark offsets */
 	for (n = 0; n < offsets->len; n++)
@@ -725,3 +1499,350 @@ cleanup:
 			long_array_invert(offsets, n);
 	return rc;
 }
+
+int
+compare_streams(tparser *p,
+		thandler *handler,
+		void *userdata,
+		GArray *offsets,
+		FILE *clean,
+		FILE *data,
+		long *error_position,
+		long *syntax_error_position)
+{
+	return compare_streams_1(p, handler, userdata, offsets, clean, data,
+				 error_position, syntax_error_position, 0, 0);
+}
+
+tplan *
+plan_new(FILE *data)
+{
+	tplan *plan = xalloc(sizeof(tplan));
+	if (fstat(fileno(data), &plan->st) == -1) syserr();
+	plan->ops = g_array_new(0, 0, sizeof(tplanop));
+	plan->deletions = g_array_new(0, 0, sizeof(int));
+	plan->records = g_array_new(0, 0, sizeof(trecord));
+	plan->by_key = g_array_new(0, 0, sizeof(int));
+	plan->end = 0;
+	plan->complete = 0;
+	plan->map = 0;
+	return plan;
+}
+
+void
+plan_free(tplan *plan)
+{
+	int i;
+
+	for (i = 0; i < plan->ops->len; i++) {
+		tplanop *op = &g_array_index(plan->ops, tplanop, i);
+		if (op->dn1) free(op->dn1);
+		if (op->dn2) free(op->dn2);
+		if (op->mods) ldap_mods_free(op->mods, 1);
+	}
+	g_array_free(plan->ops, 1);
+	g_array_free(plan->deletions, 1);
+	g_array_free(plan->records, 1);
+	g_array_free(plan->by_key, 1);
+	free(plan);
+}
+
+/*
+ * Return true if PLAN cannot be replayed for DATA: Either the analysis
+ * failed, or DATA is not the file PLAN was recorded for, or has been
+ * modified since.
+ */
+int
+plan_stale_p(tplan *plan, FILE *data)
+{
+	struct stat st;
+
+	if (fstat(fileno(data), &st) == -1) syserr();
+	return !plan->complete
+		|| st.st_dev != plan->st.st_dev
+		|| st.st_ino != plan->st.st_ino
+		|| st.st_size != plan->st.st_size
+		|| st.st_mtime != plan->st.st_mtime
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+		|| st.st_mtim.tv_nsec != plan->st.st_mtim.tv_nsec
+#endif
+		;
+}
+
+static tplanop *
+record_op(trecorder *r, int type, int n)
+{
+	tplanop op;
+
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.n = n;
+	op.datapos = *r->datapos;
+	g_array_append_val(r->plan->ops, op);
+	return &g_array_index(r->plan->ops, tplanop, r->plan->ops->len - 1);
+}
+
+static int
+record_change(int n, char *olddn, char *newdn, LDAPMod **mods, void *userdata)
+{
+	trecorder *r = userdata;
+	tplanop *op;
+	int rc = r->handler->change(n, olddn, newdn, mods, r->userdata);
+
+	if (rc) return rc;
+	op = record_op(r, PLAN_CHANGE, n);
+	op->dn1 = xdup(olddn);
+	op->dn2 = xdup(newdn);
+	op->mods = copy_mods(mods);
+	return 0;
+}
+
+static int
+record_rename(int n, char *olddn, tentry *entry, void *userdata)
+{
+	trecorder *r = userdata;
+	tplanop *op;
+	int rc = r->handler->rename(n, olddn, entry, r->userdata);
+
+	if (rc) return rc;
+	op = record_op(r, PLAN_RENAME, n);
+	op->dn1 = xdup(olddn);
+	op->dn2 = xdup(entry_dn(entry));
+	return 0;
+}
+
+static int
+record_add(int n, char *dn, LDAPMod **mods, void *userdata)
+{
+	trecorder *r = userdata;
+	tplanop *op;
+	int rc = r->handler->add(n, dn, mods, r->userdata);
+
+	if (rc) return rc;
+	op = record_op(r, PLAN_ADD, n);
+	op->dn1 = xdup(dn);
+	op->mods = copy_mods(mods);
+	return 0;
+}
+
+static int
+record_delete(int n, char *dn, void *userdata)
+{
+	trecorder *r = userdata;
+	int rc = r->handler->delete(n, dn, r->userdata);
+
+	if (rc) return rc;
+	if (n >= 0)
+		g_array_append_val(r->plan->deletions, n);
+	else
+		record_op(r, PLAN_DELETE, n)->dn1 = xdup(dn);
+	return 0;
+}
+
+static int
+record_rename0(int n, char *dn1, char *dn2, int deleteoldrdn, void *userdata)
+{
+	trecorder *r = userdata;
+	tplanop *op;
+	int rc = r->handler->rename0(n, dn1, dn2, deleteoldrdn, r->userdata);
+
+	if (rc) return rc;
+	op = record_op(r, PLAN_RENAME0, n);
+	op->dn1 = xdup(dn1);
+	op->dn2 = xdup(dn2);
+	op->deleteoldrdn = deleteoldrdn;
+	return 0;
+}
+
+/*
+ * Like compare_streams(), but also record the handler calls in PLAN.
+ * If OLD is not null, it is an earlier plan for the same clean copy and
+ * offsets, possibly of an analysis that failed, and records unchanged
+ * since then are not compared again.
+ *
+ * The plan can only be replayed if this function returns 0.
+ */
+int
+plan_record(tplan *plan, tplan *old, tparser *p, thandler *handler,
+	    void *userdata, GArray *offsets, FILE *clean, FILE *data,
+	    long *error_position, long *syntax_error_position)
+{
+	static thandler recorder_handler = {
+		record_change,
+		record_rename,
+		record_add,
+		record_delete,
+		record_rename0
+	};
+	trecorder r;
+	int rc;
+
+	r.plan = plan;
+	r.handler = handler;
+	r.userdata = userdata;
+	r.datapos = error_position;
+	g_array_set_size(plan->by_key, offsets->len);
+	memset(plan->by_key->data, 0xff, offsets->len * sizeof(int));
+	rc = compare_streams_1(p, &recorder_handler, &r, offsets, clean, data,
+			       error_position, syntax_error_position,
+			       old, plan);
+	plan->end = *error_position;
+	plan->complete = !rc;
+	return rc;
+}
+
+/*
+ * Call HANDLER for OP and note renames in SUBTREES.  Return 0 on
+ * success, else -1.
+ */
+static int
+replay_op(tparser *p, thandler *handler, void *userdata, FILE *data,
+	  tplanop *op, tsubtrees *subtrees)
+{
+	tentry *entry;
+	int rc;
+
+	switch (op->type) {
+	case PLAN_CHANGE:
+		rc = handler->change(
+			op->n, op->dn1, op->dn2, op->mods, userdata);
+		return rc == -1 ? -1 : 0;
+	case PLAN_RENAME:
+		if (p->entry(data, op->datapos, 0, &entry, 0) == -1) abort();
+		rc = handler->rename(op->n, op->dn1, entry, userdata);
+		entry_free(entry);
+		if (rc == -1)
+			return -1;
+		subtrees_note(subtrees, op->dn1, op->dn2);
+		return 0;
+	case PLAN_ADD:
+		rc = handler->add(op->n, op->dn1, op->mods, userdata);
+		return rc == -1 ? -1 : 0;
+	case PLAN_DELETE:
+		rc = handler->delete(op->n, op->dn1, userdata);
+		return rc ? -1 : 0;
+	case PLAN_RENAME0:
+		rc = handler->rename0(
+			op->n, op->dn1, op->dn2, op->deleteoldrdn, userdata);
+		return rc ? -1 : 0;
+	default:
+		abort();
+	}
+}
+
+/*
+ * Mark all numbered entries found in DATA before position END as seen,
+ * the way compare_streams() would have done before failing at END.
+ */
+static void
+mark_processed(tparser *p, GArray *offsets, FILE *data, long end)
+{
+	char *key, *ptr;
+	long pos;
+	int n;
+
+	if (fseek(data, 0, SEEK_SET) == -1) syserr();
+	for (;;) {
+		key = 0;
+		if (p->peek(data, -1, &key, &pos) == -1) abort();
+		if (!key) break;
+		if (pos >= end) {
+			free(key);
+			break;
+		}
+		n = strtol(key, &ptr, 10);
+		if (!*ptr && g_array_index(offsets, long, n) >= 0)
+			long_array_invert(offsets, n);
+		free(key);
+		if (p->skip(data, pos, 0) == -1) abort();
+	}
+}
+
+/*
+ * Leave OFFSETS and CLEAN in the state process_next_entry() leaves them
+ * in when the handler fails for operation I.
+ */
+static void
+replay_failed(tplan *plan, int i, tparser *p, GArray *offsets,
+	      FILE *clean, FILE *data)
+{
+	tplanop *op = &g_array_index(plan->ops, tplanop, i);
+	tplanop *prev = i > 0 ? op - 1 : 0;
+	tentry *entry;
+	tentry *cleanentry;
+	int deleteoldrdn;
+	char key[32];
+	long pos;
+
+	mark_processed(p, offsets, data, op->datapos);
+	if (op->n < 0)
+		return;
+	if (*op->dn2)
+		fprintf(stderr, "Error at: %s\n", op->dn2);
+
+	/* the entry was renamed already, but its changes failed */
+	if (op->type != PLAN_CHANGE || !prev || prev->type != PLAN_RENAME
+	    || prev->datapos != op->datapos)
+		return;
+	pos = g_array_index(offsets, long, op->n);
+	if (p->entry(clean, pos, 0, 0, &pos) == -1) abort();
+	if (p->entry(clean, pos, 0, &cleanentry, 0) == -1) abort();
+	if (p->entry(data, op->datapos, 0, &entry, 0) == -1) abort();
+	validate_rename(cleanentry, entry, &deleteoldrdn);
+	rename_entry(cleanentry, entry_dn(entry), deleteoldrdn);
+	sprintf(key, "%d", op->n);
+	update_clean_copy(offsets, key, clean, cleanentry, p);
+	entry_free(entry);
+	entry_free(cleanentry);
+}
+
+/*
+ * Call HANDLER as compare_streams() would for CLEAN and DATA, using the
+ * operations recorded in PLAN.  Return values and the state left behind
+ * on handler failure are the same as for compare_streams().
+ */
+int
+plan_replay(tplan *plan, tparser *p, thandler *handler, void *userdata,
+	    GArray *offsets, FILE *clean, FILE *data, long *error_position)
+{
+	tsubtrees *subtrees = subtrees_new();
+	long cleanend = file_end(clean);
+	char *deleted;
+	int i;
+	int n;
+	int rc;
+
+	for (i = 0; i < plan->ops->len; i++) {
+		tplanop *op = &g_array_index(plan->ops, tplanop, i);
+		*error_position = op->datapos;
+		if (replay_op(p, handler, userdata, data, op, subtrees) == -1) {
+			replay_failed(plan, i, p, offsets, clean, data);
+			subtrees_update_clean(
+				p, subtrees, offsets, clean, cleanend);
+			subtrees_free(subtrees);
+			return -2;
+		}
+	}
+	*error_position = plan->end;
+
+	/* every entry except those to be deleted has been seen */
+	deleted = xalloc(offsets->len + 1);
+	memset(deleted, 0, offsets->len + 1);
+	for (i = 0; i < plan->deletions->len; i++)
+		deleted[g_array_index(plan->deletions, int, i)] = 1;
+	for (n = 0; n < offsets->len; n++)
+		if (!deleted[n] && g_array_index(offsets, long, n) >= 0)
+			long_array_invert(offsets, n);
+	free(deleted);
+
+	rc = process_deletions(p, handler, userdata, offsets, clean, subtrees);
+	if (rc == -2)
+		subtrees_update_clean(p, subtrees, offsets, clean, cleanend);
+	subtrees_free(subtrees);
+	if (rc == -2) return rc;
+
+	for (n = 0; n < offsets->len; n++)
+		if (g_array_index(offsets, long, n) < 0)
+			long_array_invert(offsets, n);
+	return rc;
+}
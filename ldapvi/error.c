@@ -14,29 +14,53 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
-#include <dirent.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <glib.h>
-#include <ldap.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <strings.h>
-#include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <sys/termios.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <time.h>
-#include <unistd.h>
+#include "common.h"
+#include "config.h"
+
+/*
+ * Errors end the process, unless the calling thread has installed an
+ * error catcher, as libldapvi.c does around every call.  Then the
+ * message is kept in the catcher and control returns to its setjmp()
+ * instead, leaking whatever the failed operation had allocated.
+ */
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_TLS)
+static __thread terrorcatcher *catchers;
+#else
+static terrorcatcher *catchers;
+#endif
+
+void
+error_catch(terrorcatcher *catcher)
+{
+	catcher->message[0] = 0;
+	catcher->next = catchers;
+	catchers = catcher;
+}
+
+void
+error_uncatch(terrorcatcher *catcher)
+{
+	catchers = catcher->next;
+}
+
+static void
+throw(void)
+{
+	terrorcatcher *catcher = catchers;
+	catchers = catcher->next;
+	longjmp(catcher->jmp, 1);
+}
 
 void
 do_syserr(char *file, int line)
 {
 	char buf[32];
 	snprintf(buf, sizeof(buf), "error (%s line %d)", file, line);
+	if (catchers) {
+		snprintf(catchers->message, sizeof(catchers->message),
+			 "%s: %s", buf, strerror(errno));
+		throw();
+	}
 	perror(buf);
 	exit(1);
 }
@@ -44,6 +68,11 @@ do_syserr(char *file, int line)
 void
 yourfault(char *str)
 {
+	if (catchers) {
+		snprintf(catchers->message, sizeof(catchers->message),
+			 "%s", str);
+		throw();
+	}
 	fprintf(stderr, "%s\n", str);
 	exit(1);
 }
@@ -51,6 +80,13 @@ yourfault(char *str)
 void
 ldaperr(LDAP *ld, char *str)
 {
+	if (catchers) {
+		int code = LDAP_OTHER;
+		ldap_get_option(ld, LDAP_OPT_ERROR_NUMBER, &code);
+		snprintf(catchers->message, sizeof(catchers->message),
+			 "%s: %s", str, ldap_err2string(code));
+		throw();
+	}
 	ldap_perror(ld, str);
 	exit(1);
 }
@@ -19,16 +19,166 @@
  */
 #include <curses.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <term.h>
 #include "common.h"
+#include "config.h"
+#include "probes.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
-typedef void (*handler_entry)(char *, tentry *, void *);
-static void parse_file(
-	FILE *, tparser *, thandler *, void *, handler_entry, void *, int);
 static void cut_datafile(char *, long, cmdline *);
 static int write_file_header(FILE *, cmdline *);
 static int rebind(LDAP *, bind_options *, int, char *, int);
 
+/*
+ * The changes found by analyze_changes(), for use by the other actions
+ * until the data file is modified, and by the next analysis after that.
+ */
+static tplan *change_plan = 0;
+
+static void
+discard_change_plan(void)
+{
+	if (change_plan) {
+		plan_free(change_plan);
+		change_plan = 0;
+	}
+}
+
+/*
+ * The schema is read at most once per session.  startup() may have sent
+ * the request already, or set schema_msgid to -2 if it could not.
+ */
+static tschema *session_schema = 0;
+static int schema_msgid = -1;
+
+#ifndef LDAP_CONTROL_X_TREE_DELETE
+#define LDAP_CONTROL_X_TREE_DELETE "1.2.840.113556.1.4.805"
+#endif
+static int tree_delete = -1;	/* control advertised?  -1 if unknown */
+
+/*
+ * Does ROOTDSE list OID as a supportedControl?
+ */
+static int
+control_supported_p(LDAP *ld, LDAPMessage *rootdse, char *oid)
+{
+	char **values = ldap_get_values(ld, rootdse, "supportedControl");
+	int result = 0;
+	int i;
+
+	if (!values)
+		return 0;
+	for (i = 0; values[i]; i++)
+		if (!strcmp(values[i], oid))
+			result = 1;
+	ldap_value_free(values);
+	return result;
+}
+
+static tschema *
+get_schema(LDAP *ld)
+{
+	if (!session_schema) {
+		stats_begin(STATS_SCHEMA);
+		if (schema_msgid >= 0)
+			session_schema = schema_receive(ld, schema_msgid);
+		else if (schema_msgid == -1)
+			session_schema = schema_new(ld);
+		/* else startup() has failed to read the root DSE */
+		schema_msgid = -1;
+		stats_end(STATS_SCHEMA);
+	}
+	return session_schema;
+}
+
+/*
+ * Receive the root DSE when only the schema needs it.  Errors are
+ * reported as by schema_new() and are not fatal.  Return 0 on failure.
+ */
+static LDAPMessage *
+schema_rootdse_receive(LDAP *ld, int msgid, LDAPMessage **result)
+{
+	LDAPMessage *rootdse;
+
+	*result = 0;
+	if (ldap_result(ld, msgid, LDAP_MSG_ALL, 0, result) == -1
+	    || ldap_result2error(ld, *result, 0))
+	{
+		ldap_perror(ld, "ldap_search");
+		return 0;
+	}
+	if ( !(rootdse = ldap_first_entry(ld, *result)))
+		ldap_perror(ld, "ldap_first_entry");
+	return rootdse;
+}
+
+/*
+ * Send the requests that have to be answered before the first search
+ * result without waiting for each in turn.  The root DSE, needed for
+ * --discover and for the subschema DN, goes out together with the first
+ * search unless --discover has yet to find the base DNs.  The subschema
+ * entry is requested as soon as its DN is known, and only received by
+ * get_schema().  While we are at it, note whether deletions can use the
+ * Tree Delete control.
+ *
+ * Only --discover cannot do without the root DSE.  For the schema alone,
+ * failing to read it makes the first get_schema() fail.
+ */
+static void
+startup(LDAP *ld, cmdline *cmdline, LDAPControl **ctrls)
+{
+	char *attrs[4] = {
+		"namingContexts", "subschemaSubentry", "supportedControl", 0
+	};
+	int searchp = !cmdline->config && !cmdline->classes
+		&& (cmdline->mode == ldapvi_mode_edit
+		    || cmdline->mode == ldapvi_mode_out);
+	int schemap = searchp && cmdline->schema_comments;
+	LDAPMessage *result, *rootdse;
+	char *dn;
+	int msgid;
+
+	if (!cmdline->discover && !schemap)
+		return;
+	msgid = get_entry_request(ld, "", attrs);
+	if (searchp && !cmdline->discover)
+		search_begin(ld, cmdline, ctrls);
+	if (cmdline->discover) {
+		rootdse = get_entry_receive(ld, msgid, &result);
+		discover_naming_contexts(ld, rootdse, cmdline->basedns);
+	} else
+		rootdse = schema_rootdse_receive(ld, msgid, &result);
+	if (rootdse) {
+		tree_delete = control_supported_p(
+			ld, rootdse, LDAP_CONTROL_X_TREE_DELETE);
+		if (schemap && (dn = subschema_dn(ld, rootdse))) {
+			schema_msgid = schema_request(ld, dn);
+			free(dn);
+		}
+	} else
+		schema_msgid = -2;
+	if (result) ldap_msgfree(result);
+	if (searchp && cmdline->discover)
+		search_begin(ld, cmdline, ctrls);
+}
+
+static tschema *
+search_schema(LDAP *ld, cmdline *cmdline)
+{
+	tschema *schema;
+
+	if (!cmdline->schema_comments)
+		return 0;
+	if ( !(schema = get_schema(ld))) {
+		fputs("Error: Failed to read schema, giving up.\n", stderr);
+		exit(1);
+	}
+	return schema;
+}
+
 static int
 compare(tparser *p, thandler *handler, void *userdata, GArray *offsets,
 	char *cleanname, char *dataname, long *error_position,
@@ -40,8 +190,12 @@ compare(tparser *p, thandler *handler, void *userdata, GArray *offsets,
 
 	if ( !(clean = fopen(cleanname, "r+"))) syserr();
 	if ( !(data = fopen(dataname, "r"))) syserr();
-	rc = compare_streams(p, handler, userdata, offsets, clean, data, &pos,
-			     error_position);
+	if (change_plan && !plan_stale_p(change_plan, data))
+		rc = plan_replay(change_plan, p, handler, userdata, offsets,
+				 clean, data, &pos);
+	else
+		rc = compare_streams(p, handler, userdata, offsets, clean,
+				     data, &pos, error_position);
 	if (fclose(clean) == EOF) syserr();
 	if (fclose(data) == EOF) syserr();
 
@@ -49,6 +203,8 @@ compare(tparser *p, thandler *handler, void *userdata, GArray *offsets,
 		/* an error has happened */
 		int n;
 
+		discard_change_plan();
+
 		if (!cmdline) {
 			fputs("oops: unexpected error in handler\n", stderr);
 			exit(1);
@@ -65,6 +221,39 @@ compare(tparser *p, thandler *handler, void *userdata, GArray *offsets,
 	return rc;
 }
 
+/*
+ * Like compare(), but record a new change plan unless the current one
+ * is still valid.  Records that have not changed since the last call
+ * are not compared again.  HANDLER must not have side effects.
+ */
+static int
+compare_and_plan(tparser *p, thandler *handler, void *userdata,
+		 GArray *offsets, char *cleanname, char *dataname,
+		 long *error_position)
+{
+	FILE *clean, *data;
+	tplan *plan;
+	int rc;
+	long pos;
+
+	if ( !(clean = fopen(cleanname, "r+"))) syserr();
+	if ( !(data = fopen(dataname, "r"))) syserr();
+	if (change_plan && !plan_stale_p(change_plan, data))
+		rc = plan_replay(change_plan, p, handler, userdata, offsets,
+				 clean, data, &pos);
+	else {
+		/* keep even a failed analysis, for the next attempt */
+		plan = plan_new(data);
+		rc = plan_record(plan, change_plan, p, handler, userdata,
+				 offsets, clean, data, &pos, error_position);
+		discard_change_plan();
+		change_plan = plan;
+	}
+	if (fclose(clean) == EOF) syserr();
+	if (fclose(data) == EOF) syserr();
+	return rc;
+}
+
 static void
 cleanup(int rc, char *pathname)
 {
@@ -117,6 +306,7 @@ moddn(LDAP *ld, char *old, char *new, int dor, LDAPControl **ctrls)
 	char **ptr = newrdns;
 	char *newrdn = *ptr++;
 	GString *newsup = g_string_sized_new(strlen(new));
+	double start;
 
 	if (newrdn) {
 		if (*ptr) g_string_append(newsup, *ptr++);
@@ -126,7 +316,9 @@ moddn(LDAP *ld, char *old, char *new, int dor, LDAPControl **ctrls)
 		}
 	} else
 		newrdn = "";
+	start = stats_start();
 	rc = ldap_rename_s(ld, old, newrdn, newsup->str, dor, ctrls, 0);
+	stats_latency(STATS_RENAME, start);
 	g_string_free(newsup, 1);
 	ldap_value_free(newrdns);
 	return rc;
@@ -154,6 +346,40 @@ ldapmodify_error(struct ldapmodify_context *ctx, char *error)
 	return 0;
 }
 
+#ifdef HAVE_SYS_SDT_H
+static int
+mods_length(LDAPMod **mods)
+{
+	int n = 0;
+	while (mods[n]) n++;
+	return n;
+}
+
+/*
+ * Total size of the values in MODS.
+ */
+static long
+mods_bytes(LDAPMod **mods)
+{
+	long n = 0;
+	int i;
+
+	for (; *mods; mods++)
+		if ((*mods)->mod_op & LDAP_MOD_BVALUES) {
+			struct berval **values = (*mods)->mod_bvalues;
+			if (values)
+				for (i = 0; values[i]; i++)
+					n += values[i]->bv_len;
+		} else {
+			char **values = (*mods)->mod_values;
+			if (values)
+				for (i = 0; values[i]; i++)
+					n += strlen(values[i]);
+		}
+	return n;
+}
+#endif
+
 static int
 ldapmodify_change(
 	int key, char *labeldn, char *dn, LDAPMod **mods, void *userdata)
@@ -162,9 +388,17 @@ ldapmodify_change(
 	LDAP *ld = ctx->ld;
 	LDAPControl **ctrls = ctx->controls;
 	int verbose = ctx->verbose;
+	double start;
+	int rc;
 
 	if (verbose) printf("(modify) %s\n", labeldn);
-	if (ldap_modify_ext_s(ld, dn, mods, ctrls, 0))
+	PROBE4(modify__request,
+	       key, strlen(dn), mods_length(mods), mods_bytes(mods));
+	start = stats_start();
+	rc = ldap_modify_ext_s(ld, dn, mods, ctrls, 0);
+	stats_latency(STATS_MODIFY, start);
+	PROBE3(modify__response, key, strlen(dn), rc);
+	if (rc)
 		return ldapmodify_error(ctx, "ldap_modify");
 	return 0;
 }
@@ -179,8 +413,13 @@ ldapmodify_rename(int key, char *dn1, tentry *modified, void *userdata)
 
 	char *dn2 = entry_dn(modified);
 	int deleteoldrdn = frob_rdn(modified, dn1, FROB_RDN_CHECK) == -1;
+	int rc;
+
 	if (verbose) printf("(rename) %s to %s\n", dn1, dn2);
-	if (moddn(ld, dn1, dn2, deleteoldrdn, ctrls))
+	PROBE3(rename__request, key, strlen(dn1), strlen(dn2));
+	rc = moddn(ld, dn1, dn2, deleteoldrdn, ctrls);
+	PROBE3(rename__response, key, strlen(dn1), rc);
+	if (rc)
 		return ldapmodify_error(ctx, "ldap_rename");
 	return 0;
 }
@@ -192,9 +431,17 @@ ldapmodify_add(int key, char *dn, LDAPMod **mods, void *userdata)
 	LDAP *ld = ctx->ld;
 	LDAPControl **ctrls = ctx->controls;
 	int verbose = ctx->verbose;
+	double start;
+	int rc;
 
 	if (verbose) printf("(add) %s\n", dn);
-	if (ldap_add_ext_s(ld, dn, mods, ctrls, 0))
+	PROBE4(add__request,
+	       key, strlen(dn), mods_length(mods), mods_bytes(mods));
+	start = stats_start();
+	rc = ldap_add_ext_s(ld, dn, mods, ctrls, 0);
+	stats_latency(STATS_ADD, start);
+	PROBE3(add__response, key, strlen(dn), rc);
+	if (rc)
 		return ldapmodify_error(ctx, "ldap_add");
 	return 0;
 }
@@ -206,9 +453,16 @@ ldapmodify_delete(int key, char *dn, void *userdata)
 	LDAP *ld = ctx->ld;
 	LDAPControl **ctrls = ctx->controls;
 	int verbose = ctx->verbose;
+	double start;
+	int rc;
 
 	if (verbose) printf("(delete) %s\n", dn);
-	switch (ldap_delete_ext_s(ld, dn, ctrls, 0)) {
+	PROBE2(delete__request, key, strlen(dn));
+	start = stats_start();
+	rc = ldap_delete_ext_s(ld, dn, ctrls, 0);
+	stats_latency(STATS_DELETE, start);
+	PROBE3(delete__response, key, strlen(dn), rc);
+	switch (rc) {
 	case 0:
 		break;
 	case LDAP_NOT_ALLOWED_ON_NONLEAF:
@@ -221,6 +475,221 @@ ldapmodify_delete(int key, char *dn, void *userdata)
 	return 0;
 }
 
+/*
+ * Read the root DSE for tree_delete unless startup() has done so.  A
+ * server that does not let us read it does not get the control.
+ */
+static int
+tree_delete_p(LDAP *ld)
+{
+	char *attrs[2] = {"supportedControl", 0};
+	LDAPMessage *result = 0;
+	LDAPMessage *rootdse;
+
+	if (tree_delete != -1)
+		return tree_delete;
+	tree_delete = 0;
+	if (!ldap_search_ext_s(ld, "", LDAP_SCOPE_BASE, 0, attrs, 0, 0, 0,
+			       0, 0, &result)
+	    && (rootdse = ldap_first_entry(ld, result)))
+		tree_delete = control_supported_p(
+			ld, rootdse, LDAP_CONTROL_X_TREE_DELETE);
+	if (result) ldap_msgfree(result);
+	return tree_delete;
+}
+
+/*
+ * Is the subtree at DN exactly N entries large?  The clean copy need not
+ * show all of it, and a subtree delete must not take along entries that
+ * the user has not seen.
+ */
+static int
+subtree_size_p(LDAP *ld, char *dn, int n, LDAPControl **ctrls)
+{
+	char *attrs[2] = {"1.1", 0};
+	LDAPMessage *result = 0;
+	int rc;
+
+	rc = ldap_search_ext_s(ld, dn, LDAP_SCOPE_SUBTREE, "(objectclass=*)",
+			       attrs, 1, ctrls, 0, 0, n + 1, &result);
+	if (!rc && ldap_count_entries(ld, result) != n)
+		rc = -1;
+	if (result) ldap_msgfree(result);
+	return !rc;
+}
+
+static int
+ldapmodify_subtree_delete(struct ldapmodify_context *ctx, int key, char *dn)
+{
+	LDAP *ld = ctx->ld;
+	LDAPControl control;
+	LDAPControl **ctrls;
+	double start;
+	int n = 0;
+	int rc;
+
+	if (ctx->controls)
+		while (ctx->controls[n]) n++;
+	ctrls = xalloc((n + 2) * sizeof(LDAPControl *));
+	if (n) memcpy(ctrls, ctx->controls, n * sizeof(LDAPControl *));
+	control.ldctl_oid = LDAP_CONTROL_X_TREE_DELETE;
+	control.ldctl_value.bv_len = 0;
+	control.ldctl_value.bv_val = 0;
+	control.ldctl_iscritical = 1;
+	ctrls[n] = &control;
+	ctrls[n + 1] = 0;
+
+	if (ctx->verbose) printf("(delete tree) %s\n", dn);
+	PROBE2(delete__request, key, strlen(dn));
+	start = stats_start();
+	rc = ldap_delete_ext_s(ld, dn, ctrls, 0);
+	stats_latency(STATS_DELETE, start);
+	PROBE3(delete__response, key, strlen(dn), rc);
+	free(ctrls);
+	return rc;
+}
+
+#define DELETE_WINDOW 64
+
+/*
+ * Delete DNS[0..N-1], which are sorted by depth, subordinates first.
+ * Up to DELETE_WINDOW requests of the same depth are in flight at a time;
+ * the next depth only starts when all answers are in.  Non-leaf entries
+ * are left for ldapmodify_delete() to ask about.
+ */
+static int
+ldapmodify_delete_leaves(struct ldapmodify_context *ctx,
+			 char **dns, int *keys, int n, char *done)
+{
+	LDAP *ld = ctx->ld;
+	int *msgids = xalloc(n * sizeof(int));
+	double *starts = xalloc(n * sizeof(double));
+	int failed = 0;
+	int depth, level, end;
+	int i, j;
+
+	for (level = 0; level < n && !failed; level = end) {
+		int outstanding = 0;
+
+		depth = dn_depth(dns[level]);
+		for (end = level; end < n && dn_depth(dns[end]) == depth; )
+			end++;
+		i = level;
+		while (i < end || outstanding) {
+			LDAPMessage *msg;
+			int msgid;
+			int rc;
+
+			while (i < end && outstanding < DELETE_WINDOW
+			       && !failed)
+			{
+				if (ctx->verbose)
+					printf("(delete) %s\n", dns[i]);
+				PROBE2(delete__request,
+				       keys[i], strlen(dns[i]));
+				starts[i] = stats_start();
+				if (ldap_delete_ext(
+					    ld, dns[i], ctx->controls, 0,
+					    &msgids[i]))
+				{
+					failed = ldapmodify_error(
+						ctx, "ldap_delete");
+					msgids[i] = -1;
+				} else
+					outstanding++;
+				i++;
+			}
+			if (!outstanding)
+				break;
+
+			if (ldap_result(
+				    ld, LDAP_RES_ANY, LDAP_MSG_ALL, 0, &msg)
+			    == -1)
+				ldaperr(ld, "ldap_result");
+			msgid = ldap_msgid(msg);
+			for (j = level; j < i; j++)
+				if (msgids[j] == msgid)
+					break;
+			if (j == i) {
+				ldap_msgfree(msg);
+				continue;
+			}
+			msgids[j] = -1;
+			outstanding--;
+			rc = ldap_result2error(ld, msg, 1);
+			stats_latency(STATS_DELETE, starts[j]);
+			PROBE3(delete__response, keys[j], strlen(dns[j]), rc);
+			switch (rc) {
+			case 0:
+				done[j] = 1;
+				break;
+			case LDAP_NOT_ALLOWED_ON_NONLEAF:
+				break;
+			default:
+				if (ldapmodify_error(ctx, "ldap_delete"))
+					failed = -1;
+				else
+					done[j] = 1;
+			}
+		}
+	}
+	free(msgids);
+	free(starts);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Delete a branch, with a single request if the server supports the
+ * Tree Delete control.
+ */
+static int
+ldapmodify_delete_tree(char **dns, int *keys, int n, char *done,
+		       void *userdata)
+{
+	struct ldapmodify_context *ctx = userdata;
+	int root = n - 1;
+
+	if (tree_delete_p(ctx->ld)
+	    && subtree_size_p(ctx->ld, dns[root], n, ctx->controls))
+	{
+		if (ldapmodify_subtree_delete(ctx, keys[root], dns[root]))
+			return ldapmodify_error(ctx, "ldap_delete");
+		memset(done, 1, n);
+		return 0;
+	}
+	return ldapmodify_delete_leaves(ctx, dns, keys, n, done);
+}
+
+static int
+ldapmodify_nonleaf(char *dn, int more, void *userdata)
+{
+	printf("Error: Cannot delete non-leaf entry: %s\n", dn);
+
+	/* no more deletions anyway, so no need to ignore this one */
+	if (!more)
+		return 0;
+
+	for (;;) {
+		switch (choose("Continue?", "yn!Q?", "(Type '?' for help.)")) {
+		case 'y':
+			return 1;
+		case '!':
+			return 2;
+		case 'n':
+			return 0;
+		case 'Q':
+			exit(0);
+		case '?':
+			puts("Commands:\n"
+			     "  y -- continue deleting other entries\n"
+			     "  ! -- continue and assume 'y' until done\n"
+			     "  n -- abort deletions\n"
+			     "  Q -- discard changes and quit\n"
+			     "  ? -- this help");
+		}
+	}
+}
+
 static int
 ldapmodify_rename0(
 	int key, char *dn1, char *dn2, int deleteoldrdn, void *userdata)
@@ -229,9 +698,13 @@ ldapmodify_rename0(
 	LDAP *ld = ctx->ld;
 	LDAPControl **ctrls = ctx->controls;
 	int verbose = ctx->verbose;
+	int rc;
 
 	if (verbose) printf("(rename) %s to %s\n", dn1, dn2);
-	if (moddn(ld, dn1, dn2, deleteoldrdn, ctrls))
+	PROBE3(rename__request, key, strlen(dn1), strlen(dn2));
+	rc = moddn(ld, dn1, dn2, deleteoldrdn, ctrls);
+	PROBE3(rename__response, key, strlen(dn1), rc);
+	if (rc)
 		return ldapmodify_error(ctx, "ldap_rename");
 	return 0;
 }
@@ -572,11 +1045,27 @@ cleanup:
 	return dn;
 }
 
+/*
+ * Return the name of a new temporary directory, for
+ * ensure_tmp_directory() to create.  It goes into TMPDIR, $TMPDIR or
+ * /tmp.  On a tmpfs, the clean copy, the data file and the LDIF views
+ * never touch the disk.
+ */
+static char *
+tmp_directory_template(char *tmpdir)
+{
+	if (!tmpdir) tmpdir = getenv("TMPDIR");
+	if (!tmpdir || !*tmpdir) tmpdir = "/tmp";
+	return append(tmpdir, "/ldapvi-XXXXXX");
+}
+
 static void
 ensure_tmp_directory(char *dir)
 {
-	if (strcmp(dir, "/tmp/ldapvi-XXXXXX")) return;
-	mkdtemp(dir);
+	int n = strlen(dir);
+
+	if (n < 6 || strcmp(dir + n - 6, "XXXXXX")) return;
+	if (!mkdtemp(dir)) syserr();
 	on_exit((on_exit_function) cleanup, dir);
 	signal(SIGTERM, cleanup_signal);
 	signal(SIGINT, cleanup_signal);
@@ -720,7 +1209,7 @@ do_connect(char *server, bind_options *bind_options,
 		ldaperr(0, "ldap_set_option(LDAP_OPT_X_TLS)");
 	if ( rc = ldap_initialize(&ld, server)) {
 		fprintf(stderr, "ldap_initialize: %s\n", ldap_err2string(rc));
-		exit(1);
+		return 0;
 	}
 	if (!profileonlyp)
 		init_sasl_arguments(ld, bind_options);
@@ -745,6 +1234,22 @@ do_connect(char *server, bind_options *bind_options,
 	return ld;
 }
 
+/*
+ * Connect for ldapvi --agent.
+ */
+static LDAP *
+agent_connection(cmdline *cmdline, char *dir)
+{
+	return do_connect(cmdline->server,
+			  &cmdline->bind_options,
+			  cmdline->referrals,
+			  cmdline->starttls,
+			  cmdline->tls,
+			  cmdline->deref,
+			  cmdline->profileonlyp,
+			  dir);
+}
+
 /*
  * fixme: brauchen wir das mit dem user?  dann sollten wir hier noch
  * sasl support vorsehen
@@ -869,8 +1374,10 @@ analyze_changes(tparser *p, GArray *offsets, char *clean, char *data,
 
 retry:
 	memset(&st, 0, sizeof(st));
-	rc = compare(
-		p, &statistics_handler, &st, offsets, clean, data, &pos, 0);
+	stats_begin(STATS_ANALYZE);
+	rc = compare_and_plan(
+		p, &statistics_handler, &st, offsets, clean, data, &pos);
+	stats_end(STATS_ANALYZE);
 
 	/* Success? */
 	if (rc == 0) {
@@ -927,17 +1434,23 @@ commit(tparser *p, LDAP *ld, GArray *offsets, char *clean, char *data,
 		ldapmodify_rename,
 		ldapmodify_add,
 		ldapmodify_delete,
-		ldapmodify_rename0
+		ldapmodify_rename0,
+		ldapmodify_nonleaf,
+		ldapmodify_delete_tree
 	};
+	int rc;
+
 	ctx.ld = ld;
 	ctx.controls = ctrls;
 	ctx.verbose = verbose;
 	ctx.noquestions = noquestions;
 	ctx.continuous = continuous;
 
-	switch (compare(p, &ldapmodify_handler, &ctx, offsets, clean, data, 0,
-			cmdline))
-	{
+	stats_begin(STATS_COMMIT);
+	rc = compare(p, &ldapmodify_handler, &ctx, offsets, clean, data, 0,
+		     cmdline);
+	stats_end(STATS_COMMIT);
+	switch (rc) {
 	case 0:
 		if (!cmdline->quiet)
 			puts("Done.");
@@ -1030,7 +1543,7 @@ skip(tparser *p, char *dataname, GArray *offsets, cmdline *cmdline)
 }
 
 static tentroid *
-entroid_set_entry(LDAP *ld, tentroid *entroid, tentry *entry)
+entroid_set_entry(tentroid *entroid, tentry *entry)
 {
 	int i;
 	tattribute *oc = entry_find_attribute(entry, "objectClass", 0);
@@ -1043,16 +1556,9 @@ entroid_set_entry(LDAP *ld, tentroid *entroid, tentry *entry)
 	values = attribute_values(oc);
 	for (i = 0; i < values->len; i++) {
 		GArray *av = g_ptr_array_index(values, i);
-		LDAPObjectClass *cls;
-
-		{
-			char zero = 0;
-			/* PFUSCH!  die GArrays muessen absolut weg! */
-			g_array_append_val(av, zero);
-			av->len--;
-		}
+		/* values are zero-terminated, see attribute_append_value */
+		LDAPObjectClass *cls = entroid_request_class(entroid, av->data);
 
-		cls = entroid_request_class(entroid, av->data);
 		if (!cls) {
 			g_string_append(entroid->comment, "# ");
 			g_string_append(entroid->comment, entroid->error->str);
@@ -1068,19 +1574,175 @@ entroid_set_entry(LDAP *ld, tentroid *entroid, tentry *entry)
 	return entroid;
 }
 
-struct annotation_context {
-	LDAP *ld;
-	FILE *out;
-	tparser *parser;
-	tentroid *entroid;
-};
+/*
+ * Annotation works like the search pipeline: the calling thread parses
+ * the data file, formatter threads compute the schema comments for each
+ * entry and print it into the buffer of its slot, and the calling thread
+ * writes the buffers in order.  Records other than entries are written
+ * directly, after everything before them.
+ */
+#define ANNOTATION_SLOTS 64
+
+enum annotation_state { ANNOTATION_EMPTY, ANNOTATION_PARSED,
+			ANNOTATION_FORMATTED };
+
+typedef struct tannotation {
+	enum annotation_state state;
+	char *key;
+	tentry *entry;
+	tobuffer buffer;
+} tannotation;
+
+typedef struct tannotator {
+	tschema *schema;
+	tentroid *entroid;	/* without threads */
+	int ldif;
+	tobuffer out;
+	tannotation slots[ANNOTATION_SLOTS];
+	int parsed;		/* entries handed to the formatters */
+	int formatting;		/* entries taken by a formatter */
+	int written;		/* entries written */
+	int done;		/* no more entries */
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t ready;
+#endif
+} tannotator;
+
+static void
+annotation_format(tannotator *a, tannotation *slot, tentroid *entroid)
+{
+	tentroid *e = entroid_set_entry(entroid, slot->entry);
+
+	if (a->ldif)
+		format_ldif_entry(&slot->buffer, slot->entry, slot->key, e);
+	else
+		format_ldapvi_entry(&slot->buffer, slot->entry, slot->key, e);
+}
+
+static void
+annotation_write(tannotator *a, tannotation *slot)
+{
+	obuffer_write(&a->out, slot->buffer.data, slot->buffer.len);
+	slot->buffer.len = 0;
+	/* here rather than in the formatter, see pool.c */
+	entry_free(slot->entry);
+	free(slot->key);
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *
+annotation_formatter(void *arg)
+{
+	tannotator *a = arg;
+	tentroid *entroid = entroid_new(a->schema);
+	tannotation *slot;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		while (a->formatting == a->parsed && !a->done)
+			pthread_cond_wait(&a->work, &a->lock);
+		if (a->formatting == a->parsed)
+			break;
+		slot = &a->slots[a->formatting++ % ANNOTATION_SLOTS];
+		pthread_mutex_unlock(&a->lock);
+		annotation_format(a, slot, entroid);
+		pthread_mutex_lock(&a->lock);
+		slot->state = ANNOTATION_FORMATTED;
+		pthread_cond_signal(&a->ready);
+	}
+	pthread_mutex_unlock(&a->lock);
+	entroid_free(entroid);
+	return 0;
+}
 
+/*
+ * Write formatted entries in order until at most N are pending.
+ */
+static void
+annotation_drain(tannotator *a, int n)
+{
+	tannotation *slot;
+
+	pthread_mutex_lock(&a->lock);
+	while (a->parsed - a->written > n) {
+		slot = &a->slots[a->written % ANNOTATION_SLOTS];
+		if (slot->state != ANNOTATION_FORMATTED) {
+			pthread_cond_wait(&a->ready, &a->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&a->lock);
+		annotation_write(a, slot);
+		pthread_mutex_lock(&a->lock);
+		slot->state = ANNOTATION_EMPTY;
+		a->written++;
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+static void
+annotation_add(tannotator *a, char *key, tentry *entry)
+{
+	tannotation *slot;
+
+	annotation_drain(a, ANNOTATION_SLOTS - 1);
+	slot = &a->slots[a->parsed % ANNOTATION_SLOTS];
+	slot->key = key;
+	slot->entry = entry;
+	pthread_mutex_lock(&a->lock);
+	slot->state = ANNOTATION_PARSED;
+	a->parsed++;
+	pthread_cond_signal(&a->work);
+	pthread_mutex_unlock(&a->lock);
+}
+#else
 static void
-annotate_entry(char *key, tentry *entry, void *userdata)
+annotation_drain(tannotator *a, int n)
 {
-	struct annotation_context *ctx = userdata;
-	tentroid *entroid = entroid_set_entry(ctx->ld, ctx->entroid, entry);
-	ctx->parser->print(ctx->out, entry, key, entroid);
+}
+
+static void
+annotation_add(tannotator *a, char *key, tentry *entry)
+{
+	tannotation *slot = &a->slots[0];
+
+	slot->key = key;
+	slot->entry = entry;
+	annotation_format(a, slot, a->entroid);
+	annotation_write(a, slot);
+}
+#endif
+
+static void
+annotate_file(FILE *in, tparser *p, thandler *h, tannotator *a, int addp)
+{
+	char *key = 0;
+
+	for (;;) {
+		long pos;
+
+		if (p->peek(in, -1, &key, &pos) == -1) exit(1);
+		if (!key) break;
+
+		if (ndecimalp(key)) {
+			tentry *entry;
+			if (p->entry(in, pos, 0, &entry, 0) == -1)
+				exit(1);
+			annotation_add(a, key, entry);
+		} else {
+			char *k = key;
+			if (!strcmp(key, "add") && !addp)
+				k = "replace";
+			annotation_drain(a, 0);
+			obuffer_flush(&a->out);
+			if (process_immediate(p, h, a->out.s, in, pos, k) < 0)
+				exit(1);
+			free(key);
+		}
+	}
+	annotation_drain(a, 0);
+	obuffer_flush(&a->out);
 }
 
 static void
@@ -1091,9 +1753,14 @@ rewrite_comments(LDAP *ld, char *dataname, cmdline *cmdline)
 	char *tmpname;
 	tparser *p = &ldapvi_parser;
 	thandler *h = &vdif_handler;
-	struct annotation_context ctx;
+	tannotator *a;
 	int addp = cmdline->ldapmodify_add;
-	tschema *schema = schema_new(ld);
+	tschema *schema = get_schema(ld);
+	int i;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t workers[PIPELINE_WORKERS];
+	int nworkers = pipeline_workers();
+#endif
 
 	if (!schema) {
 		fputs("Error: Failed to read schema.\n", stderr);
@@ -1109,17 +1776,47 @@ rewrite_comments(LDAP *ld, char *dataname, cmdline *cmdline)
 		p = &ldif_parser;
 		h = &ldif_handler;
 	}
-	ctx.ld = ld;
-	ctx.out = out;
-	ctx.entroid = entroid_new(schema);
-	ctx.parser = p;
-	parse_file(in, p, h, out, annotate_entry, &ctx, addp);
+
+	a = xalloc(sizeof(tannotator));
+	memset(a, 0, sizeof(tannotator));
+	a->schema = schema;
+	a->ldif = cmdline->ldif;
+	obuffer_init(&a->out, out);
+	for (i = 0; i < ANNOTATION_SLOTS; i++)
+		obuffer_init(&a->slots[i].buffer, 0);
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&a->lock, 0);
+	pthread_cond_init(&a->work, 0);
+	pthread_cond_init(&a->ready, 0);
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&workers[i], 0, annotation_formatter, a))
+			syserr();
+	annotate_file(in, p, h, a, addp);
+	pthread_mutex_lock(&a->lock);
+	a->done = 1;
+	pthread_cond_broadcast(&a->work);
+	pthread_mutex_unlock(&a->lock);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], 0);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->work);
+	pthread_cond_destroy(&a->ready);
+#else
+	a->entroid = entroid_new(schema);
+	annotate_file(in, p, h, a, addp);
+	entroid_free(a->entroid);
+#endif
+
+	for (i = 0; i < ANNOTATION_SLOTS; i++)
+		obuffer_free(&a->slots[i].buffer);
+	obuffer_free(&a->out);
+	free(a);
 
 	if (fclose(in) == EOF) syserr();
 	if (fclose(out) == EOF) syserr();
 	rename(tmpname, dataname);
 	free(tmpname);
-	schema_free(schema);
 }
 
 
@@ -1136,6 +1833,7 @@ forget_deletions(tparser *p, GArray *offsets, char *clean, char *data)
 		g_array_index(offsets, long, n) = -1;
 	}
 	g_array_free(deletions, 1);
+	discard_change_plan();
 }
 
 static void
@@ -1151,8 +1849,181 @@ append_sort_control(LDAP *ld, GPtrArray *ctrls, char *keystring)
 	g_ptr_array_add(ctrls, ctrl);
 }
 
+/*
+ * read_offsets() only needs the key and position of each record, so
+ * scan_entry() finds them without parsing entries.  Large files are
+ * split into chunks that are scanned in parallel, each starting at what
+ * looks like a record.  That guess can be wrong, so the result is only
+ * used if each chunk ended exactly where the next one started, else the
+ * file is scanned again in one go.
+ */
+#define SCAN_CHUNK_SIZE (16 << 20)
+
+typedef struct tscanchunk {
+	const char *map;
+	long size;
+	long start;
+	long end;		/* start of the next chunk */
+	long stop;		/* start of the first record not scanned */
+	long first;		/* key of the first record */
+	GArray *offsets;
+	int rc;
+} tscanchunk;
+
+static void *
+scan_chunk(void *arg)
+{
+	tscanchunk *c = arg;
+	long pos = c->start;
+
+	c->rc = -1;
+	for (;;) {
+		const char *key;
+		int keylen;
+		long start;
+		long n = 0;
+		int i;
+
+		if (scan_entry(c->map, c->size, &pos, &start, &key, &keylen))
+			return 0;
+		c->stop = start;
+		if (!key || start >= c->end)
+			break;
+		for (i = 0; i < keylen; i++) {
+			if (!isdigit((unsigned char) key[i]) || n > c->size)
+				return 0;
+			n = n * 10 + key[i] - '0';
+		}
+		if (!c->offsets->len)
+			c->first = n;
+		else if (n != c->first + c->offsets->len)
+			return 0;
+		g_array_append_val(c->offsets, start);
+	}
+	c->rc = 0;
+	return 0;
+}
+
+/*
+ * Guess where the first record after POS begins: at a key after an
+ * empty line.
+ */
+static long
+guess_record_start(const char *map, long size, long pos)
+{
+	const char *ptr;
+
+	while (pos < size - 2) {
+		if ( !(ptr = memchr(map + pos, '\n', size - 2 - pos)))
+			break;
+		pos = ptr - map + 1;
+		if (map[pos] == '\n' && isdigit((unsigned char) map[pos + 1]))
+			return pos + 1;
+	}
+	return -1;
+}
+
+/*
+ * Scan MAP in up to N chunks.
+ */
 static GArray *
-read_offsets(tparser *p, char *file)
+scan_offsets_1(const char *map, long size, int n)
+{
+	tscanchunk chunks[PIPELINE_WORKERS];
+	GArray *offsets = 0;
+	int nchunks = 1;
+	int i;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t threads[PIPELINE_WORKERS];
+#endif
+
+	chunks[0].start = 0;
+#ifdef HAVE_LIBPTHREAD
+	for (i = 1; i < n; i++) {
+		long start = guess_record_start(map, size, size / n * i);
+		if (start > chunks[nchunks - 1].start)
+			chunks[nchunks++].start = start;
+	}
+#endif
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].map = map;
+		chunks[i].size = size;
+		chunks[i].end = i + 1 < nchunks ? chunks[i + 1].start : size;
+		chunks[i].offsets = g_array_new(0, 0, sizeof(long));
+	}
+
+#ifdef HAVE_LIBPTHREAD
+	for (i = 1; i < nchunks; i++)
+		if (pthread_create(&threads[i], 0, scan_chunk, &chunks[i]))
+			syserr();
+#endif
+	scan_chunk(&chunks[0]);
+#ifdef HAVE_LIBPTHREAD
+	for (i = 1; i < nchunks; i++)
+		pthread_join(threads[i], 0);
+#endif
+
+	for (i = 0; i < nchunks; i++) {
+		tscanchunk *c = &chunks[i];
+		if (c->rc || c->stop != c->end)
+			goto cleanup;
+		if (c->offsets->len && c->first != (offsets ? offsets->len : 0))
+			goto cleanup;
+		if (!offsets) {
+			offsets = c->offsets;
+			c->offsets = 0;
+		} else
+			g_array_append_vals(
+				offsets, c->offsets->data, c->offsets->len);
+	}
+	return offsets;
+
+cleanup:
+	if (offsets)
+		g_array_free(offsets, 1);
+	for (i = 0; i < nchunks; i++)
+		if (chunks[i].offsets)
+			g_array_free(chunks[i].offsets, 1);
+	return 0;
+}
+
+/*
+ * Return the offsets of the ldapvi file FILE, or 0 if read_entry() is
+ * needed to read it.
+ */
+static GArray *
+scan_offsets(char *file)
+{
+	struct stat st;
+	GArray *offsets;
+	char *map;
+	int fd;
+	int n = 1;
+
+	if ( (fd = open(file, O_RDONLY)) == -1) syserr();
+	if (fstat(fd, &st) == -1) syserr();
+	if (!st.st_size) {
+		if (close(fd) == -1) syserr();
+		return g_array_new(0, 0, sizeof(long));
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) syserr();
+	if (close(fd) == -1) syserr();
+#ifdef HAVE_LIBPTHREAD
+	if (st.st_size / SCAN_CHUNK_SIZE < pipeline_workers())
+		n = st.st_size / SCAN_CHUNK_SIZE;
+	else
+		n = pipeline_workers();
+#endif
+	offsets = scan_offsets_1(map, st.st_size, n);
+	if (!offsets && n > 1)
+		offsets = scan_offsets_1(map, st.st_size, 1);
+	if (munmap(map, st.st_size) == -1) syserr();
+	return offsets;
+}
+
+static GArray *
+parse_offsets(tparser *p, char *file)
 {
 	GArray *offsets = g_array_new(0, 0, sizeof(long));
 	FILE *s;
@@ -1186,10 +2057,46 @@ read_offsets(tparser *p, char *file)
 	return offsets;
 }
 
+static GArray *
+read_offsets(tparser *p, char *file)
+{
+	GArray *offsets;
+
+	if (p == &ldapvi_parser && (offsets = scan_offsets(file)))
+		return offsets;
+	return parse_offsets(p, file);
+}
+
+/*
+ * If FILE is compressed, decompress it into the temporary directory
+ * and return the name of the copy.  Else return FILE itself.
+ */
+static char *
+uncompressed_file(char *file, char *dir, char *name)
+{
+	FILE *in, *out;
+
+	if ( !(in = fopen(file, "r"))) syserr();
+	if (compressed_stream_p(in)) {
+		ensure_tmp_directory(dir);
+		file = append(dir, name);
+		if ( !(out = fopen(file, "w"))) syserr();
+		uncompress_copy(in, out);
+		if (fclose(out) == EOF) syserr();
+	}
+	if (fclose(in) == EOF) syserr();
+	return file;
+}
+
 static void
 offline_diff(tparser *p, char *a, char *b)
 {
-	GArray *offsets = read_offsets(p, a);
+	char *dir = tmp_directory_template(0);
+	GArray *offsets;
+
+	a = uncompressed_file(a, dir, "/clean");
+	b = uncompressed_file(b, dir, "/data");
+	offsets = read_offsets(p, a);
 	compare(p, &ldif_handler, stdout, offsets, a, b, 0, 0);
 	g_array_free(offsets, 1);
 }
@@ -1325,7 +2232,7 @@ add_template(LDAP *ld, FILE *s, GPtrArray *wanted, char *base)
 	tentroid *entroid;
 	LDAPObjectClass *cls;
 	LDAPAttributeType *at;
-	tschema *schema = schema_new(ld);
+	tschema *schema = get_schema(ld);
 
 	if (!schema) {
 		fputs("Error: Failed to read schema, giving up.\n", stderr);
@@ -1373,39 +2280,6 @@ add_template(LDAP *ld, FILE *s, GPtrArray *wanted, char *base)
 	}
 
 	entroid_free(entroid);
-	schema_free(schema);
-}
-
-static void
-parse_file(FILE *in,
-	   tparser *p, thandler *h, void *userdata,
-	   handler_entry hentry, void *entrydata,
-	   int addp)
-{
-	char *key = 0;
-
-	for (;;) {
-		long pos;
-
-		if (p->peek(in, -1, &key, &pos) == -1) exit(1);
-		if (!key) break;
-
-		if (ndecimalp(key)) {
-			tentry *entry;
-			if (p->entry(in, pos, 0, &entry, 0) == -1)
-				exit(1);
-			if (hentry)
-				hentry(key, entry, entrydata);
-			entry_free(entry);
-		} else {
-			char *k = key;
-			if (!strcmp(key, "add") && !addp)
-				k = "replace";
-			if (process_immediate(p, h, userdata, in, pos, k) < 0)
-				exit(1);
-		}
-		free(key);
-	}
 }
 
 static int
@@ -1470,7 +2344,7 @@ copy_sasl_output(FILE *out, char *sasl)
 	int line = 0;
 	int c;
 
-	if (lstat(sasl, &st) == -1) return;
+	if (lstat(sasl, &st) == -1) return 0;
 	if ( !(in = fopen(sasl, "r"))) syserr();
 
 	if (st.st_size > 0) {
@@ -1530,22 +2404,26 @@ main_write_files(
 		if (cmdline->in_file) {
 			if ( !(source = fopen(cmdline->in_file, "r+")))
 				syserr();
-		} else {
-			if (!source)
-				source = stdin;
-			if (!can_seek(source)) {
-				/* einfach clean als tmpfile nehmen */
-				if ( !(tmp = fopen(clean, "w+"))) syserr();
-				fcopy(source, tmp);
-				if (fseek(tmp, 0, SEEK_SET) == -1) syserr();
-				source = tmp;
-				/* source war stdin, kann offen bleiben */
-			}
+		} else if (!source)
+			source = stdin;
+		if (!can_seek(source) || compressed_stream_p(source)) {
+			/* einfach clean als tmpfile nehmen */
+			if ( !(tmp = fopen(clean, "w+"))) syserr();
+			uncompress_copy(source, tmp);
+			if (fseek(tmp, 0, SEEK_SET) == -1) syserr();
+			if (cmdline->in_file)
+				if (fclose(source) == EOF) syserr();
+			/* stdin kann offen bleiben */
+			source = tmp;
 		}
 
 		if (cmdline->ldif) h = &ldif_handler;
 		if (cmdline->ldapvi) p = &ldapvi_parser;
-		parse_file(source, p, h, s, 0, 0, cmdline->ldapmodify_add);
+		stats_begin(STATS_WRITE);
+		if (process_stream(source, p, h, s, 0, 0,
+				   cmdline->ldapmodify_add,
+				   !cmdline->continuous))
+			exit(1);
 
 		if (cmdline->in_file)
 			if (fclose(source) == EOF) syserr();
@@ -1553,8 +2431,10 @@ main_write_files(
 			if (unlink(clean) == -1) syserr();
 		if (fclose(s) == EOF) syserr();
 		cp("/dev/null", clean, 0, 0);
+		stats_end(STATS_WRITE);
 		offsets = g_array_new(0, 0, sizeof(long));
 	} else if (cmdline->classes || cmdline->mode != ldapvi_mode_edit) {
+		stats_begin(STATS_WRITE);
 		if (!cmdline->classes)
 			add_changerecord(s, cmdline);
 		else if (cmdline->classes->len) {
@@ -1566,12 +2446,22 @@ main_write_files(
 			fputc('\n', s);
 		if (fclose(s) == EOF) syserr();
 		cp("/dev/null", clean, 0, 0);
+		stats_end(STATS_WRITE);
 		offsets = g_array_new(0, 0, sizeof(long));
 	} else {
+		long pos = ftell(s);
+		tlineindex *lineindex;
+
+		if (pos == -1) syserr();
+		lineindex = line_index_new(data, pos, line);
 		offsets = search(s, ld, cmdline, (void *) ctrls->pdata, 0,
-				 cmdline->ldif);
+				 cmdline->ldif, lineindex,
+				 search_schema(ld, cmdline));
+		stats_begin(STATS_WRITE);
 		if (fclose(s) == EOF) syserr();
+		line_index_install(lineindex);
 		cp(data, clean, 0, 0);
+		stats_end(STATS_WRITE);
 	}
 
 	*nlines = line;
@@ -1643,6 +2533,7 @@ main_loop(LDAP *ld, cmdline *cmdline,
 			break;
 		case 'r':
 			ldap_unbind_s(ld);
+			stats_begin(STATS_CONNECT);
 			ld = do_connect(
 				cmdline->server,
 				&cmdline->bind_options,
@@ -1652,6 +2543,7 @@ main_loop(LDAP *ld, cmdline *cmdline,
 				cmdline->deref,
 				1,
 				0);
+			stats_end(STATS_CONNECT);
 			printf("Connected to %s.\n", cmdline->server);
 			changed = 1; /* print stats again */
 			break;
@@ -1703,7 +2595,7 @@ main(int argc, const char **argv)
 	LDAP *ld;
 	cmdline cmdline;
 	GPtrArray *ctrls = g_ptr_array_new();
-	static char dir[] = "/tmp/ldapvi-XXXXXX";
+	char *dir;
 	char *clean;
 	char *data;
 	char *sasl;
@@ -1727,6 +2619,8 @@ main(int argc, const char **argv)
 	}
 
 	parse_arguments(argc, argv, &cmdline, ctrls);
+	stats_init(cmdline.stats);
+	dir = tmp_directory_template(cmdline.tmpdir);
 	if (fixup_streams(&source_stream, &target_stream) == -1)
 		cmdline.noninteractive = 1;
 	if (cmdline.noninteractive) {
@@ -1734,6 +2628,10 @@ main(int argc, const char **argv)
 		cmdline.quiet = 1;
 		cmdline.bind_options.dialog = BD_NEVER;
 	}
+	if (cmdline.compress
+	    && !(cmdline.mode == ldapvi_mode_out
+		 || (cmdline.mode == ldapvi_mode_edit && target_stream)))
+		yourfault("--compress only works with --out.");
 	if (cmdline.ldif)
 		parser = &ldif_parser;
 	else
@@ -1741,14 +2639,22 @@ main(int argc, const char **argv)
 	read_ldapvi_history();
 
 	setupterm(0, 1, 0);
-	ld = do_connect(cmdline.server,
-			&cmdline.bind_options,
-			cmdline.referrals,
-			cmdline.starttls,
-			cmdline.tls,
-			cmdline.deref,
-			cmdline.profileonlyp,
-			dir);
+	if (cmdline.agent)
+		agent_main(&cmdline, agent_connection, dir);
+	stats_begin(STATS_CONNECT);
+	ld = 0;
+	if (!cmdline.noagent)
+		ld = agent_connect(&cmdline);
+	if (!ld)
+		ld = do_connect(cmdline.server,
+				&cmdline.bind_options,
+				cmdline.referrals,
+				cmdline.starttls,
+				cmdline.tls,
+				cmdline.deref,
+				cmdline.profileonlyp,
+				dir);
+	stats_end(STATS_CONNECT);
 	if (!ld) {
 		write_ldapvi_history();
 		exit(1);
@@ -1758,12 +2664,9 @@ main(int argc, const char **argv)
 		append_sort_control(ld, ctrls, cmdline.sortkeys);
 	g_ptr_array_add(ctrls, 0);
 
-	if (cmdline.discover) {
-		if (cmdline.basedns->len > 0)
-			yourfault("Conflicting options given:"
-				  " --base and --discover.");
-		discover_naming_contexts(ld, cmdline.basedns);
-	}
+	if (cmdline.discover && cmdline.basedns->len > 0)
+		yourfault("Conflicting options given: --base and --discover.");
+	startup(ld, &cmdline, (void *) ctrls->pdata);
 
 	if (cmdline.config) {
 		write_config(ld, target_stream, &cmdline);
@@ -1781,7 +2684,8 @@ main(int argc, const char **argv)
 		search(target_stream, ld, &cmdline, (void *) ctrls->pdata, 1,
 		       cmdline.mode == ldapvi_mode_out
 		       ? !cmdline.ldapvi
-		       : cmdline.ldif);
+		       : cmdline.ldif,
+		       0, search_schema(ld, &cmdline));
 		write_ldapvi_history();
 		exit(0);
 	}
@@ -0,0 +1,362 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "common.h"
+#include "config.h"
+#include "libldapvi.h"
+
+/*
+ * The entry points of libldapvi, see libldapvi.h.  Each of them installs
+ * an error catcher, so that syserr() and friends return here instead of
+ * ending the process, and passes an adapter to the thandler code that
+ * translates to the public ldapvi_handler.
+ */
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_TLS)
+static __thread char message[256];
+#else
+static char message[256];
+#endif
+
+typedef struct tadapter {
+	ldapvi_handler *handler;
+	void *userdata;
+} tadapter;
+
+static tparser *
+syntax_parser(int syntax)
+{
+	return syntax == LDAPVI_SYNTAX_LDIF ? &ldif_parser : &ldapvi_parser;
+}
+
+static int
+caught(terrorcatcher *catcher)
+{
+	strcpy(message, catcher->message);
+	return -1;
+}
+
+static int
+adapter_entry(char *key, tentry *entry, void *userdata)
+{
+	tadapter *a = userdata;
+	LDAPMod **attrs = entry2mods(entry);
+	int rc = a->handler->entry(key, entry_dn(entry), attrs, a->userdata);
+	ldap_mods_free(attrs, 1);
+	return rc;
+}
+
+static int
+adapter_change(int key, char *olddn, char *newdn, LDAPMod **mods,
+	       void *userdata)
+{
+	tadapter *a = userdata;
+	if (!a->handler->change)
+		return 0;
+	return a->handler->change(key, olddn, newdn, mods, a->userdata);
+}
+
+static int
+adapter_rename(int key, char *olddn, tentry *modified, void *userdata)
+{
+	tadapter *a = userdata;
+	int deleteoldrdn;
+
+	if (!a->handler->rename)
+		return 0;
+	deleteoldrdn = frob_rdn(modified, olddn, FROB_RDN_CHECK) == -1;
+	return a->handler->rename(
+		key, olddn, entry_dn(modified), deleteoldrdn, a->userdata);
+}
+
+static int
+adapter_add(int key, char *dn, LDAPMod **mods, void *userdata)
+{
+	tadapter *a = userdata;
+	if (!a->handler->add)
+		return 0;
+	return a->handler->add(key, dn, mods, a->userdata);
+}
+
+static int
+adapter_delete(int key, char *dn, void *userdata)
+{
+	tadapter *a = userdata;
+	if (!a->handler->remove)
+		return 0;
+	return a->handler->remove(key, dn, a->userdata);
+}
+
+static int
+adapter_rename0(int key, char *dn1, char *dn2, int deleteoldrdn,
+		void *userdata)
+{
+	tadapter *a = userdata;
+	if (!a->handler->rename)
+		return 0;
+	return a->handler->rename(key, dn1, dn2, deleteoldrdn, a->userdata);
+}
+
+static thandler adapter_handler = {
+	adapter_change,
+	adapter_rename,
+	adapter_add,
+	adapter_delete,
+	adapter_rename0
+};
+
+int
+ldapvi_stream(FILE *in, int syntax, int addp,
+	      ldapvi_handler *handler, void *userdata)
+{
+	terrorcatcher catcher;
+	tadapter a;
+	int rc;
+
+	a.handler = handler;
+	a.userdata = userdata;
+	message[0] = 0;
+	error_catch(&catcher);
+	if (setjmp(catcher.jmp))
+		return caught(&catcher);
+	rc = process_stream(in, syntax_parser(syntax), &adapter_handler, &a,
+			    handler->entry ? adapter_entry : 0, &a, addp, 0);
+	error_uncatch(&catcher);
+	if (rc == -1)
+		strcpy(message, "Syntax error.");
+	return rc;
+}
+
+/*
+ * Like parse_offsets() in ldapvi.c.
+ */
+static int
+read_offsets(tparser *p, FILE *clean, GArray *offsets)
+{
+	for (;;) {
+		long offset;
+		char *key = 0;
+		char *ptr;
+		tentry *entry;
+		int n;
+
+		if (p->entry(clean, -1, &key, &entry, &offset) == -1) {
+			strcpy(message, "Syntax error in clean file.");
+			return -1;
+		}
+		if (!key)
+			return 0;
+		n = strtol(key, &ptr, 10);
+		if (*ptr || n != offsets->len) {
+			snprintf(message, sizeof(message),
+				 "Unexpected key in clean file: `%s'.", key);
+			free(key);
+			entry_free(entry);
+			return -1;
+		}
+		free(key);
+		entry_free(entry);
+		g_array_append_val(offsets, offset);
+	}
+}
+
+int
+ldapvi_diff(FILE *clean, FILE *data, int syntax,
+	    ldapvi_handler *handler, void *userdata,
+	    long *error_position)
+{
+	terrorcatcher catcher;
+	tparser *p = syntax_parser(syntax);
+	GArray *offsets;
+	tadapter a;
+	long pos = 0;
+	long syntaxpos = 0;
+	int rc;
+
+	a.handler = handler;
+	a.userdata = userdata;
+	message[0] = 0;
+	error_catch(&catcher);
+	if (setjmp(catcher.jmp))
+		return caught(&catcher);
+	offsets = g_array_new(0, 0, sizeof(long));
+	rc = read_offsets(p, clean, offsets);
+	if (!rc)
+		rc = compare_streams(p, &adapter_handler, &a, offsets, clean,
+				     data, &pos, &syntaxpos);
+	g_array_free(offsets, 1);
+	error_uncatch(&catcher);
+	if (rc && error_position)
+		*error_position = pos;
+	if (rc == -1 && !*message)
+		snprintf(message, sizeof(message),
+			 "Syntax error at position %ld.", syntaxpos);
+	return rc;
+}
+
+/*
+ * The opposite of entry2mods().
+ */
+static tentry *
+mods2entry(char *dn, LDAPMod **attrs)
+{
+	tentry *entry = entry_new(xdup(dn));
+	int i, j;
+
+	for (i = 0; attrs[i]; i++) {
+		LDAPMod *m = attrs[i];
+		tattribute *a = entry_find_attribute(entry, m->mod_type, 1);
+
+		if (m->mod_op & LDAP_MOD_BVALUES) {
+			if (m->mod_bvalues)
+				for (j = 0; m->mod_bvalues[j]; j++)
+					attribute_append_value(
+						a,
+						m->mod_bvalues[j]->bv_val,
+						m->mod_bvalues[j]->bv_len);
+		} else if (m->mod_values)
+			for (j = 0; m->mod_values[j]; j++)
+				attribute_append_value(
+					a,
+					m->mod_values[j],
+					strlen(m->mod_values[j]));
+	}
+	return entry;
+}
+
+int
+ldapvi_print_entry(FILE *out, int syntax, char *key, char *dn,
+		   LDAPMod **attrs)
+{
+	terrorcatcher catcher;
+	tentry *entry;
+
+	message[0] = 0;
+	error_catch(&catcher);
+	if (setjmp(catcher.jmp))
+		return caught(&catcher);
+	entry = mods2entry(dn, attrs);
+	syntax_parser(syntax)->print(out, entry, key ? key : "add", 0);
+	entry_free(entry);
+	error_uncatch(&catcher);
+	return 0;
+}
+
+
+/*****************************************
+ * printers
+ */
+static int
+ldif_entry(char *key, char *dn, LDAPMod **attrs, void *userdata)
+{
+	return ldapvi_print_entry(
+		userdata, LDAPVI_SYNTAX_LDIF, key, dn, attrs);
+}
+
+static int
+ldif_change(int key, char *olddn, char *newdn, LDAPMod **mods,
+	    void *userdata)
+{
+	print_ldif_modify(userdata, newdn, mods);
+	return 0;
+}
+
+static int
+ldif_rename(int key, char *olddn, char *newdn, int deleteoldrdn,
+	    void *userdata)
+{
+	print_ldif_rename(userdata, olddn, newdn, deleteoldrdn);
+	return 0;
+}
+
+static int
+ldif_add(int key, char *dn, LDAPMod **attrs, void *userdata)
+{
+	print_ldif_add(userdata, dn, attrs);
+	return 0;
+}
+
+static int
+ldif_delete(int key, char *dn, void *userdata)
+{
+	print_ldif_delete(userdata, dn);
+	return 0;
+}
+
+static ldapvi_handler ldif_printer = {
+	ldif_entry,
+	ldif_change,
+	ldif_rename,
+	ldif_add,
+	ldif_delete
+};
+
+static int
+vdif_entry(char *key, char *dn, LDAPMod **attrs, void *userdata)
+{
+	return ldapvi_print_entry(
+		userdata, LDAPVI_SYNTAX_LDAPVI, key, dn, attrs);
+}
+
+static int
+vdif_change(int key, char *olddn, char *newdn, LDAPMod **mods,
+	    void *userdata)
+{
+	print_ldapvi_modify(userdata, newdn, mods);
+	return 0;
+}
+
+static int
+vdif_rename(int key, char *olddn, char *newdn, int deleteoldrdn,
+	    void *userdata)
+{
+	print_ldapvi_rename(userdata, olddn, newdn, deleteoldrdn);
+	return 0;
+}
+
+static int
+vdif_add(int key, char *dn, LDAPMod **attrs, void *userdata)
+{
+	print_ldapvi_add(userdata, dn, attrs);
+	return 0;
+}
+
+static int
+vdif_delete(int key, char *dn, void *userdata)
+{
+	print_ldapvi_delete(userdata, dn);
+	return 0;
+}
+
+static ldapvi_handler vdif_printer = {
+	vdif_entry,
+	vdif_change,
+	vdif_rename,
+	vdif_add,
+	vdif_delete
+};
+
+ldapvi_handler *
+ldapvi_printer(int syntax)
+{
+	return syntax == LDAPVI_SYNTAX_LDIF ? &ldif_printer : &vdif_printer;
+}
+
+char *
+ldapvi_error(void)
+{
+	return message;
+}
@@ -0,0 +1,104 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef LIBLDAPVI_H
+#define LIBLDAPVI_H
+
+/*
+ * libldapvi: the parsers, the comparison of a clean and a modified file,
+ * and the printers of ldapvi, for use in other programs.
+ *
+ * No function exits the process.  On failure, they return
+ *   -1 on syntax errors, and on system or LDAP errors
+ *   -2 if a handler method returned -1
+ * and ldapvi_error() has a message for -1.  Syntax errors are also
+ * reported on stderr, as by ldapvi.
+ *
+ * Calls in different threads are independent if libldapvi was built with
+ * thread-local storage (HAVE_TLS in config.h), and must not overlap
+ * otherwise.  Within one thread, calls must not be nested, except from
+ * handler methods.
+ */
+#include <stdio.h>
+#include <ldap.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum ldapvi_syntax { LDAPVI_SYNTAX_LDAPVI, LDAPVI_SYNTAX_LDIF };
+
+/*
+ * Handler methods return 0 to go on and -1 to stop.  All of them are
+ * optional.  KEY is the number of the record, or -1 for change records.
+ * Arguments belong to the caller and are only valid during the call.
+ *
+ * entry	a numbered entry read by ldapvi_stream(), as a list of
+ *		LDAP_MOD_BVALUES mods
+ * change	modify OLDDN, which is to be renamed to NEWDN, by MODS
+ * rename	rename OLDDN to NEWDN.  Entries below OLDDN move along, and
+ *		are not renamed again.
+ * add		add an entry
+ * remove	delete an entry.  Return -2 if it still has children; the
+ *		deletion is retried after the other ones.
+ */
+typedef struct ldapvi_handler {
+	int (*entry)(char *key, char *dn, LDAPMod **attrs, void *userdata);
+	int (*change)(int key, char *olddn, char *newdn, LDAPMod **mods,
+		      void *userdata);
+	int (*rename)(int key, char *olddn, char *newdn, int deleteoldrdn,
+		      void *userdata);
+	int (*add)(int key, char *dn, LDAPMod **attrs, void *userdata);
+	int (*remove)(int key, char *dn, void *userdata);
+} ldapvi_handler;
+
+/*
+ * Read all records of IN in SYNTAX and call HANDLER for each.  If ADDP
+ * is false, "add" records replace the attributes of existing entries.
+ */
+int ldapvi_stream(FILE *in, int syntax, int addp,
+		  ldapvi_handler *handler, void *userdata);
+
+/*
+ * Compare CLEAN, whose entries are numbered from zero, to its modified
+ * copy DATA, and call HANDLER for each change.  CLEAN must be open for
+ * reading and writing.  If ERROR_POSITION is not null, it is set to the
+ * offset in DATA of the record that failed.
+ */
+int ldapvi_diff(FILE *clean, FILE *data, int syntax,
+		ldapvi_handler *handler, void *userdata,
+		long *error_position);
+
+/*
+ * A handler that writes entries and changes in SYNTAX to the stream
+ * passed as userdata.
+ */
+ldapvi_handler *ldapvi_printer(int syntax);
+
+int ldapvi_print_entry(FILE *out, int syntax, char *key, char *dn,
+		       LDAPMod **attrs);
+
+/*
+ * The message for the last error in this thread.
+ */
+char *ldapvi_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
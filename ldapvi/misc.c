@@ -15,43 +15,74 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define _GNU_SOURCE
 #include <curses.h>
 #include <term.h>
+#include <sys/mman.h>
 #include "common.h"
+#include "config.h"
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 #include <readline/readline.h>
 #include <readline/history.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-int
-carray_cmp(GArray *a, GArray *b)
-{
-	int d = memcmp(a->data, b->data, MIN(a->len, b->len));
-	if (d) return d;
-	if (a->len < b->len)
-		return -1;
-	else if (a->len == b->len)
-		return 0;
-	else
-		return 1;
-}
+#define COPY_BUFFER_SIZE (1 << 20)
 
-int
-carray_ptr_cmp(const void *aa, const void *bb)
+/*
+ * Let the kernel copy from FDSRC to FDDST, starting at *OFFSET if
+ * given, at the file position of FDSRC otherwise.  Return -1 without
+ * having copied anything if that isn't possible for these files.
+ */
+static int
+copy_range(int fdsrc, off_t *offset, int fddst)
 {
-	GArray *a = *((GArray **) aa);
-	GArray *b = *((GArray **) bb);
-	return carray_cmp(a ,b);
+#ifdef HAVE_COPY_FILE_RANGE
+	int started = 0;
+	ssize_t n;
+
+	for (;;) {
+		n = copy_file_range(
+			fdsrc, offset, fddst, 0, COPY_BUFFER_SIZE * 64, 0);
+		if (n == -1) {
+			if (started) syserr();
+			switch (errno) {
+			case EXDEV:
+			case EINVAL:
+			case EBADF:
+			case ENOSYS:
+			case EOPNOTSUPP:
+				return -1;
+			default:
+				syserr();
+			}
+		}
+		if (!n)
+			return 0;
+		started = 1;
+	}
+#else
+	return -1;
+#endif
 }
 
 void
 fdcp(int fdsrc, int fddst)
 {
-	int n;
-	char buf[4096];
+	ssize_t n;
+	char *buf;
 
+	if (copy_range(fdsrc, 0, fddst) != -1)
+		return;
+	buf = xalloc(COPY_BUFFER_SIZE);
 	do {
-		if ( (n = read(fdsrc, buf, sizeof(buf))) == -1) syserr();
+		if ( (n = read(fdsrc, buf, COPY_BUFFER_SIZE)) == -1) syserr();
 		if (write(fddst, buf, n) != n) syserr();
 	} while (n);
+	free(buf);
 }
 
 void
@@ -63,7 +94,11 @@ cp(char *src, char *dst, off_t skip, int append)
 	if ( (fdsrc = open(src, O_RDONLY)) == -1) syserr();
 	if (lseek(fdsrc, skip, SEEK_SET) == -1) syserr();
 	if ( (fddst = open(dst, flags, 0600)) == -1) syserr();
-	fdcp(fdsrc, fddst);
+#ifdef FICLONE
+	/* share the blocks if the file system can do that */
+	if (skip || append || ioctl(fddst, FICLONE, fdsrc) == -1)
+#endif
+		fdcp(fdsrc, fddst);
 	if (close(fdsrc) == -1) syserr();
 	if (close(fddst) == -1) syserr();
 }
@@ -71,16 +106,33 @@ cp(char *src, char *dst, off_t skip, int append)
 void
 fcopy(FILE *src, FILE *dst)
 {
-	int n;
-	char buf[4096];
+	size_t n;
+	char *buf;
+	off_t pos;
+
+	/*
+	 * Both streams are on files: hand the rest of SRC to the kernel,
+	 * then bring the stdio positions back in sync.
+	 */
+	if (fflush(dst) == EOF) syserr();
+	if ( (pos = ftello(src)) != -1
+	     && copy_range(fileno(src), &pos, fileno(dst)) != -1)
+	{
+		if (fseeko(src, pos, SEEK_SET) == -1) syserr();
+		if ( (pos = lseek(fileno(dst), 0, SEEK_CUR)) == -1) syserr();
+		if (fseeko(dst, pos, SEEK_SET) == -1) syserr();
+		return;
+	}
 
+	buf = xalloc(COPY_BUFFER_SIZE);
 	for (;;) {
-		if ( (n = fread(buf, 1, sizeof(buf), src)) == 0) {
+		if ( (n = fread(buf, 1, COPY_BUFFER_SIZE, src)) == 0) {
 			if (feof(src)) break;
 			syserr();
 		}
 		if (fwrite(buf, 1, n, dst) != n) syserr();
 	}
+	free(buf);
 }
 
 static void
@@ -127,30 +179,160 @@ choose(char *prompt, char *charbag, char *help)
 	return c;
 }
 
+long
+count_newlines(const char *ptr, size_t n)
+{
+	const char *end = ptr + n;
+	long result = 0;
+#ifdef __SSE2__
+	__m128i nl = _mm_set1_epi8('\n');
+	__m128i zero = _mm_setzero_si128();
+
+	while (end - ptr >= 16) {
+		__m128i acc = zero;
+		int i;
+
+		/* per-byte counters, summed up before they can overflow */
+		for (i = 0; i < 255 && end - ptr >= 16; i++, ptr += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *) ptr);
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(x, nl));
+		}
+		acc = _mm_sad_epu8(acc, zero);
+		result += _mm_cvtsi128_si32(acc)
+			+ _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+#endif
+	while ( (ptr = memchr(ptr, '\n', end - ptr))) {
+		result++;
+		ptr++;
+	}
+	return result;
+}
+
+/*
+ * Sparse line index for the data file, built while it is written:
+ * Every LINE_INDEX_STEP bytes or so, remember how many newlines came
+ * before that offset.  The index is only trusted as long as the file
+ * still looks the way it did after writing.
+ */
+static tlineindex *line_index = 0;
+
+tlineindex *
+line_index_new(char *pathname, long pos, long nl)
+{
+	tlineindex *li = xalloc(sizeof(tlineindex));
+	li->pathname = xdup(pathname);
+	li->offsets = g_array_new(0, 0, sizeof(long));
+	li->counts = g_array_new(0, 0, sizeof(long));
+	li->pos = pos;
+	li->nl = nl;
+	li->last = 0;
+	return li;
+}
+
+void
+line_index_note(tlineindex *li, const char *ptr, size_t n)
+{
+	li->nl += count_newlines(ptr, n);
+	li->pos += n;
+	if (li->pos - li->last >= LINE_INDEX_STEP) {
+		g_array_append_val(li->offsets, li->pos);
+		g_array_append_val(li->counts, li->nl);
+		li->last = li->pos;
+	}
+}
+
+static void
+line_index_free(tlineindex *li)
+{
+	free(li->pathname);
+	g_array_free(li->offsets, 1);
+	g_array_free(li->counts, 1);
+	free(li);
+}
+
+/*
+ * Call this once the file has been closed.  From now on, edit_pos()
+ * uses INDEX for its file.
+ */
+void
+line_index_install(tlineindex *li)
+{
+	if (stat(li->pathname, &li->st) == -1) syserr();
+	if (line_index)
+		line_index_free(line_index);
+	line_index = li;
+}
+
+/*
+ * Find the last checkpoint before POS in PATHNAME, unless the file has
+ * changed since it was indexed.  Return the number of newlines before
+ * *START.
+ */
+static long
+line_index_lookup(char *pathname, struct stat *st, long pos, long *start)
+{
+	tlineindex *li = line_index;
+	long *offsets;
+	int lo, hi;
+
+	*start = 0;
+	if (!li || strcmp(li->pathname, pathname)
+	    || st->st_ino != li->st.st_ino
+	    || st->st_dev != li->st.st_dev
+	    || st->st_size != li->st.st_size
+	    || st->st_mtime != li->st.st_mtime)
+		return 0;
+
+	offsets = (long *) li->offsets->data;
+	lo = 0;
+	hi = li->offsets->len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (offsets[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return 0;
+	*start = offsets[lo - 1];
+	return g_array_index(li->counts, long, lo - 1);
+}
+
+/*
+ * Return the line containing byte POS, counting from 1.  The scan
+ * starts at the closest checkpoint of the line index, if usable, and
+ * runs over a mapping of the file rather than through stdio.
+ */
 static long
 line_number(char *pathname, long pos)
 {
-	FILE *f;
+	struct stat st;
+	long start;
 	long line = 1;
-	int c;
-
-	if ( !(f = fopen(pathname, "r+"))) syserr();
-	while (pos > 0) {
-		switch ( c = getc_unlocked(f)) {
-		case EOF:
-			goto done;
-		case '\n':
-			if ( (c = getc_unlocked(f)) != EOF) {
-				ungetc(c, f);
-				line++;
-			}
-			/* fall through */
-		default:
-			pos--;
-		}
+	int fd;
+
+	if ( (fd = open(pathname, O_RDONLY)) == -1) syserr();
+	if (fstat(fd, &st) == -1) syserr();
+	if (pos > st.st_size)
+		pos = st.st_size;
+	line += line_index_lookup(pathname, &st, pos, &start);
+
+	if (pos > start) {
+		long page = sysconf(_SC_PAGESIZE);
+		long base = start - start % page;
+		char *data;
+
+		data = mmap(0, pos - base, PROT_READ, MAP_SHARED, fd, base);
+		if (data == MAP_FAILED) syserr();
+		line += count_newlines(data + (start - base), pos - start);
+		/* a newline at the very end doesn't start another line */
+		if (pos == st.st_size && data[pos - base - 1] == '\n')
+			line--;
+		if (munmap(data, pos - base) == -1) syserr();
 	}
-done:
-	if (fclose(f) == EOF) syserr();
+	if (close(fd) == -1) syserr();
 	return line;
 }
 
@@ -165,6 +347,7 @@ edit(char *pathname, long line)
 	if (!vi) vi = getenv("EDITOR");
 	if (!vi) vi = "vi";
 
+	stats_begin(STATS_EDITOR);
 	switch ( (childpid = fork())) {
 	case -1:
 		syserr();
@@ -181,6 +364,7 @@ edit(char *pathname, long line)
 	}
 
 	if (waitpid(childpid, &status, 0) == -1) syserr();
+	stats_end(STATS_EDITOR);
 	if (!WIFEXITED(status) || WEXITSTATUS(status))
 		yourfault("editor died");
 }
@@ -395,53 +579,6 @@ append(char *a, char *b)
 	return result;
 }
 
-void *
-xalloc(size_t size)
-{
-	void *result = malloc(size);
-	if (!result) {
-		write(2, "\nmalloc error\n", sizeof("\nmalloc error\n") - 1);
-		_exit(2);
-	}
-	return result;
-}
-
-char *
-xdup(char *str)
-{
-	char *result;
-
-	if (!str)
-		return str;
-	if (!(result = strdup(str))) {
-		write(2, "\nstrdup error\n", sizeof("\nstrdup error\n") - 1);
-		_exit(2);
-	}
-	return result;
-}
-
-int
-adjoin_str(GPtrArray *strs, char *str)
-{
-	int i;
-	for (i = 0; i < strs->len; i++)
-		if (!strcmp(str, g_ptr_array_index(strs, i)))
-			return -1;
-	g_ptr_array_add(strs, str);
-	return i;
-}
-
-int
-adjoin_ptr(GPtrArray *a, void *p)
-{
-	int i;
-	for (i = 0; i < a->len; i++)
-		if (g_ptr_array_index(a, i) == p)
-			return -1;
-	g_ptr_array_add(a, p);
-	return i;
-}
-
 void
 dumb_dialog(tdialog *d, int n)
 {
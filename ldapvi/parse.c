@@ -17,6 +17,7 @@
  */
 #define _XOPEN_SOURCE
 #include <unistd.h>
+#define ALLOC_CATEGORY ALLOC_PARSER
 #include "common.h"
 
 #define fast_g_string_append_c(gstring, c)				\
@@ -714,6 +715,182 @@ skip_entry(FILE *s, long offset, char **key)
 	return rc;
 }
 
+/*
+ * The scan functions find records without parsing them, for callers
+ * that only need keys and positions of a large file, like offline
+ * --diff.  They work on the file contents in memory and follow the line
+ * structure that read_line1() and read_header() see, but do not decode
+ * or check values.  Whatever they are unsure about makes them fail, so
+ * that the caller can fall back to read_entry(), which then reports the
+ * error properly.
+ */
+
+/*
+ * Skip a comment or LDIF-style value at POS, including folded lines.
+ */
+static long
+scan_folded(const char *map, long size, long pos)
+{
+	const char *ptr;
+
+	for (;;) {
+		if ( !(ptr = memchr(map + pos, '\n', size - pos)))
+			return -1;
+		pos = ptr - map + 1;
+		if (pos == size || map[pos] != ' ')
+			return pos;
+	}
+}
+
+/*
+ * Skip a backslashed value at POS.  A newline is escaped if an odd
+ * number of backslashes precedes it.
+ */
+static long
+scan_backslashed(const char *map, long size, long pos)
+{
+	const char *ptr;
+	const char *q;
+
+	for (;;) {
+		if ( !(ptr = memchr(map + pos, '\n', size - pos)))
+			return -1;
+		for (q = ptr; q > map + pos && q[-1] == '\\'; q--)
+			;
+		pos = ptr - map + 1;
+		if ((ptr - q) % 2 == 0)
+			return pos;
+	}
+}
+
+static int
+named_encoding_p(const char *encoding, int n)
+{
+	static char *names[] = {
+		":", "<", "crypt", "cryptmd5", "sha", "ssha", "md5", "smd5", 0
+	};
+	char **ptr;
+
+	for (ptr = names; *ptr; ptr++)
+		if (strlen(*ptr) == n && !strncasecmp(*ptr, encoding, n))
+			return 1;
+	return 0;
+}
+
+/*
+ * Like read_line1(), but set *NAME and *N to the name and *VALUE to the
+ * position of the value.  Return -3 instead of -2 at end of file.
+ */
+static int
+scan_line(const char *map, long size, long *pos,
+	  const char **name, int *n, long *value)
+{
+	long i = *pos;
+	long lhs;
+	const char *colon;
+	const char *encoding;
+	int elen;
+
+	for (;;) {
+		if (i == size) {
+			*pos = i;
+			return -3;
+		}
+		if (map[i] == '\n') {
+			*pos = i + 1;
+			return -2;
+		}
+		if (map[i] != '#')
+			break;
+		if ( (i = scan_folded(map, size, i)) == -1)
+			return -1;
+	}
+
+	for (lhs = i; i < size && map[i] != ' '; i++)
+		if (map[i] == '\n' || !map[i])
+			return -1;
+	if (i == size || i == lhs)
+		return -1;
+	*name = map + lhs;
+	colon = memchr(map + lhs, ':', i - lhs);
+	*n = colon ? colon - *name : i - lhs;
+	if (!*n)
+		return -1;
+	*value = ++i;
+
+	if (!colon)
+		i = scan_backslashed(map, size, i);
+	else {
+		encoding = colon + 1;
+		elen = map + i - 1 - encoding;
+		if (elen == 1 && *encoding == ';')
+			i = scan_backslashed(map, size, i);
+		else if (elen == 0 || named_encoding_p(encoding, elen))
+			i = scan_folded(map, size, i);
+		else {
+			long m = 0;
+			int j;
+
+			for (j = 0; j < elen; j++) {
+				if (!isdigit((unsigned char) encoding[j])
+				    || m > size)
+					return -1;
+				m = m * 10 + encoding[j] - '0';
+			}
+			if (m > size - i)
+				return -1;
+			i += m;
+		}
+	}
+	if (i == -1)
+		return -1;
+	*pos = i;
+	return 0;
+}
+
+/*
+ * Find the record at *POS of the SIZE bytes at MAP, without parsing it.
+ * Set *START to the position read_entry() would report for it, *KEY and
+ * *KEYLEN to its key, and *POS to the end of the record.
+ *
+ * Return 0 on success and at EOF, in which case *KEY is set to 0.
+ * Return -1 if the record needs to be parsed by read_entry().
+ */
+int
+scan_entry(const char *map, long size, long *pos, long *start,
+	   const char **key, int *keylen)
+{
+	const char *name;
+	long value;
+	int n;
+
+	for (;;) {
+		*start = *pos;
+		switch (scan_line(map, size, pos, key, keylen, &value)) {
+		case -1:
+			return -1;
+		case -2:
+			continue;
+		case -3:
+			*key = 0;
+			return 0;
+		}
+		if (*keylen != 7 || strncmp(*key, "version", 7))
+			break;
+		if (*pos - value != 7 || strncmp(map + value, "ldapvi\n", 7))
+			return -1;
+	}
+
+	for (;;)
+		switch (scan_line(map, size, pos, &name, &n, &value)) {
+		case -1:
+			return -1;
+		case -2:
+		case -3:
+			return 0;
+		}
+}
+
 static int
 read_profile_header(GString *tmp1, GString *tmp2, FILE *s, char **name)
 {
@@ -17,6 +17,7 @@
  */
 #define _XOPEN_SOURCE
 #include <unistd.h>
+#define ALLOC_CATEGORY ALLOC_PARSER
 #include "common.h"
 
 #define fast_g_string_append_c(gstring, c)				\
@@ -0,0 +1,170 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define ALLOC_CATEGORY ALLOC_POOL
+#include "common.h"
+#include "config.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * A size-class allocator for the small nodes that are made and freed
+ * once per entry or attribute: POOL_CLASSES classes, POOL_GRAIN bytes
+ * apart, each with a free list and a chunk that new objects are cut
+ * from.  Larger requests go to xalloc().
+ *
+ * Each thread has its own pool, so there is no locking.  An object must
+ * be freed by the thread that allocated it; otherwise it ends up on the
+ * free list of the wrong thread.  When a thread exits, all chunks of
+ * its pool are returned at once by pool_release().
+ *
+ * Without thread-local storage, or with --disable-pool, all of this
+ * maps to xalloc() and free().
+ */
+#if defined(ENABLE_POOL) && (defined(HAVE_TLS) || !defined(HAVE_LIBPTHREAD))
+#define POOL_GRAIN 16
+#define POOL_CLASSES 4
+#define POOL_MAX (POOL_GRAIN * POOL_CLASSES)
+#define POOL_CHUNK_SIZE 16384
+
+typedef struct tpoolchunk {
+	struct tpoolchunk *next;
+	char pad[POOL_GRAIN - sizeof(struct tpoolchunk *)];
+} tpoolchunk;
+
+typedef struct tpoolclass {
+	void *free;		/* free list, linked through the first word */
+	char *next;		/* unused part of the current chunk */
+	char *end;
+} tpoolclass;
+
+typedef struct tpool {
+	tpoolclass classes[POOL_CLASSES];
+	tpoolchunk *chunks;
+} tpool;
+
+#ifdef HAVE_LIBPTHREAD
+static __thread tpool pool;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The destructor of pool_key, called with the pool of an exiting thread.
+ */
+static void
+pool_release(void *arg)
+{
+	tpool *p = arg;
+	tpoolchunk *chunk = p->chunks;
+
+	while (chunk) {
+		tpoolchunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	memset(p, 0, sizeof(*p));
+}
+
+static void
+pool_key_create(void)
+{
+	if (pthread_key_create(&pool_key, pool_release)) syserr();
+}
+#else
+static tpool pool;
+#endif
+
+static void
+pool_refill(tpoolclass *c)
+{
+	tpoolchunk *chunk;
+
+#ifdef HAVE_LIBPTHREAD
+	if (!pool.chunks) {
+		pthread_once(&pool_once, pool_key_create);
+		if (pthread_setspecific(pool_key, &pool)) syserr();
+	}
+#endif
+	chunk = xalloc(POOL_CHUNK_SIZE);
+	chunk->next = pool.chunks;
+	pool.chunks = chunk;
+	c->next = (char *) (chunk + 1);
+	c->end = (char *) chunk + POOL_CHUNK_SIZE;
+}
+
+void *
+pool_alloc(size_t size)
+{
+	tpoolclass *c;
+	void *result;
+	size_t n;
+
+	if (size > POOL_MAX || !size)
+		return xalloc(size);
+	c = &pool.classes[(size - 1) / POOL_GRAIN];
+	if ( (result = c->free)) {
+		c->free = *(void **) result;
+		return result;
+	}
+	n = ((size - 1) / POOL_GRAIN + 1) * POOL_GRAIN;
+	if ((size_t) (c->end - c->next) < n)
+		pool_refill(c);
+	result = c->next;
+	c->next += n;
+	return result;
+}
+
+void
+pool_free(void *ptr, size_t size)
+{
+	tpoolclass *c;
+
+	if (size > POOL_MAX || !size) {
+		free(ptr);
+		return;
+	}
+	c = &pool.classes[(size - 1) / POOL_GRAIN];
+	*(void **) ptr = c->free;
+	c->free = ptr;
+}
+#else
+void *
+pool_alloc(size_t size)
+{
+	return xalloc(size);
+}
+
+void
+pool_free(void *ptr, size_t size)
+{
+	free(ptr);
+}
+#endif
+
+char *
+pool_dup(char *str)
+{
+	size_t n = strlen(str) + 1;
+	return memcpy(pool_alloc(n), str, n);
+}
+
+void
+pool_free_string(char *str)
+{
+	pool_free(str, strlen(str) + 1);
+}
@@ -15,248 +15,392 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define ALLOC_CATEGORY ALLOC_OUTPUT
 #include "common.h"
-
+#include "config.h"
+#include "probes.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* set by ldapvi before it starts any threads, never by libldapvi */
 t_print_binary_mode print_binary_mode = PRINT_UTF8;
 
+/*
+ * All printers of a thread format into one buffer and flush it at the
+ * end of each record, so callers can still ftell() the stream between
+ * records.  If an error cuts a record short, its first part is left in
+ * the buffer and dropped by the next record.
+ */
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_TLS)
+static __thread tobuffer buffer;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The destructor of buffer_key, called with the buffer of an exiting
+ * thread.
+ */
 static void
-write_backslashed(FILE *s, char *ptr, int n)
+buffer_release(void *arg)
 {
-	int i;
-	for (i = 0; i < n; i++) {
-		char c = ptr[i];
-		if (c == '\n' || c == '\\') fputc('\\', s);
-		fputc(c, s);
+	obuffer_free(arg);
+}
+
+static void
+buffer_key_create(void)
+{
+	if (pthread_key_create(&buffer_key, buffer_release)) syserr();
+}
+#else
+static tobuffer buffer;
+#endif
+
+static tobuffer *
+print_buffer(FILE *s)
+{
+	if (!buffer.data) {
+		obuffer_init(&buffer, s);
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_TLS)
+		pthread_once(&buffer_once, buffer_key_create);
+		if (pthread_setspecific(buffer_key, &buffer)) syserr();
+#endif
 	}
-	if (ferror(s)) syserr();
+	buffer.s = s;
+	buffer.len = 0;
+	return &buffer;
 }
 
+static void
+write_backslashed(tobuffer *b, char *ptr, int n)
+{
+	char *end = ptr + n;
+
+	while (ptr < end) {
+		char *q = ptr;
+		while (q < end && *q != '\n' && *q != '\\')
+			q++;
+		obuffer_write(b, ptr, q - ptr);
+		if (q == end)
+			break;
+		obuffer_putc(b, '\\');
+		obuffer_putc(b, *q);
+		ptr = q + 1;
+	}
+}
+
+/*
+ * Check the UTF-8 sequence starting with the non-ASCII byte str[0],
+ * with N bytes available.  Return its length, or 0 if it is invalid.
+ */
 static int
-utf8_string_p(unsigned char *str, int n)
+utf8_sequence(unsigned char *str, int n)
 {
-	int i = 0;
-	while (i < n) {
-		unsigned char c = str[i++];
-		if (c >= 0xfe)
+	unsigned char c = str[0];
+	unsigned char d, e;
+	unsigned code;
+	int i, k;
+
+	if (c >= 0xfe)
+		return 0;
+	else if (c >= 0xfc)
+		k = 6;
+	else if (c >= 0xf8)
+		k = 5;
+	else if (c >= 0xf0)
+		k = 4;
+	else if (c >= 0xe0)
+		k = 3;
+	else if (c >= 0xc2)
+		k = 2;
+	else
+		return 0;
+
+	if (n < k)
+		return 0;
+	for (i = 1; i < k; i++)
+		if ((str[i] ^ 0x80) >= 0x40)
 			return 0;
-		if (c >= 0xfc) {
-			unsigned char d;
-			if ((n - i < 5)
-			    || ((d=str[i++]) ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (c < 0xfd && d < 0x84))
-				return 0;
-		} else if (c >= 0xf8) {
-			unsigned char d;
-			if ((n - i < 4)
-			    || ((d=str[i++]) ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (c < 0xf9 && d < 0x88))
-				return 0;
-		} else if (c >= 0xf0) {
-			unsigned char d;
-			if ((n - i < 3)
-			    || ((d=str[i++]) ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (str[i++] ^ 0x80) >= 0x40
-			    || (c < 0xf1 && d < 0x90))
-				return 0;
-		} else if (c >= 0xe0) {
-			unsigned char d, e;
-			unsigned code;
-			if ((n - i < 2)
-			    || ((d=str[i++]) ^ 0x80) >= 0x40
-			    || ((e=str[i++]) ^ 0x80) >= 0x40
-			    || (c < 0xe1 && d < 0xa0))
-				return 0;
-			code = ((int) c & 0x0f) << 12
-				| ((int) d ^ 0x80) << 6
-				| ((int) e ^ 0x80);
-			if ((0xd800 <= code) && (code <= 0xdfff)
-			    || code == 0xfffe || code == 0xffff)
-				return 0;
-		} else if (c >= 0x80) {
-			unsigned char d;
-			if ((n - i < 1)
-			    || ((d=str[i++]) ^ 0x80) >= 0x40
-			    || (c < 0xc2))
-				return 0;
-		} else if (c == 0)
+
+	d = str[1];
+	switch (k) {
+	case 6:
+		if (c < 0xfd && d < 0x84) return 0;
+		break;
+	case 5:
+		if (c < 0xf9 && d < 0x88) return 0;
+		break;
+	case 4:
+		if (c < 0xf1 && d < 0x90) return 0;
+		break;
+	case 3:
+		e = str[2];
+		if (c < 0xe1 && d < 0xa0) return 0;
+		code = ((int) c & 0x0f) << 12
+			| ((int) d ^ 0x80) << 6
+			| ((int) e ^ 0x80);
+		if ((0xd800 <= code) && (code <= 0xdfff)
+		    || code == 0xfffe || code == 0xffff)
 			return 0;
+		break;
 	}
-	return 1;
+	return k;
 }
 
+/*
+ * Return the length of the initial segment of STR consisting of bytes
+ * between 0x20 and 0x7f, which is nearly everything in typical values.
+ */
 static int
-readable_string_p(char *str, int n)
+printable_prefix(unsigned char *str, int n)
 {
-	int i;
-	for (i = 0; i < n; i++) {
-		char c = str[i];
-		if (c < 32 && c != '\n' && c != '\t')
-			return 0;
+	int i = 0;
+#ifdef __SSE2__
+	__m128i limit = _mm_set1_epi8(0x20);
+
+	/* signed comparison catches both controls and bytes >= 0x80 */
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *) (str + i));
+		int mask = _mm_movemask_epi8(_mm_cmplt_epi8(v, limit));
+		if (mask)
+			return i + ffs(mask) - 1;
 	}
-	return 1;
+#else
+	unsigned long ones = (unsigned long) -1 / 255;
+	unsigned long highs = ones * 0x80;
+
+	for (; i + sizeof(unsigned long) <= n; i += sizeof(unsigned long)) {
+		unsigned long w;
+		memcpy(&w, str + i, sizeof(w));
+		if ((w | ((w - ones * 0x20) & ~w)) & highs)
+			break;
+	}
+#endif
+	while (i < n && str[i] >= 0x20 && str[i] < 0x80)
+		i++;
+	return i;
 }
 
+#define VALUE_READABLE 1	/* ASCII, no controls except tab and newline */
+#define VALUE_UTF8 2		/* valid UTF-8 without null bytes */
+#define VALUE_SAFE 4		/* an RFC 2849 SAFE-STRING */
+
+/*
+ * Classify a value in a single pass.  Return the VALUE_* flags which
+ * apply to it, but stop early once none of the flags in WANT can
+ * still be true.
+ */
 static int
-safe_string_p(char *str, int n)
+classify_value(unsigned char *str, int n, int want)
 {
-	unsigned char c;
-	int i;
+	int result = VALUE_READABLE | VALUE_UTF8 | VALUE_SAFE;
+	int i = 0;
 
-	if (n == 0) return 1;
+	if (n == 0)
+		return result;
+	if (str[0] == ' ' || str[0] == ':' || str[0] == '<')
+		result &= ~VALUE_SAFE;
 
-	c = str[0];
-	if ((c == ' ') || (c == ':') || (c == '<'))
-		return 0;
+	for (;;) {
+		unsigned char c;
 
-	for (i = 0; i < n; i++) {
+		i += printable_prefix(str + i, n - i);
+		if (i >= n)
+			break;
 		c = str[i];
-		if ((c == '\0') || (c == '\r') || (c == '\n') || (c >= 0x80))
-			return 0;
+		if (c < 0x80) {
+			if (c == 0)
+				result &= ~(VALUE_UTF8 | VALUE_SAFE);
+			else if (c == '\n' || c == '\r')
+				result &= ~VALUE_SAFE;
+			if (c != '\n' && c != '\t')
+				result &= ~VALUE_READABLE;
+			i++;
+		} else {
+			result &= ~(VALUE_READABLE | VALUE_SAFE);
+			if (result & VALUE_UTF8) {
+				int k = utf8_sequence(str + i, n - i);
+				if (k) {
+					i += k;
+					continue;
+				}
+				result &= ~VALUE_UTF8;
+			}
+			i++;
+		}
+		if (!(result & want))
+			break;
 	}
-	return 1;
+	return result;
 }
 
 static void
-print_attrval(FILE *s, char *str, int len, int prefernocolon)
+print_attrval(tobuffer *b, char *str, int len, int prefernocolon)
 {
-	int readablep;
+	int readable;
+	int class;
+
 	switch (print_binary_mode) {
 	case PRINT_ASCII:
-		readablep = readable_string_p(str, len);
+		readable = VALUE_READABLE;
 		break;
 	case PRINT_UTF8:
-		readablep = utf8_string_p((unsigned char *) str, len);
+		readable = VALUE_UTF8;
 		break;
 	case PRINT_JUNK:
-		readablep = 1;
+		readable = 0;
 		break;
 	default:
 		abort();
 	}
+	class = classify_value(
+		(unsigned char *) str, len, readable | VALUE_SAFE);
 
-	if (!readablep) {
-		fputs(":: ", s);
-		print_base64((unsigned char *) str, len, s);
+	if ((class & readable) != readable) {
+		obuffer_write(b, ":: ", 3);
+		print_base64((unsigned char *) str, len, b);
 	} else if (prefernocolon) {
-		fputc(' ', s);
-		write_backslashed(s, str, len);
-	} else if (!safe_string_p(str, len)) {
-		fputs(":; ", s);
-		write_backslashed(s, str, len);
+		obuffer_putc(b, ' ');
+		write_backslashed(b, str, len);
+	} else if (!(class & VALUE_SAFE)) {
+		obuffer_write(b, ":; ", 3);
+		write_backslashed(b, str, len);
 	} else {
-		fputs(": ", s);
-		fwrite(str, 1, len, s);
+		obuffer_write(b, ": ", 2);
+		obuffer_write(b, str, len);
 	}
 }
 
 static void
-print_attribute(FILE *s, tattribute *attribute)
+print_attribute(tobuffer *b, tattribute *attribute)
 {
 	GPtrArray *values = attribute_values(attribute);
+	char *ad = attribute_ad(attribute);
+	int adlen = strlen(ad);
 	int j;
 
 	for (j = 0; j < values->len; j++) {
 		GArray *av = g_ptr_array_index(values, j);
-		fputs(attribute_ad(attribute), s);
-		print_attrval(s, av->data, av->len, 0);
-		fputc('\n', s);
+		obuffer_write(b, ad, adlen);
+		print_attrval(b, av->data, av->len, 0);
+		obuffer_putc(b, '\n');
 	}
-	if (ferror(s)) syserr();
 }
 
 static void
-print_entroid_bottom(FILE *s, tentroid *entroid)
+print_entroid_bottom(tobuffer *b, tentroid *entroid)
 {
 	int i;
 	LDAPAttributeType *at;
 	for (i = 0; i < entroid->must->len; i++) {
 		at = g_ptr_array_index(entroid->must, i);
-		fprintf(s, "# required attribute not shown: %s\n",
-			attributetype_name(at));
+		obuffer_puts(b, "# required attribute not shown: ");
+		obuffer_puts(b, attributetype_name(at));
+		obuffer_putc(b, '\n');
 	}
 	for (i = 0; i < entroid->may->len; i++) {
 		at = g_ptr_array_index(entroid->may, i);
-		fprintf(s, "#%s: \n", attributetype_name(at));
+		obuffer_putc(b, '#');
+		obuffer_puts(b, attributetype_name(at));
+		obuffer_write(b, ": \n", 3);
 	}
 }
 
+static void
+print_entroid_comment(tobuffer *b, tentroid *entroid)
+{
+	obuffer_write(b, entroid->comment->str, entroid->comment->len);
+}
+
+static void
+print_schema_warning(tobuffer *b, char *ad)
+{
+	obuffer_puts(b, "# WARNING: ");
+	obuffer_puts(b, ad);
+	obuffer_puts(b, " not allowed by schema\n");
+}
+
 void
-print_ldapvi_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
+format_ldapvi_entry(tobuffer *b, tentry *entry, char *key, tentroid *entroid)
 {
 	GPtrArray *attributes = entry_attributes(entry);
 	int i;
 
-	fputc('\n', s);
-	fputs(key ? key : "entry", s);
-	fputc(' ', s);
-	fputs(entry_dn(entry), s);
-	fputc('\n', s);
-	if (ferror(s)) syserr();
+	obuffer_putc(b, '\n');
+	obuffer_puts(b, key ? key : "entry");
+	obuffer_putc(b, ' ');
+	obuffer_puts(b, entry_dn(entry));
+	obuffer_putc(b, '\n');
 
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		print_entroid_comment(b, entroid);
 	for (i = 0; i < attributes->len; i++) {
 		tattribute *attribute = g_ptr_array_index(attributes, i);
 		char *ad = attribute_ad(attribute);
 		if ( entroid && !entroid_remove_ad(entroid, ad))
-			fprintf(s, "# WARNING: %s not allowed by schema\n",
-				ad);
-		print_attribute(s, attribute);
+			print_schema_warning(b, ad);
+		print_attribute(b, attribute);
 	}
 	if (entroid)
-		print_entroid_bottom(s, entroid);
+		print_entroid_bottom(b, entroid);
+}
+
+void
+print_ldapvi_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
+{
+	tobuffer *b = print_buffer(s);
+	format_ldapvi_entry(b, entry, key, entroid);
+	obuffer_flush(b);
 }
 
 static void
-print_ldapvi_ldapmod(FILE *s, LDAPMod *mod)
+print_ldapvi_ldapmod(tobuffer *b, LDAPMod *mod)
 {
 	struct berval **values = mod->mod_bvalues;
 
 	switch (mod->mod_op & ~LDAP_MOD_BVALUES) {
-	case LDAP_MOD_ADD: fputs("add", s); break;
-	case LDAP_MOD_DELETE: fputs("delete", s); break;
-	case LDAP_MOD_REPLACE: fputs("replace", s); break;
+	case LDAP_MOD_ADD: obuffer_puts(b, "add"); break;
+	case LDAP_MOD_DELETE: obuffer_puts(b, "delete"); break;
+	case LDAP_MOD_REPLACE: obuffer_puts(b, "replace"); break;
 	default: abort();
 	}
-	print_attrval(s, mod->mod_type, strlen(mod->mod_type), 0);
-	fputc('\n', s);
+	print_attrval(b, mod->mod_type, strlen(mod->mod_type), 0);
+	obuffer_putc(b, '\n');
 	for (; *values; values++) {
 		struct berval *value = *values;
-		print_attrval(s, value->bv_val, value->bv_len, 0);
-		fputc('\n', s);
+		print_attrval(b, value->bv_val, value->bv_len, 0);
+		obuffer_putc(b, '\n');
 	}
-	if (ferror(s)) syserr();
 }
 
 void
 print_ldapvi_modify(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputs("\nmodify", s);
-	print_attrval(s, dn, strlen(dn), 1);
-	fputc('\n', s);
+	tobuffer *b = print_buffer(s);
+
+	obuffer_puts(b, "\nmodify");
+	print_attrval(b, dn, strlen(dn), 1);
+	obuffer_putc(b, '\n');
 
 	for (; *mods; mods++)
-		print_ldapvi_ldapmod(s, *mods);
-	if (ferror(s)) syserr();
+		print_ldapvi_ldapmod(b, *mods);
+	obuffer_flush(b);
 }
 
 void
 print_ldapvi_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn)
 {
-	fputs("\nrename", s);
-	print_attrval(s, olddn, strlen(olddn), 1);
-	fputs(deleteoldrdn ? "\nreplace" : "\nadd", s);
-	print_attrval(s, newdn, strlen(newdn), 0);
-	fputc('\n', s);
-	if (ferror(s)) syserr();
+	tobuffer *b = print_buffer(s);
+
+	obuffer_puts(b, "\nrename");
+	print_attrval(b, olddn, strlen(olddn), 1);
+	obuffer_puts(b, deleteoldrdn ? "\nreplace" : "\nadd");
+	print_attrval(b, newdn, strlen(newdn), 0);
+	obuffer_putc(b, '\n');
+	obuffer_flush(b);
 }
 
 static GString *
@@ -277,145 +421,156 @@ rdns2gstring(char **ptr)
 void
 print_ldapvi_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn)
 {
+	tobuffer *b = print_buffer(s);
 	char **newrdns = ldap_explode_dn(olddn, 0);
 	GString *newdn;
 	char *tmp;
 
-	fputs("\nrename", s);
-	print_attrval(s, olddn, strlen(olddn), 1);
-	fputs(deleteoldrdn ? "\nreplace" : "\nadd", s);
+	obuffer_puts(b, "\nrename");
+	print_attrval(b, olddn, strlen(olddn), 1);
+	obuffer_puts(b, deleteoldrdn ? "\nreplace" : "\nadd");
 
 	/* fixme, siehe notes */
 	tmp = *newrdns;
 	*newrdns = newrdn;
 	newdn = rdns2gstring(newrdns);
-	print_attrval(s, newdn->str, newdn->len, 0);
-	fputc('\n', s);
+	print_attrval(b, newdn->str, newdn->len, 0);
+	obuffer_putc(b, '\n');
 	g_string_free(newdn, 1);
 	*newrdns = tmp;
 
-	if (ferror(s)) syserr();
+	obuffer_flush(b);
 	ldap_value_free(newrdns);
 }
 
 void
 print_ldapvi_add(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputs("\nadd", s);
-	print_attrval(s, dn, strlen(dn), 1);
-	fputc('\n', s);
+	tobuffer *b = print_buffer(s);
+
+	obuffer_puts(b, "\nadd");
+	print_attrval(b, dn, strlen(dn), 1);
+	obuffer_putc(b, '\n');
 
 	for (; *mods; mods++) {
 		LDAPMod *mod = *mods;
 		struct berval **values = mod->mod_bvalues;
+		int adlen = strlen(mod->mod_type);
 		for (; *values; values++) {
 			struct berval *value = *values;
-			fputs(mod->mod_type, s);
-			print_attrval(s, value->bv_val, value->bv_len, 0);
-			fputc('\n', s);
+			obuffer_write(b, mod->mod_type, adlen);
+			print_attrval(b, value->bv_val, value->bv_len, 0);
+			obuffer_putc(b, '\n');
 		}
 	}
-	if (ferror(s)) syserr();
+	obuffer_flush(b);
 }
 
 void
 print_ldapvi_delete(FILE *s, char *dn)
 {
-	fputs("\ndelete", s);
-	print_attrval(s, dn, strlen(dn), 1);
-	fputc('\n', s);
-	if (ferror(s)) syserr();
+	tobuffer *b = print_buffer(s);
+
+	obuffer_puts(b, "\ndelete");
+	print_attrval(b, dn, strlen(dn), 1);
+	obuffer_putc(b, '\n');
+	obuffer_flush(b);
 }
 
 static void
-print_ldif_line(FILE *s, char *ad, char *str, int len)
+print_ldif_line(tobuffer *b, char *ad, char *str, int len)
 {
 	if (len == -1)
 		len = strlen(str);
-	fputs(ad, s);
-	if (safe_string_p(str, len)) {
-		fputs(": ", s);
-		fwrite(str, len, 1, s);
+	obuffer_puts(b, ad);
+	if (classify_value((unsigned char *) str, len, VALUE_SAFE)
+	    & VALUE_SAFE) {
+		obuffer_write(b, ": ", 2);
+		obuffer_write(b, str, len);
 	} else {
-		fputs(":: ", s);
-		print_base64((unsigned char *) str, len, s);
+		obuffer_write(b, ":: ", 3);
+		print_base64((unsigned char *) str, len, b);
 	}
-	fputs("\n", s);
+	obuffer_putc(b, '\n');
 }
 
 static void
-print_ldif_bervals(FILE *s, char *ad, struct berval **values)
+print_ldif_bervals(tobuffer *b, char *ad, struct berval **values)
 {
 	for (; *values; values++) {
 		struct berval *value = *values;
-		print_ldif_line(s, ad, value->bv_val, value->bv_len);
+		print_ldif_line(b, ad, value->bv_val, value->bv_len);
 	}
-	if (ferror(s)) syserr();
 }
 
 void
 print_ldif_modify(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", dn, -1);
-	fputs("changetype: modify\n", s);
+	tobuffer *b = print_buffer(s);
+
+	obuffer_putc(b, '\n');
+	print_ldif_line(b, "dn", dn, -1);
+	obuffer_puts(b, "changetype: modify\n");
 
 	for (; *mods; mods++) {
 		LDAPMod *mod = *mods;
 
 		switch (mod->mod_op & ~LDAP_MOD_BVALUES) {
-		case LDAP_MOD_ADD: fputs("add: ", s); break;
-		case LDAP_MOD_DELETE: fputs("delete: ", s); break;
-		case LDAP_MOD_REPLACE: fputs("replace: ", s); break;
+		case LDAP_MOD_ADD: obuffer_puts(b, "add: "); break;
+		case LDAP_MOD_DELETE: obuffer_puts(b, "delete: "); break;
+		case LDAP_MOD_REPLACE: obuffer_puts(b, "replace: "); break;
 		default: abort();
 		}
-		fputs(mod->mod_type, s);
-		fputc('\n', s);
+		obuffer_puts(b, mod->mod_type);
+		obuffer_putc(b, '\n');
 
-		print_ldif_bervals(s, mod->mod_type, mod->mod_bvalues);
-		fputs("-\n", s);
+		print_ldif_bervals(b, mod->mod_type, mod->mod_bvalues);
+		obuffer_write(b, "-\n", 2);
 	}
-	if (ferror(s)) syserr();
+	obuffer_flush(b);
 }
 
 void
 print_ldif_add(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", dn, -1);
-	fputs("changetype: add\n", s);
+	tobuffer *b = print_buffer(s);
+
+	obuffer_putc(b, '\n');
+	print_ldif_line(b, "dn", dn, -1);
+	obuffer_puts(b, "changetype: add\n");
 
 	for (; *mods; mods++) {
 		LDAPMod *mod = *mods;
-		print_ldif_bervals(s, mod->mod_type, mod->mod_bvalues);
+		print_ldif_bervals(b, mod->mod_type, mod->mod_bvalues);
 	}
-	if (ferror(s)) syserr();
+	obuffer_flush(b);
 }
 
 void
 print_ldif_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn)
 {
+	tobuffer *b = print_buffer(s);
 	char **newrdns = ldap_explode_dn(newdn, 0);
 	int isRootDSE = !*newrdns;
 	GString *sup;
 
-	fputc('\n', s);
-	print_ldif_line(s, "dn", olddn, -1);
-	fputs("changetype: modrdn\n", s);
+	obuffer_putc(b, '\n');
+	print_ldif_line(b, "dn", olddn, -1);
+	obuffer_puts(b, "changetype: modrdn\n");
 
-	print_ldif_line(s, "newrdn", isRootDSE ? "" : *newrdns, -1);
+	print_ldif_line(b, "newrdn", isRootDSE ? "" : *newrdns, -1);
 
-	fprintf(s, "deleteoldrdn: %d\n", !!deleteoldrdn);
+	obuffer_printf(b, "deleteoldrdn: %d\n", !!deleteoldrdn);
 
 	if (isRootDSE || !newrdns[1])
-		fputs("newsuperior:\n", s);
+		obuffer_puts(b, "newsuperior:\n");
 	else {
 		sup = rdns2gstring(newrdns + 1);
-		print_ldif_line(s, "newsuperior", sup->str, sup->len);
+		print_ldif_line(b, "newsuperior", sup->str, sup->len);
 		g_string_free(sup, 1);
 	}
 
-	if (ferror(s)) syserr();
+	obuffer_flush(b);
 	ldap_value_free(newrdns);
 }
 
@@ -423,76 +578,80 @@ print_ldif_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn)
 void
 print_ldif_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", olddn, -1);
-	fputs("changetype: modrdn\n", s);
-	print_ldif_line(s, "newrdn", newrdn, -1);
-	fprintf(s, "deleteoldrdn: %d\n", !!deleteoldrdn);
-	if (ferror(s)) syserr();
+	tobuffer *b = print_buffer(s);
+
+	obuffer_putc(b, '\n');
+	print_ldif_line(b, "dn", olddn, -1);
+	obuffer_puts(b, "changetype: modrdn\n");
+	print_ldif_line(b, "newrdn", newrdn, -1);
+	obuffer_printf(b, "deleteoldrdn: %d\n", !!deleteoldrdn);
+	obuffer_flush(b);
 }
 
 void
 print_ldif_delete(FILE *s, char *dn)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", dn, -1);
-	fputs("changetype: delete\n", s);
-	if (ferror(s)) syserr();
+	tobuffer *b = print_buffer(s);
+
+	obuffer_putc(b, '\n');
+	print_ldif_line(b, "dn", dn, -1);
+	obuffer_puts(b, "changetype: delete\n");
+	obuffer_flush(b);
 }
 
+/*
+ * The message printers format into a buffer supplied by the caller,
+ * which may be working on several entries at once.
+ */
 void
-print_ldapvi_message(FILE *s, LDAP *ld, LDAPMessage *entry, int key,
-		    tentroid *entroid)
+print_ldapvi_message(tobuffer *b, tberentry *entry, int key, tentroid *entroid)
 {
-	char *dn, *ad;
-	BerElement *ber;
+	size_t len = b->len;
+	int i;
 
-	fprintf(s, "\n%d", key);
-	dn = ldap_get_dn(ld, entry);
-	print_attrval(s, dn, strlen(dn), 1);
-	ldap_memfree(dn);
-	fputc('\n', s);
+	PROBE2(print__start, key, entry->dn.bv_len);
+	obuffer_printf(b, "\n%d", key);
+	print_attrval(b, entry->dn.bv_val, entry->dn.bv_len, 1);
+	obuffer_putc(b, '\n');
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		print_entroid_comment(b, entroid);
 
-	for (ad = ldap_first_attribute(ld, entry, &ber);
-	     ad;
-	     ad = ldap_next_attribute(ld, entry, ber))
-	{
-		struct berval **values = ldap_get_values_len(ld, entry, ad);
-		struct berval **ptr;
+	for (i = 0; i < entry->attributes->len; i++) {
+		tberattribute *a
+			= &g_array_index(entry->attributes, tberattribute, i);
+		struct berval *ptr;
 
-		if (!values) continue;
+		if (!a->values) continue;
 		if (entroid)
-			entroid_remove_ad(entroid, ad);
+			entroid_remove_ad(entroid, a->ad.bv_val);
 
-		for (ptr = values; *ptr; ptr++) {
-			fputs(ad, s);
-			print_attrval(s, (*ptr)->bv_val, (*ptr)->bv_len, 0);
-			fputc('\n', s);
+		for (ptr = a->values; ptr->bv_val; ptr++) {
+			obuffer_write(b, a->ad.bv_val, a->ad.bv_len);
+			print_attrval(b, ptr->bv_val, ptr->bv_len, 0);
+			obuffer_putc(b, '\n');
 		}
-		ldap_memfree(ad);
-		ldap_value_free_len(values);
 	}
-	ber_free(ber, 0);
 
 	if (entroid)
-		print_entroid_bottom(s, entroid);
-	if (ferror(s)) syserr();
+		print_entroid_bottom(b, entroid);
+	PROBE3(print__done, key, entry->dn.bv_len, b->len - len);
 }
 
 void
-print_ldif_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
+format_ldif_entry(tobuffer *b, tentry *entry, char *key, tentroid *entroid)
 {
 	int i;
 	GPtrArray *attributes = entry_attributes(entry);
 
-	fputc('\n', s);
-	print_ldif_line(s, "dn", entry_dn(entry), -1);
-	if (key)
-		fprintf(s, "ldapvi-key: %s\n", key);
+	obuffer_putc(b, '\n');
+	print_ldif_line(b, "dn", entry_dn(entry), -1);
+	if (key) {
+		obuffer_puts(b, "ldapvi-key: ");
+		obuffer_puts(b, key);
+		obuffer_putc(b, '\n');
+	}
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		print_entroid_comment(b, entroid);
 	for (i = 0; i < attributes->len; i++) {
 		tattribute *attribute = g_ptr_array_index(attributes, i);
 		char *ad = attribute_ad(attribute);
@@ -500,49 +659,55 @@ print_ldif_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
 		int j;
 
 		if ( entroid && !entroid_remove_ad(entroid, ad))
-			fprintf(s, "# WARNING: %s not allowed by schema\n",
-				ad);
+			print_schema_warning(b, ad);
 
 		for (j = 0; j < values->len; j++) {
 			GArray *av = g_ptr_array_index(values, j);
-			print_ldif_line(s, ad, av->data, av->len);
+			print_ldif_line(b, ad, av->data, av->len);
 		}
 	}
 	if (entroid)
-		print_entroid_bottom(s, entroid);
+		print_entroid_bottom(b, entroid);
 }
 
 void
-print_ldif_message(FILE *s, LDAP *ld, LDAPMessage *entry, int key,
-		   tentroid *entroid)
+print_ldif_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
 {
-	char *dn, *ad;
-	BerElement *ber;
+	tobuffer *b = print_buffer(s);
+	format_ldif_entry(b, entry, key, entroid);
+	obuffer_flush(b);
+}
 
-	fputc('\n', s);
+void
+print_ldif_message(tobuffer *b, tberentry *entry, int key, tentroid *entroid)
+{
+	size_t len = b->len;
+	int i;
+
+	PROBE2(print__start, key, entry->dn.bv_len);
+	obuffer_putc(b, '\n');
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		print_entroid_comment(b, entroid);
 
-	dn = ldap_get_dn(ld, entry);
-	print_ldif_line(s, "dn", dn, -1);
-	ldap_memfree(dn);
+	print_ldif_line(b, "dn", entry->dn.bv_val, entry->dn.bv_len);
 
 	if (key != -1)
-		fprintf(s, "ldapvi-key: %d\n", key);
-
-	for (ad = ldap_first_attribute(ld, entry, &ber);
-	     ad;
-	     ad = ldap_next_attribute(ld, entry, ber))
-	{
-		struct berval **values = ldap_get_values_len(ld, entry, ad);
-		if (entroid) entroid_remove_ad(entroid, ad);
-		print_ldif_bervals(s, ad, values);
-		ldap_memfree(ad);
-		ldap_value_free_len(values);
+		obuffer_printf(b, "ldapvi-key: %d\n", key);
+
+	for (i = 0; i < entry->attributes->len; i++) {
+		tberattribute *a
+			= &g_array_index(entry->attributes, tberattribute, i);
+		struct berval *ptr;
+
+		if (!a->values) continue;
+		if (entroid)
+			entroid_remove_ad(entroid, a->ad.bv_val);
+		for (ptr = a->values; ptr->bv_val; ptr++)
+			print_ldif_line(
+				b, a->ad.bv_val, ptr->bv_val, ptr->bv_len);
 	}
-	ber_free(ber, 0);
 
 	if (entroid)
-		print_entroid_bottom(s, entroid);
-	if (ferror(s)) syserr();
+		print_entroid_bottom(b, entroid);
+	PROBE3(print__done, key, entry->dn.bv_len, b->len - len);
 }
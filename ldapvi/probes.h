@@ -0,0 +1,55 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Static tracepoints for perf and bpftrace, e.g.
+ *
+ *   bpftrace -e 'usdt:./ldapvi:ldapvi:modify__response { @[arg2] = count(); }'
+ *
+ * A disabled probe is a single nop.  Include after config.h; without
+ * <sys/sdt.h> the probes are compiled out and their arguments are not
+ * evaluated.
+ *
+ *   search__message      key (-1 for references), message type
+ *   print__start         key, DN length
+ *   print__done          key, DN length, bytes formatted
+ *   diff__fastpath       key, 1 if the record is unchanged, bytes compared
+ *   diff__mods           key, DN length, number of modifications
+ *   modify__request      key, DN length, modifications, value bytes
+ *   modify__response     key, DN length, result code
+ *   add__request         key, DN length, attributes, value bytes
+ *   add__response        key, DN length, result code
+ *   delete__request      key, DN length
+ *   delete__response     key, DN length, result code
+ *   rename__request      key, old DN length, new DN length
+ *   rename__response     key, old DN length, result code
+ *   schema__start
+ *   schema__done         object classes, attribute types
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(ldapvi, name)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ldapvi, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ldapvi, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(ldapvi, name, a, b, c, d)
+#else
+#define PROBE0(name) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
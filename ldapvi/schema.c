@@ -15,18 +15,76 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define ALLOC_CATEGORY ALLOC_SCHEMA
 #include "common.h"
+#include "config.h"
+#include "probes.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * Definitions are parsed only when they are first looked up.  Until
+ * then, the tables map the OID and the names of each definition, found
+ * by scan_definition(), to the unparsed string.
+ *
+ * Formatter threads share the schema, so lookups are serialized.
+ */
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t schema_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+typedef struct tdefinition {
+	char *str;		/* null once parsed */
+	void *parsed;		/* null if not parsed or invalid */
+} tdefinition;
+
+static void *
+schema_lookup(GHashTable *table, char *name, int classp)
+{
+	tdefinition *def;
+	int code;
+	const char *errp;
+	void *result;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&schema_lock);
+#endif
+	if ( (def = g_hash_table_lookup(table, name)) && def->str) {
+		if (classp) {
+			def->parsed = ldap_str2objectclass(
+				def->str, &code, &errp, 0);
+			if (!def->parsed)
+				fprintf(stderr,
+					"Warning: Cannot parse class: %s\n",
+					ldap_scherr2str(code));
+		} else {
+			def->parsed = ldap_str2attributetype(
+				def->str, &code, &errp, 0);
+			if (!def->parsed)
+				fprintf(stderr,
+					"Warning: Cannot parse type: %s\n",
+					ldap_scherr2str(code));
+		}
+		def->str = 0;
+	}
+	result = def ? def->parsed : 0;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&schema_lock);
+#endif
+	return result;
+}
 
 LDAPObjectClass *
 schema_get_objectclass(tschema *schema, char *name)
 {
-	return g_hash_table_lookup(schema->classes, name);
+	return schema_lookup(schema->classes, name, 1);
 }
 
 LDAPAttributeType *
 schema_get_attributetype(tschema *schema, char *name)
 {
-	return g_hash_table_lookup(schema->types, name);
+	return schema_lookup(schema->types, name, 0);
 }
 
 char *
@@ -47,30 +105,6 @@ attributetype_name(LDAPAttributeType *at)
 	return at->at_oid;
 }
 
-static void
-add_objectclass(GHashTable *classes, LDAPObjectClass *cls)
-{
-	int i;
-	char **names = cls->oc_names;
-
-	g_hash_table_insert(classes, cls->oc_oid, cls);
-	if (names)
-		for (i = 0; names[i]; i++)
-			g_hash_table_insert(classes, names[i], cls);
-}
-
-static void
-add_attributetype(GHashTable *types, LDAPAttributeType *at)
-{
-	int i;
-	char **names = at->at_names;
-
-	g_hash_table_insert(types, at->at_oid, at);
-	if (names)
-		for (i = 0; names[i]; i++)
-			g_hash_table_insert(types, names[i], at);
-}
-
 static gboolean
 strcaseequal(gconstpointer v, gconstpointer w)
 {
@@ -93,54 +127,226 @@ strcasehash(gconstpointer v)
 	return h;
 }
 
-static gboolean
-aux_class_entry_p(gpointer key, gpointer value, gpointer data)
+/*
+ * Return the next token of a schema definition at *PTR: a quoted
+ * string without its quotes, a parenthesis, or a bare word.  Set *LEN
+ * to its length and *QUOTED if it was a string.  Return null at the end.
+ */
+static char *
+next_token(char **ptr, int *len, int *quoted)
 {
-	LDAPObjectClass *class = value;
-	return !!strcmp(key, class->oc_oid);
+	char *p = *ptr;
+	char *start;
+
+	while (isspace((unsigned char) *p))
+		p++;
+	*quoted = *p == '\'';
+	if (!*p)
+		return 0;
+	if (*p == '(' || *p == ')') {
+		*len = 1;
+		*ptr = p + 1;
+		return p;
+	}
+	if (*quoted) {
+		start = ++p;
+		while (*p && *p != '\'')
+			p++;
+		*len = p - start;
+		*ptr = *p ? p + 1 : p;
+		return start;
+	}
+	start = p;
+	while (*p && !isspace((unsigned char) *p)
+	       && *p != '(' && *p != ')' && *p != '\'')
+		p++;
+	*len = p - start;
+	*ptr = p;
+	return start;
 }
 
-static gboolean
-aux_type_entry_p(gpointer key, gpointer value, gpointer data)
+static void
+index_token(GHashTable *table, char *token, int len, tdefinition *def)
 {
-	LDAPAttributeType *at = value;
-	return !!strcmp(key, at->at_oid);
+	char *key = xalloc(len + 1);
+
+	memcpy(key, token, len);
+	key[len] = 0;
+	g_hash_table_insert(table, key, def);
 }
 
+/*
+ * Enter DEF into TABLE under its OID and NAMEs, without parsing all of
+ * it.  See RFC 4512, section 4.1.
+ */
 static void
-free_class(gpointer key, gpointer value, gpointer data)
+scan_definition(GHashTable *table, tdefinition *def)
 {
-	ldap_objectclass_free(value);
+	char *ptr = def->str;
+	char *token;
+	int len, quoted;
+	int depth = 1;
+
+	if ( !(token = next_token(&ptr, &len, &quoted)) || *token != '(')
+		return;
+	if ( !(token = next_token(&ptr, &len, &quoted)))
+		return;
+	index_token(table, token, len, def);
+	while ( (token = next_token(&ptr, &len, &quoted))) {
+		if (!quoted && *token == '(')
+			depth++;
+		else if (!quoted && *token == ')')
+			depth--;
+		else if (depth == 1 && !quoted
+			 && len == 4 && !strncmp(token, "NAME", 4))
+			break;
+	}
+	if (!token || !(token = next_token(&ptr, &len, &quoted)))
+		return;
+	if (quoted) {
+		index_token(table, token, len, def);
+		return;
+	}
+	if (*token != '(')
+		return;
+	while ( (token = next_token(&ptr, &len, &quoted)) && quoted)
+		index_token(table, token, len, def);
 }
 
-static void
-free_type(gpointer key, gpointer value, gpointer data)
+static GHashTable *
+schema_table(char **values, tdefinition **defs)
 {
-	ldap_attributetype_free(value);
+	GHashTable *table
+		= g_hash_table_new_full(strcasehash, strcaseequal, free, 0);
+	int n = 0;
+	int i;
+
+	if (values)
+		for (; values[n]; n++)
+			;
+	*defs = xalloc((n + 1) * sizeof(tdefinition));
+	for (i = 0; i < n; i++) {
+		(*defs)[i].str = values[i];
+		(*defs)[i].parsed = 0;
+		scan_definition(table, &(*defs)[i]);
+	}
+	return table;
 }
 
 void
 schema_free(tschema *schema)
 {
-	g_hash_table_foreach_steal(schema->classes, aux_class_entry_p, 0);
-	g_hash_table_foreach_steal(schema->types, aux_type_entry_p, 0);
-
-	g_hash_table_foreach(schema->classes, free_class, 0);
-	g_hash_table_foreach(schema->types, free_type, 0);
+	int i;
 
 	g_hash_table_destroy(schema->classes);
 	g_hash_table_destroy(schema->types);
+	if (schema->class_values) {
+		for (i = 0; schema->class_values[i]; i++)
+			if (schema->class_defs[i].parsed)
+				ldap_objectclass_free(
+					schema->class_defs[i].parsed);
+		ldap_value_free(schema->class_values);
+	}
+	if (schema->type_values) {
+		for (i = 0; schema->type_values[i]; i++)
+			if (schema->type_defs[i].parsed)
+				ldap_attributetype_free(
+					schema->type_defs[i].parsed);
+		ldap_value_free(schema->type_values);
+	}
+	free(schema->class_defs);
+	free(schema->type_defs);
 	free(schema);
 }
 
+/*
+ * Read the entry DN in two steps, so that other requests can be in
+ * flight meanwhile: get_entry_request() sends the search and
+ * get_entry_receive() waits for its result.  ATTRS defaults to all
+ * attributes.
+ */
+int
+get_entry_request(LDAP *ld, char *dn, char **attrs)
+{
+	char *all[3] = {"+", "*", 0};
+	int msgid;
+
+	if (ldap_search_ext(ld, dn, LDAP_SCOPE_BASE, 0, attrs ? attrs : all,
+			    0, 0, 0, 0, 0, &msgid))
+		ldaperr(ld, "ldap_search");
+	return msgid;
+}
+
+LDAPMessage *
+get_entry_receive(LDAP *ld, int msgid, LDAPMessage **result)
+{
+	LDAPMessage *entry;
+
+	if (ldap_result(ld, msgid, LDAP_MSG_ALL, 0, result) == -1)
+		ldaperr(ld, "ldap_result");
+	if (ldap_result2error(ld, *result, 0))
+		ldaperr(ld, "ldap_search");
+	if ( !(entry = ldap_first_entry(ld, *result)))
+		ldaperr(ld, "ldap_first_entry");
+	return entry;
+}
+
+LDAPMessage *
+get_entry(LDAP *ld, char *dn, LDAPMessage **result)
+{
+	return get_entry_receive(ld, get_entry_request(ld, dn, 0), result);
+}
+
+/*
+ * Return the subschemaSubentry of ROOTDSE, or null.
+ */
+char *
+subschema_dn(LDAP *ld, LDAPMessage *rootdse)
+{
+	char **values = ldap_get_values(ld, rootdse, "subschemaSubentry");
+	char *result;
+
+	if (!values)
+		return 0;
+	result = xdup(*values);
+	ldap_value_free(values);
+	return result;
+}
+
+/*
+ * Like get_entry_request() for the subschema entry.
+ */
+int
+schema_request(LDAP *ld, char *dn)
+{
+	PROBE0(schema__start);
+	return get_entry_request(ld, dn, 0);
+}
+
+tschema *
+schema_receive(LDAP *ld, int msgid)
+{
+	LDAPMessage *result, *entry;
+	tschema *schema = xalloc(sizeof(tschema));
+
+	entry = get_entry_receive(ld, msgid, &result);
+	schema->class_values = ldap_get_values(ld, entry, "objectClasses");
+	schema->type_values = ldap_get_values(ld, entry, "attributeTypes");
+	ldap_msgfree(result);
+	schema->classes
+		= schema_table(schema->class_values, &schema->class_defs);
+	schema->types = schema_table(schema->type_values, &schema->type_defs);
+	PROBE2(schema__done,
+	       g_hash_table_size(schema->classes),
+	       g_hash_table_size(schema->types));
+	return schema;
+}
+
 tschema *
 schema_new(LDAP *ld)
 {
 	LDAPMessage *result, *entry;
-	char **values;
-	char *subschema_dn;
-	int code;
-	const char *errp;
+	char *dn;
 	char *attrs[2] = {"subschemaSubentry", 0};
 	tschema *schema;
 
@@ -152,55 +358,14 @@ schema_new(LDAP *ld)
 		ldap_perror(ld, "ldap_first_entry");
 		return 0;
 	}
-	values = ldap_get_values(ld, entry, "subschemaSubentry");
-	if (!values) {
+	dn = subschema_dn(ld, entry);
+	ldap_msgfree(result);
+	if (!dn) {
 		fputs("subschemaSubentry attribute not found.", stderr);
-		ldap_msgfree(result);
 		return 0;
 	}
-	subschema_dn = xdup(*values);
-	ldap_value_free(values);
-	ldap_msgfree(result);
-
-	entry = get_entry(ld, subschema_dn, &result);
-	free(subschema_dn);
-	values = ldap_get_values(ld, entry, "objectClasses");
-
-	schema = xalloc(sizeof(tschema));
-	schema->classes = g_hash_table_new(strcasehash, strcaseequal);
-	schema->types = g_hash_table_new(strcasehash, strcaseequal);
-
-	if (values) {
-		char **ptr = values;
-		for (ptr = values; *ptr; ptr++) {
-			LDAPObjectClass *cls
-				= ldap_str2objectclass(*ptr, &code, &errp, 0);
-			if (cls)
-				add_objectclass(schema->classes, cls);
-                        else
-                                fprintf(stderr,
-                                        "Warning: Cannot parse class: %s\n",
-                                        ldap_scherr2str(code));
-		}
-		ldap_value_free(values);
-	}
-	values = ldap_get_values(ld, entry, "attributeTypes");
-	if (values) {
-		char **ptr = values;
-		for (ptr = values; *ptr; ptr++) {
-			LDAPAttributeType *at
-				= ldap_str2attributetype(
-					*ptr, &code, &errp, 0);
-			if (at)
-                                add_attributetype(schema->types, at);
-                        else
-                                fprintf(stderr,
-                                        "Warning: Cannot parse type: %s\n",
-                                        ldap_scherr2str(code));
-		}
-		ldap_value_free(values);
-	}
-	ldap_msgfree(result);
+	schema = schema_receive(ld, schema_request(ld, dn));
+	free(dn);
 	return schema;
 }
 
@@ -286,8 +451,9 @@ entroid_remove_ad(tentroid *entroid, char *ad)
 
 	if (s) {
 		int n = s - ad;
-		name = xalloc(n);
+		name = xalloc(n + 1);
 		memcpy(name, ad, n);
+		name[n] = 0;
 	} else
 		name = ad;
 
@@ -15,7 +15,13 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define ALLOC_CATEGORY ALLOC_OUTPUT
 #include "common.h"
+#include "config.h"
+#include "probes.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 static int
 get_ws_col(void)
@@ -26,7 +32,7 @@ get_ws_col(void)
 }
 
 static void
-update_progress(LDAP *ld, int n, LDAPMessage *entry)
+update_progress(int n, struct berval *dn)
 {
 	int cols = get_ws_col();
 	static struct timeval tv;
@@ -34,7 +40,7 @@ update_progress(LDAP *ld, int n, LDAPMessage *entry)
 	int i;
 
 	if (gettimeofday(&tv, 0) == -1) syserr();
-	if (!entry)
+	if (!dn)
 		usec = 0;
 	else if (!usec)
 		usec = tv.tv_usec;
@@ -49,12 +55,8 @@ update_progress(LDAP *ld, int n, LDAPMessage *entry)
 	for (i = 0; i < cols; i++) putchar(' ');
 
 	printf((n == 1) ? "\r%7d entry read  " :"\r%7d entries read", n);
-	if (entry) {
-		char *dn = ldap_get_dn(ld, entry);
-		if (strlen(dn) < cols - 28)
-			printf("        %s", dn);
-		ldap_memfree(dn);
-	}
+	if (dn && dn->bv_len < cols - 28)
+		printf("        %.*s", (int) dn->bv_len, dn->bv_val);
 	fflush(stdout);
 }
 
@@ -100,41 +102,164 @@ handle_result(LDAP *ld, LDAPMessage *result, int start, int n,
 }
 
 void
-log_reference(LDAP *ld, LDAPMessage *reference, FILE *s)
+log_reference(LDAP *ld, LDAPMessage *reference, tobuffer *b)
 {
         char **refs;
 	char **ptr;
 
         if (ldap_parse_reference(ld, reference, &refs, 0, 0))
 		ldaperr(ld, "ldap_parse_reference");
-	fputc('\n', s);
+	obuffer_putc(b, '\n');
 	for (ptr = refs; *ptr; ptr++)
-		fprintf(s, "# reference to: %s\n", *ptr);
+		obuffer_printf(b, "# reference to: %s\n", *ptr);
 	ldap_value_free(refs);
 }
 
+void
+berentry_init(tberentry *entry)
+{
+	entry->ber = 0;
+	entry->dn.bv_val = 0;
+	entry->dn.bv_len = 0;
+	entry->attributes = g_array_new(0, 0, sizeof(tberattribute));
+}
+
+/*
+ * Walk MESSAGE once and remember where its DN, attribute descriptions,
+ * and values are.  With ldap_get_attribute_ber() nothing is copied;
+ * everything stays valid until berentry_clear() or ldap_msgfree().
+ *
+ * Since in-place decoding modifies the BER buffer, MESSAGE must not be
+ * handed to ldap_get_values() and friends afterwards.
+ */
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+void
+berentry_read(tberentry *entry, LDAP *ld, LDAPMessage *message)
+{
+	tberattribute a;
+	int rc;
+
+	if (ldap_get_dn_ber(ld, message, &entry->ber, &entry->dn))
+		ldaperr(ld, "ldap_get_dn_ber");
+	a.data = 0;
+	for (;;) {
+		rc = ldap_get_attribute_ber(
+			ld, message, entry->ber, &a.ad, &a.values);
+		if (rc != LDAP_SUCCESS)
+			ldaperr(ld, "ldap_get_attribute_ber");
+		if (!a.ad.bv_val)
+			break;
+		g_array_append_val(entry->attributes, a);
+	}
+}
+#else
+void
+berentry_read(tberentry *entry, LDAP *ld, LDAPMessage *message)
+{
+	tberattribute a;
+	char *ad;
+
+	entry->dn.bv_val = ldap_get_dn(ld, message);
+	entry->dn.bv_len = strlen(entry->dn.bv_val);
+	for (ad = ldap_first_attribute(ld, message, &entry->ber);
+	     ad;
+	     ad = ldap_next_attribute(ld, message, entry->ber))
+	{
+		struct berval **values = ldap_get_values_len(ld, message, ad);
+		a.ad.bv_val = ad;
+		a.ad.bv_len = strlen(ad);
+		a.data = values;
+		if (values) {
+			int i, n = 0;
+			while (values[n]) n++;
+			a.values = xalloc((n + 1) * sizeof(struct berval));
+			for (i = 0; i < n; i++)
+				a.values[i] = *values[i];
+			a.values[n].bv_val = 0;
+			a.values[n].bv_len = 0;
+		} else
+			a.values = 0;
+		g_array_append_val(entry->attributes, a);
+	}
+}
+#endif
+
+void
+berentry_clear(tberentry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->attributes->len; i++) {
+		tberattribute *a
+			= &g_array_index(entry->attributes, tberattribute, i);
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+		if (a->values) ber_memfree(a->values);
+#else
+		ldap_memfree(a->ad.bv_val);
+		if (a->data) ldap_value_free_len(a->data);
+		if (a->values) free(a->values);
+#endif
+	}
+	g_array_set_size(entry->attributes, 0);
+#ifndef HAVE_LDAP_GET_ATTRIBUTE_BER
+	if (entry->dn.bv_val) ldap_memfree(entry->dn.bv_val);
+#endif
+	entry->dn.bv_val = 0;
+	entry->dn.bv_len = 0;
+	if (entry->ber) ber_free(entry->ber, 0);
+	entry->ber = 0;
+}
+
+void
+berentry_free(tberentry *entry)
+{
+	berentry_clear(entry);
+	g_array_free(entry->attributes, 1);
+}
+
+struct berval *
+berentry_values(tberentry *entry, char *ad)
+{
+	int n = strlen(ad);
+	int i;
+
+	for (i = 0; i < entry->attributes->len; i++) {
+		tberattribute *a
+			= &g_array_index(entry->attributes, tberattribute, i);
+		if (a->ad.bv_len == n && !strncasecmp(a->ad.bv_val, ad, n))
+			return a->values;
+	}
+	return 0;
+}
+
+/*
+ * Values decoded in place are not zero-terminated, so each class name is
+ * copied before the lookup.  (The DN and attribute descriptions are.)
+ */
 static tentroid *
-entroid_set_message(LDAP *ld, tentroid *entroid, LDAPMessage *entry)
+entroid_set_message(tentroid *entroid, tberentry *entry)
 {
-	struct berval **values = ldap_get_values_len(ld, entry, "objectClass");
-	struct berval **ptr;
+	struct berval *values = berentry_values(entry, "objectClass");
+	struct berval *ptr;
 
-	if (!values || !*values)
+	if (!values || !values->bv_val)
 		return 0;
 
 	entroid_reset(entroid);
-	for (ptr = values; *ptr; ptr++) {
-		struct berval *value = *ptr;
-		LDAPObjectClass *cls
-			= entroid_request_class(entroid, value->bv_val);
+	for (ptr = values; ptr->bv_val; ptr++) {
+		LDAPObjectClass *cls;
+		char *name = xalloc(ptr->bv_len + 1);
+
+		memcpy(name, ptr->bv_val, ptr->bv_len);
+		name[ptr->bv_len] = 0;
+		cls = entroid_request_class(entroid, name);
+		free(name);
 		if (!cls) {
 			g_string_append(entroid->comment, "# ERROR: ");
 			g_string_append(entroid->comment, entroid->error->str);
-			ldap_value_free_len(values);
 			return entroid;
 		}
 	}
-	ldap_value_free_len(values);
 
 	if (compute_entroid(entroid) == -1) {
 		g_string_append(entroid->comment, "# ERROR: ");
@@ -144,105 +269,398 @@ entroid_set_message(LDAP *ld, tentroid *entroid, LDAPMessage *entry)
 	return entroid;
 }
 
+/*
+ * Search results go through a three-stage pipeline: a receiver thread
+ * drains ldap_result() and decodes each message, formatter threads print
+ * each entry into the buffer of its slot, and the calling thread writes
+ * the buffers in order, recording offsets and updating the progress
+ * display.  Only the receiver uses the LDAP handle, since libldap calls
+ * on the same handle are not safe to make from several threads at once.
+ *
+ * The slots form a ring, so that the receiver stalls once it gets
+ * PIPELINE_SLOTS messages ahead of the writer.  Without threads, the
+ * same steps are simply run one after the other.
+ */
+#define PIPELINE_SLOTS 64
+
+enum slot_state { SLOT_EMPTY, SLOT_RECEIVED, SLOT_FORMATTED };
+
+typedef struct tslot {
+	enum slot_state state;
+	int type;
+	int key;
+	LDAPMessage *message;
+	tberentry entry;
+	tobuffer buffer;
+} tslot;
+
+typedef struct tpipeline {
+	FILE *s;
+	tcompressor *compressor;
+	tlineindex *lineindex;
+	LDAP *ld;
+	int msgid;
+	int notty;
+	int ldif;
+	tschema *schema;
+	tslot slots[PIPELINE_SLOTS];
+	int nentries;		/* entries received */
+	int received;		/* messages received */
+	int formatting;		/* messages handed to a formatter */
+	int written;		/* messages written */
+	LDAPMessage *result;	/* final result, once received */
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+	pthread_cond_t work;
+	pthread_cond_t ready;
+#endif
+} tpipeline;
+
+/*
+ * Wait for the next message.  Return its slot, or 0 once the search
+ * result has arrived, which is then stored in *FINAL.
+ */
+static tslot *
+pipeline_receive(tpipeline *p, int start, LDAPMessage **final)
+{
+	LDAPMessage *result;
+	tslot *slot;
+	int type;
+	double since = stats_start();
+
+	switch ( (type = ldap_result(p->ld, p->msgid, 0, 0, &result))) {
+	case -1:
+	case 0:
+		ldaperr(p->ld, "ldap_result");
+	case LDAP_RES_SEARCH_ENTRY:
+	case LDAP_RES_SEARCH_REFERENCE:
+		break;
+	case LDAP_RES_SEARCH_RESULT:
+		*final = result;
+		return 0;
+	default:
+		abort();
+	}
+
+	slot = &p->slots[p->received % PIPELINE_SLOTS];
+	slot->type = type;
+	slot->message = result;
+	if (type == LDAP_RES_SEARCH_ENTRY) {
+		stats_latency(STATS_ENTRY, since);
+		slot->key = start + p->nentries++;
+	} else
+		slot->key = -1;
+	PROBE2(search__message, slot->key, type);
+	if (!slot->buffer.data) {
+		obuffer_init(&slot->buffer, 0);
+		berentry_init(&slot->entry);
+	}
+	if (type == LDAP_RES_SEARCH_ENTRY)
+		berentry_read(&slot->entry, p->ld, result);
+	else
+		log_reference(p->ld, result, &slot->buffer);
+	return slot;
+}
+
 static void
-search_subtree(FILE *s, LDAP *ld, GArray *offsets, char *base,
-	       cmdline *cmdline, LDAPControl **ctrls, int notty, int ldif,
-	       tschema *schema)
+pipeline_format(tpipeline *p, tslot *slot, tentroid *entroid)
 {
-	int msgid;
-	LDAPMessage *result, *entry;
-	int start = offsets->len;
-	int n = start;
-	long offset;
-	tentroid *entroid;
-	tentroid *e;
+	tentroid *e = 0;
 
-	if (schema)
-		entroid = entroid_new(schema);
+	if (slot->type == LDAP_RES_SEARCH_REFERENCE)
+		/* printed by pipeline_receive() */
+		return;
+	if (entroid)
+		e = entroid_set_message(entroid, &slot->entry);
+	if (p->ldif)
+		print_ldif_message(&slot->buffer, &slot->entry,
+				   p->notty ? -1 : slot->key, e);
 	else
-		entroid = 0;
+		print_ldapvi_message(&slot->buffer, &slot->entry, slot->key, e);
+}
+
+static void
+pipeline_write(tpipeline *p, tslot *slot, GArray *offsets, int progress)
+{
+	tobuffer *b = &slot->buffer;
+	long offset;
+
+	if (slot->type == LDAP_RES_SEARCH_ENTRY) {
+		offset = ftell(p->s);
+		if (offset == -1 && !p->notty) syserr();
+		g_array_append_val(offsets, offset);
+		stats_count(&slot->entry, b->len);
+	}
+	if (p->lineindex)
+		line_index_note(p->lineindex, b->data, b->len);
+	if (p->compressor)
+		compressor_write(p->compressor, b->data, b->len);
+	else if (b->len && fwrite(b->data, 1, b->len, p->s) != b->len)
+		syserr();
+	b->len = 0;
+	if (slot->type == LDAP_RES_SEARCH_ENTRY && progress)
+		update_progress(slot->key + 1, &slot->entry.dn);
+	berentry_clear(&slot->entry);
+	ldap_msgfree(slot->message);
+}
+
+#ifdef HAVE_LIBPTHREAD
+typedef struct treceiver {
+	tpipeline *p;
+	int start;
+} treceiver;
+
+static void *
+pipeline_receiver(void *arg)
+{
+	treceiver *r = arg;
+	tpipeline *p = r->p;
+	LDAPMessage *final;
+	tslot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->received - p->written >= PIPELINE_SLOTS)
+			pthread_cond_wait(&p->space, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+		slot = pipeline_receive(p, r->start, &final);
+		pthread_mutex_lock(&p->lock);
+		if (!slot) {
+			p->result = final;
+			break;
+		}
+		slot->state = SLOT_RECEIVED;
+		p->received++;
+		pthread_cond_signal(&p->work);
+	}
+	pthread_cond_broadcast(&p->work);
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+static void *
+pipeline_formatter(void *arg)
+{
+	tpipeline *p = arg;
+	tentroid *entroid = p->schema ? entroid_new(p->schema) : 0;
+	tslot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->formatting == p->received && !p->result)
+			pthread_cond_wait(&p->work, &p->lock);
+		if (p->formatting == p->received)
+			break;
+		slot = &p->slots[p->formatting++ % PIPELINE_SLOTS];
+		pthread_mutex_unlock(&p->lock);
+		pipeline_format(p, slot, entroid);
+		pthread_mutex_lock(&p->lock);
+		slot->state = SLOT_FORMATTED;
+		pthread_cond_signal(&p->ready);
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (entroid)
+		entroid_free(entroid);
+	return 0;
+}
+
+int
+pipeline_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 2) return 1;
+	if (n > PIPELINE_WORKERS) return PIPELINE_WORKERS;
+	return n;
+}
+
+static void
+pipeline_run(tpipeline *p, GArray *offsets, int start, int progress)
+{
+	pthread_t receiver;
+	pthread_t workers[PIPELINE_WORKERS];
+	treceiver r;
+	int nworkers = pipeline_workers();
+	tslot *slot;
+	int i;
+
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->space, 0);
+	pthread_cond_init(&p->work, 0);
+	pthread_cond_init(&p->ready, 0);
+
+	r.p = p;
+	r.start = start;
+	if (pthread_create(&receiver, 0, pipeline_receiver, &r))
+		syserr();
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&workers[i], 0, pipeline_formatter, p))
+			syserr();
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		slot = &p->slots[p->written % PIPELINE_SLOTS];
+		if (slot->state != SLOT_FORMATTED) {
+			if (p->result && p->written == p->received)
+				break;
+			pthread_cond_wait(&p->ready, &p->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&p->lock);
+		pipeline_write(p, slot, offsets, progress);
+		pthread_mutex_lock(&p->lock);
+		slot->state = SLOT_EMPTY;
+		p->written++;
+		pthread_cond_signal(&p->space);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(receiver, 0);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], 0);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->space);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->ready);
+}
+#else
+static void
+pipeline_run(tpipeline *p, GArray *offsets, int start, int progress)
+{
+	tentroid *entroid = p->schema ? entroid_new(p->schema) : 0;
+	tslot *slot;
+
+	while ( (slot = pipeline_receive(p, start, &p->result))) {
+		pipeline_format(p, slot, entroid);
+		pipeline_write(p, slot, offsets, progress);
+		p->received++;
+		p->written++;
+	}
+	if (entroid)
+		entroid_free(entroid);
+}
+#endif
+
+/*
+ * The request for the first base DN, if search_begin() has sent it.
+ */
+static int first_msgid = -1;
+
+static int
+search_send(LDAP *ld, char *base, cmdline *cmdline, LDAPControl **ctrls)
+{
+	int msgid;
 
 	if (ldap_search_ext(
 		    ld, base,
 		    cmdline->scope, cmdline->filter, cmdline->attrs,
 		    0, ctrls, 0, 0, 0, &msgid))
 		ldaperr(ld, "ldap_search");
+	return msgid;
+}
 
-	while (n >= 0)
-		switch (ldap_result(ld, msgid, 0, 0, &result)) {
-		case -1:
-		case 0:
-			ldaperr(ld, "ldap_result");
-		case LDAP_RES_SEARCH_ENTRY:
-			entry = ldap_first_entry(ld, result);
-			offset = ftell(s);
-			if (offset == -1 && !notty) syserr();
-			g_array_append_val(offsets, offset);
-			if (entroid)
-				e = entroid_set_message(ld, entroid, entry);
-			else
-				e = 0;
-			if (ldif)
-				print_ldif_message(
-					s, ld, entry, notty ? -1 : n, e);
-			else
-				print_ldapvi_message(s, ld, entry, n, e);
-			n++;
-			if (!cmdline->quiet && !notty)
-				update_progress(ld, n, entry);
-			ldap_msgfree(entry);
-			break;
-		case LDAP_RES_SEARCH_REFERENCE:
-			log_reference(ld, result, s);
-			ldap_msgfree(result);
-			break;
-		case LDAP_RES_SEARCH_RESULT:
-			if (!notty) {
-				update_progress(ld, n, 0);
-				putchar('\n');
-			}
-			handle_result(ld, result, start, n, !cmdline->quiet,
-				      notty);
-			n = -1;
-			ldap_msgfree(result);
-			break;
-		default:
-			abort();
+/*
+ * Send the search for the first base DN now, so that it is in flight
+ * while the caller waits for other requests.  search() picks it up.
+ */
+void
+search_begin(LDAP *ld, cmdline *cmdline, LDAPControl **ctrls)
+{
+	GPtrArray *basedns = cmdline->basedns;
+	char *base = basedns->len ? g_ptr_array_index(basedns, 0) : 0;
+
+	first_msgid = search_send(ld, base, cmdline, ctrls);
+}
+
+static void
+search_subtree(FILE *s, tcompressor *compressor, tlineindex *lineindex,
+	       LDAP *ld, GArray *offsets, int msgid, cmdline *cmdline,
+	       int notty, int ldif, tschema *schema)
+{
+	tpipeline *p = xalloc(sizeof(tpipeline));
+	int start = offsets->len;
+	int n;
+	int i;
+
+	memset(p, 0, sizeof(tpipeline));
+	p->s = s;
+	p->compressor = compressor;
+	p->lineindex = lineindex;
+	p->ld = ld;
+	p->notty = notty;
+	p->ldif = ldif;
+	p->schema = schema;
+	p->msgid = msgid;
+
+	pipeline_run(p, offsets, start, !cmdline->quiet && !notty);
+
+	n = start + p->nentries;
+	if (!notty) {
+		update_progress(n, 0);
+		putchar('\n');
+	}
+	handle_result(ld, p->result, start, n, !cmdline->quiet, notty);
+	ldap_msgfree(p->result);
+
+	for (i = 0; i < PIPELINE_SLOTS; i++)
+		if (p->slots[i].buffer.data) {
+			obuffer_free(&p->slots[i].buffer);
+			berentry_free(&p->slots[i].entry);
 		}
-	if (entroid)
-		entroid_free(entroid);
+	free(p);
 }
 
+/*
+ * Search and write the results to S.  If SCHEMA is not null, annotate
+ * each entry with schema comments.
+ *
+ * The search for the next base DN is sent before the results of the
+ * current one are read, so that the server works on it meanwhile.  Its
+ * results queue up in libldap, but only for one base DN at a time.
+ */
 GArray *
 search(FILE *s, LDAP *ld, cmdline *cmdline, LDAPControl **ctrls, int notty,
-       int ldif)
+       int ldif, tlineindex *lineindex, tschema *schema)
 {
 	GArray *offsets = g_array_new(0, 0, sizeof(long));
 	GPtrArray *basedns = cmdline->basedns;
 	int i;
-	tschema *schema;
+	int msgid;
+	tcompressor *compressor = 0;
 
-	if (cmdline->schema_comments) {
-		schema = schema_new(ld);
-		if (!schema) {
-			fputs("Error: Failed to read schema, giving up.",
-			      stderr);
-			exit(1);
-		}
-	} else
-		schema = 0;
+	stats_begin(STATS_SEARCH);
+	/* offsets are useless in compressed output, so only with notty */
+	if (cmdline->compress && notty)
+		compressor = compressor_new(
+			s, cmdline->compress, cmdline->compress_level);
 
+	if ( (msgid = first_msgid) == -1)
+		msgid = search_send(
+			ld, basedns->len ? g_ptr_array_index(basedns, 0) : 0,
+			cmdline, ctrls);
+	first_msgid = -1;
 	if (basedns->len == 0)
-		search_subtree(s, ld, offsets, 0, cmdline, ctrls, notty, ldif,
-			       schema);
+		search_subtree(s, compressor, lineindex, ld, offsets, msgid,
+			       cmdline, notty, ldif, schema);
 	else
 		for (i = 0; i < basedns->len; i++) {
 			char *base = g_ptr_array_index(basedns, i);
+			int next = -1;
+
+			if (i + 1 < basedns->len)
+				next = search_send(
+					ld, g_ptr_array_index(basedns, i + 1),
+					cmdline, ctrls);
 			if (!cmdline->quiet && (basedns->len > 1))
 				fprintf(stderr, "Searching in: %s\n", base);
-			search_subtree(s, ld, offsets, base, cmdline, ctrls,
-				       notty, ldif, schema);
+			search_subtree(s, compressor, lineindex, ld, offsets,
+				       msgid, cmdline, notty, ldif, schema);
+			msgid = next;
 		}
+	if (compressor)
+		compressor_finish(compressor);
+	stats_end(STATS_SEARCH);
 
 	if (!offsets->len) {
 		if (!cmdline->noninteractive) {
@@ -254,37 +672,22 @@ search(FILE *s, LDAP *ld, cmdline *cmdline, LDAPControl **ctrls, int notty,
 		exit(0);
 	}
 
-	if (schema)
-		schema_free(schema);
 	return offsets;
 }
 
-LDAPMessage *
-get_entry(LDAP *ld, char *dn, LDAPMessage **result)
-{
-	LDAPMessage *entry;
-	char *attrs[3] = {"+", "*", 0};
-
-	if (ldap_search_s(ld, dn, LDAP_SCOPE_BASE, 0, attrs, 0, result))
-		ldaperr(ld, "ldap_search");
-	if ( !(entry = ldap_first_entry(ld, *result)))
-		ldaperr(ld, "ldap_first_entry");
-	return entry;
-}
-
+/*
+ * Add the namingContexts of ROOTDSE to BASEDNS.
+ */
 void
-discover_naming_contexts(LDAP *ld, GPtrArray *basedns)
+discover_naming_contexts(LDAP *ld, LDAPMessage *rootdse, GPtrArray *basedns)
 {
-	LDAPMessage *result, *entry;
 	char **values;
 
-	entry = get_entry(ld, "", &result);
-	values = ldap_get_values(ld, entry, "namingContexts");
+	values = ldap_get_values(ld, rootdse, "namingContexts");
 	if (values) {
 		char **ptr = values;
 		for (ptr = values; *ptr; ptr++)
 			g_ptr_array_add(basedns, xdup(*ptr));
 		ldap_value_free(values);
 	}
-	ldap_msgfree(result);
 }
@@ -0,0 +1,346 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <sys/resource.h>
+#include "common.h"
+#include "config.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * --stats: wall clock time per phase, counters, and a latency histogram
+ * per operation type, printed to stderr when the process exits.
+ *
+ * Histogram bucket i counts latencies below 2^i microseconds (and at
+ * least 2^(i-1)), the last bucket everything slower.
+ *
+ * Allocations through xalloc() and xdup() are counted by the
+ * ALLOC_CATEGORY of the calling file.  Frees are not tracked, so these
+ * are totals, not live memory.  GLib and libldap allocate behind our
+ * back; the peak RSS at the end of each phase covers them.
+ *
+ * Only the allocation counters are locked, since formatter threads
+ * allocate too.  Search entries are timed by the receiver thread of the
+ * search pipeline and counted by the writer, while everything else
+ * happens in the main thread, so no other field has two writers.
+ */
+#define STATS_BUCKETS 28
+
+typedef struct tphase {
+	double start;
+	double seconds;
+	long count;
+	long start_rss;
+	long peak_rss;		/* kilobytes */
+	long growth;		/* kilobytes */
+} tphase;
+
+typedef struct thistogram {
+	long count;
+	double seconds;
+	double max;
+	long buckets[STATS_BUCKETS];
+} thistogram;
+
+static struct {
+	int format;
+	pid_t pid;
+	tphase phases[STATS_NPHASES];
+	thistogram ops[STATS_NOPS];
+	long entries;
+	long values;
+	long bytes;
+	long created;
+	struct {
+		long count;
+		long bytes;
+	} allocs[ALLOC_NCATEGORIES];
+} stats;
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static char *phase_names[STATS_NPHASES] = {
+	"connect", "schema", "search", "write", "editor", "analyze", "commit"
+};
+
+static char *op_names[STATS_NOPS] = {
+	"entry", "modify", "add", "delete", "rename"
+};
+
+static char *alloc_names[ALLOC_NCATEGORIES] = {
+	"other", "parser", "entry", "mods", "schema", "output", "pool"
+};
+
+static double
+stats_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) syserr();
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	struct timeval tv;
+
+	if (gettimeofday(&tv, 0) == -1) syserr();
+	return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+static long
+peak_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1) syserr();
+	return ru.ru_maxrss;
+}
+
+/*
+ * Bytes allocated per entry read from the server or parsed.
+ */
+static double
+per_entry(long bytes)
+{
+	long n = stats.entries + stats.created;
+	return n ? (double) bytes / n : 0;
+}
+
+/*
+ * The latency below which a fraction P of the operations in H
+ * completed, rounded up to the bucket boundary.
+ */
+static double
+percentile(thistogram *h, double p)
+{
+	long n = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		n += h->buckets[i];
+		if (n >= p * h->count)
+			break;
+	}
+	if (i == STATS_BUCKETS - 1)
+		return h->max;
+	return MIN((double) (1L << i) / 1e6, h->max);
+}
+
+static void
+print_text(FILE *s)
+{
+	int i;
+
+	fputs("\nphase        seconds  count   peak_kb growth_kb\n", s);
+	for (i = 0; i < STATS_NPHASES; i++) {
+		tphase *phase = &stats.phases[i];
+		if (phase->count)
+			fprintf(s, "%-10s %9.3f %6ld %9ld %9ld\n",
+				phase_names[i], phase->seconds, phase->count,
+				phase->peak_rss, phase->growth);
+	}
+	fprintf(s, "\nentries %ld, values %ld, bytes %ld, entries parsed %ld\n",
+		stats.entries, stats.values, stats.bytes, stats.created);
+	fputs("\nallocation    count       bytes  bytes/entry\n", s);
+	for (i = 0; i < ALLOC_NCATEGORIES; i++)
+		if (stats.allocs[i].count)
+			fprintf(s, "%-9s %9ld %11ld %12.1f\n",
+				alloc_names[i], stats.allocs[i].count,
+				stats.allocs[i].bytes,
+				per_entry(stats.allocs[i].bytes));
+	fputs("\noperation   count   mean_ms    p50_ms    p90_ms"
+	      "    p99_ms    max_ms\n",
+	      s);
+	for (i = 0; i < STATS_NOPS; i++) {
+		thistogram *h = &stats.ops[i];
+		if (!h->count)
+			continue;
+		fprintf(s, "%-9s %7ld %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			op_names[i], h->count, h->seconds * 1e3 / h->count,
+			percentile(h, 0.5) * 1e3, percentile(h, 0.9) * 1e3,
+			percentile(h, 0.99) * 1e3, h->max * 1e3);
+	}
+}
+
+static void
+print_json(FILE *s)
+{
+	int i, j;
+
+	fputs("{\"phases\": {", s);
+	for (i = 0; i < STATS_NPHASES; i++)
+		fprintf(s, "%s\"%s\": {\"seconds\": %.6f, \"count\": %ld"
+			", \"peak_kb\": %ld, \"growth_kb\": %ld}",
+			i ? ", " : "", phase_names[i],
+			stats.phases[i].seconds, stats.phases[i].count,
+			stats.phases[i].peak_rss, stats.phases[i].growth);
+	fprintf(s, "}, \"entries\": %ld, \"values\": %ld, \"bytes\": %ld"
+		", \"entries_parsed\": %ld",
+		stats.entries, stats.values, stats.bytes, stats.created);
+	fputs(", \"allocations\": {", s);
+	for (i = 0; i < ALLOC_NCATEGORIES; i++)
+		fprintf(s, "%s\"%s\": {\"count\": %ld, \"bytes\": %ld"
+			", \"per_entry\": %.1f}",
+			i ? ", " : "", alloc_names[i], stats.allocs[i].count,
+			stats.allocs[i].bytes,
+			per_entry(stats.allocs[i].bytes));
+	fprintf(s, "}, \"peak_kb\": %ld", peak_rss());
+	fputs(", \"operations\": {", s);
+	for (i = 0; i < STATS_NOPS; i++) {
+		thistogram *h = &stats.ops[i];
+		int n = STATS_BUCKETS;
+
+		fprintf(s, "%s\"%s\": {\"count\": %ld, \"seconds\": %.6f"
+			", \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f"
+			", \"max\": %.6f, \"buckets_us\": [",
+			i ? ", " : "", op_names[i], h->count, h->seconds,
+			percentile(h, 0.5), percentile(h, 0.9),
+			percentile(h, 0.99), h->max);
+		/* trailing empty buckets are left out */
+		while (n > 0 && !h->buckets[n - 1])
+			n--;
+		for (j = 0; j < n; j++)
+			fprintf(s, "%s%ld", j ? ", " : "", h->buckets[j]);
+		fputs("]}", s);
+	}
+	fputs("}}\n", s);
+}
+
+static void
+stats_report(void)
+{
+	/* not in children that fail to exec */
+	if (getpid() != stats.pid)
+		return;
+	if (stats.format == STATS_JSON)
+		print_json(stderr);
+	else
+		print_text(stderr);
+}
+
+void
+stats_init(int format)
+{
+	if (format == STATS_OFF)
+		return;
+	stats.format = format;
+	stats.pid = getpid();
+	if (atexit(stats_report)) syserr();
+}
+
+void
+stats_begin(int phase)
+{
+	tphase *p = &stats.phases[phase];
+
+	if (!stats.format)
+		return;
+	p->start = stats_now();
+	p->start_rss = peak_rss();
+}
+
+void
+stats_end(int phase)
+{
+	tphase *p = &stats.phases[phase];
+
+	if (!stats.format)
+		return;
+	p->seconds += stats_now() - p->start;
+	p->count++;
+	p->peak_rss = peak_rss();
+	p->growth += p->peak_rss - p->start_rss;
+}
+
+/*
+ * Return a start time for stats_latency(), or 0 if --stats is off.
+ */
+double
+stats_start(void)
+{
+	return stats.format ? stats_now() : 0;
+}
+
+void
+stats_latency(int op, double start)
+{
+	thistogram *h = &stats.ops[op];
+	double t;
+	long us;
+	int i;
+
+	if (!stats.format)
+		return;
+	t = stats_now() - start;
+	h->count++;
+	h->seconds += t;
+	if (t > h->max)
+		h->max = t;
+	us = t * 1e6;
+	for (i = 0; i < STATS_BUCKETS - 1 && us >= (1L << i); i++)
+		;
+	h->buckets[i]++;
+}
+
+/*
+ * Count a search result ENTRY, written as BYTES bytes.
+ */
+void
+stats_count(tberentry *entry, long bytes)
+{
+	int i;
+
+	if (!stats.format)
+		return;
+	stats.entries++;
+	stats.bytes += bytes;
+	for (i = 0; i < entry->attributes->len; i++) {
+		struct berval *ptr = g_array_index(
+			entry->attributes, tberattribute, i).values;
+		if (ptr)
+			for (; ptr->bv_val; ptr++)
+				stats.values++;
+	}
+}
+
+/*
+ * Count an entry made by entry_new(), usually by a parser.
+ */
+void
+stats_entry_created(void)
+{
+	if (stats.format)
+		stats.created++;
+}
+
+void
+stats_alloc(int category, size_t size)
+{
+	if (!stats.format)
+		return;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&alloc_lock);
+#endif
+	stats.allocs[category].count++;
+	stats.allocs[category].bytes += size;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&alloc_lock);
+#endif
+}
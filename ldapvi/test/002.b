@@ -0,0 +1,14 @@
+
+0 ou=staff,dc=example,dc=com
+objectClass: organizationalUnit
+ou: staff
+
+1 cn=a,dc=example,dc=com
+objectClass: person
+cn: a
+sn: A
+
+2 cn=b,ou=staff,dc=example,dc=com
+objectClass: person
+cn: b
+sn: B
@@ -0,0 +1,13 @@
+
+0 ou=staff,dc=example,dc=com
+objectClass: organizationalUnit
+ou: staff
+
+1 ou=team,ou=staff,dc=example,dc=com
+objectClass: organizationalUnit
+ou: team
+
+2 cn=c,ou=team,ou=staff,dc=example,dc=com
+objectClass: person
+cn: c
+sn: A
@@ -0,0 +1,9 @@
+
+0 cn=a,ou=staff,dc=example,dc=com
+objectClass: person
+cn: a
+sn: A
+
+1 ou=staff,dc=example,dc=com
+objectClass: organizationalUnit
+ou: staff
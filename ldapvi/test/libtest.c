@@ -0,0 +1,257 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Tests of libldapvi through its public interface: the error returns,
+ * recovery after an error, and independent calls in several threads.
+ * Prints one line per failed check and exits with status 1 if there
+ * was any.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../config.h"
+#include "../libldapvi.h"
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_TLS)
+#include <pthread.h>
+#define THREADS 8
+#endif
+
+#define RECORDS 2000
+
+static int failures = 0;
+
+static void
+check(int ok, char *what)
+{
+	if (!ok) {
+		printf("FAIL: %s (%s)\n", what, ldapvi_error());
+		failures++;
+	}
+}
+
+/*
+ * A temporary file holding STR, positioned at its start.
+ */
+static FILE *
+string_file(char *str)
+{
+	FILE *s = tmpfile();
+
+	if (!s || fputs(str, s) == EOF || fseek(s, 0, SEEK_SET) == -1) {
+		perror("tmpfile");
+		exit(1);
+	}
+	return s;
+}
+
+/*
+ * The contents of S, which is closed.
+ */
+static char *
+file_string(FILE *s)
+{
+	long n;
+	char *result;
+
+	if (fflush(s) == EOF || (n = ftell(s)) == -1
+	    || fseek(s, 0, SEEK_SET) == -1)
+	{
+		perror("file_string");
+		exit(1);
+	}
+	result = malloc(n + 1);
+	if (!result || fread(result, 1, n, s) != n) {
+		perror("file_string");
+		exit(1);
+	}
+	result[n] = 0;
+	fclose(s);
+	return result;
+}
+
+static char *
+records(void)
+{
+	char *result = malloc(RECORDS * 128);
+	char *ptr = result;
+	int i;
+
+	for (i = 0; i < RECORDS; i++)
+		ptr += sprintf(ptr,
+			       "dn: cn=u%d,dc=example,dc=com\n"
+			       "changetype: add\n"
+			       "objectClass: person\n"
+			       "cn: u%d\n"
+			       "sn: s%d\n"
+			       "\n",
+			       i, i, i);
+	return result;
+}
+
+/*
+ * Print the records read from IN in ldapvi syntax and return the result,
+ * or 0 on error.
+ */
+static char *
+print_records(char *in)
+{
+	FILE *s = string_file(in);
+	FILE *out = tmpfile();
+	int rc = ldapvi_stream(s, LDAPVI_SYNTAX_LDIF, 1,
+			       ldapvi_printer(LDAPVI_SYNTAX_LDAPVI), out);
+
+	fclose(s);
+	if (rc) {
+		fclose(out);
+		return 0;
+	}
+	return file_string(out);
+}
+
+static int
+refuse_add(int key, char *dn, LDAPMod **attrs, void *userdata)
+{
+	return -1;
+}
+
+static void
+test_syntax_error(void)
+{
+	FILE *s = string_file("dn: cn=x\nchangetype: frob\n\n");
+	ldapvi_handler handler;
+
+	memset(&handler, 0, sizeof(handler));
+	check(ldapvi_stream(s, LDAPVI_SYNTAX_LDIF, 1, &handler, 0) == -1,
+	      "syntax error returns -1");
+	check(!strcmp(ldapvi_error(), "Syntax error."),
+	      "syntax error message");
+	fclose(s);
+}
+
+static void
+test_handler_error(void)
+{
+	FILE *s = string_file(records());
+	ldapvi_handler handler;
+
+	memset(&handler, 0, sizeof(handler));
+	handler.add = refuse_add;
+	check(ldapvi_stream(s, LDAPVI_SYNTAX_LDIF, 1, &handler, 0) == -2,
+	      "handler error returns -2");
+	fclose(s);
+}
+
+static void
+test_bad_clean_file(void)
+{
+	FILE *clean = string_file("\nadd cn=x,dc=example,dc=com\ncn: x\n");
+	FILE *data = string_file("");
+	long pos = -1;
+
+	check(ldapvi_diff(clean, data, LDAPVI_SYNTAX_LDAPVI,
+			  ldapvi_printer(LDAPVI_SYNTAX_LDIF), stdout, &pos)
+	      == -1,
+	      "bad clean file returns -1");
+	check(!strncmp(ldapvi_error(), "Unexpected key", 14),
+	      "bad clean file message");
+	fclose(clean);
+	fclose(data);
+}
+
+/*
+ * A write error in the middle of printing must neither end the process
+ * nor leave anything behind for the next call.
+ */
+static void
+test_write_error(char *expected)
+{
+	FILE *full = fopen("/dev/full", "w");
+	FILE *s;
+	char *result;
+
+	if (!full) {
+		printf("SKIP: write error (no /dev/full)\n");
+		return;
+	}
+	setvbuf(full, 0, _IONBF, 0);
+	s = string_file(records());
+	check(ldapvi_stream(s, LDAPVI_SYNTAX_LDIF, 1,
+			    ldapvi_printer(LDAPVI_SYNTAX_LDAPVI), full)
+	      == -1,
+	      "write error returns -1");
+	check(strstr(ldapvi_error(), "error (") != 0,
+	      "write error message");
+	fclose(s);
+	fclose(full);
+
+	result = print_records(records());
+	check(result && !strcmp(result, expected),
+	      "output after a write error");
+	free(result);
+}
+
+#ifdef THREADS
+static void *
+print_thread(void *arg)
+{
+	return print_records(arg);
+}
+
+static void
+test_threads(char *in, char *expected)
+{
+	pthread_t threads[THREADS];
+	int i;
+
+	for (i = 0; i < THREADS; i++)
+		if (pthread_create(&threads[i], 0, print_thread, in)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	for (i = 0; i < THREADS; i++) {
+		void *result;
+		pthread_join(threads[i], &result);
+		check(result && !strcmp(result, expected),
+		      "output of concurrent calls");
+		free(result);
+	}
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+	char *in = records();
+	char *expected = print_records(in);
+
+	check(expected != 0, "printing records");
+	if (!expected)
+		return 1;
+	test_syntax_error();
+	test_handler_error();
+	test_bad_clean_file();
+	test_write_error(expected);
+#ifdef THREADS
+	test_threads(in, expected);
+#endif
+	if (failures)
+		return 1;
+	puts("libldapvi tests passed");
+	return 0;
+}
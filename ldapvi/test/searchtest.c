@@ -0,0 +1,200 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Test of search() with schema comments, as for ldapvi -m, against a
+ * canned server on the other end of a socket pair.  The entries are
+ * decoded as ldapvi decodes them, in place if libldap can.
+ */
+#include "../common.h"
+#include "../config.h"
+#include <sys/socket.h>
+
+#if !defined(HAVE_LDAP_INIT_FD) || !defined(HAVE_LIBPTHREAD)
+int
+main(int argc, char **argv)
+{
+	puts("SKIP: search tests need ldap_init_fd() and threads");
+	return 0;
+}
+#else
+#include <pthread.h>
+
+static char *subschema_values[] = {"cn=Subschema", 0};
+static char *class_values[] = {
+	"( 2.5.6.0 NAME 'top' ABSTRACT MUST objectClass )",
+	"( 2.5.6.6 NAME 'person' SUP top STRUCTURAL MUST ( sn $ cn )"
+	" MAY description )",
+	0
+};
+static char *type_values[] = {
+	"( 2.5.4.0 NAME 'objectClass' )",
+	"( 2.5.4.3 NAME 'cn' )",
+	"( 2.5.4.4 NAME 'sn' )",
+	"( 2.5.4.13 NAME 'description' )",
+	0
+};
+static char *person_values[] = {"top", "person", 0};
+static char *cn_values[] = {"x", 0};
+
+static void
+send_message(Sockbuf *sb, BerElement *ber)
+{
+	if (ber_flush2(sb, ber, LBER_FLUSH_FREE_ALWAYS)) {
+		perror("ber_flush2");
+		exit(1);
+	}
+}
+
+/*
+ * Send an entry DN with attribute AD1 set to VALUES1, and AD2 to VALUES2.
+ */
+static void
+send_entry(Sockbuf *sb, ber_int_t msgid, char *dn,
+	   char *ad1, char **values1, char *ad2, char **values2)
+{
+	BerElement *ber = ber_alloc_t(LBER_USE_DER);
+
+	ber_printf(ber, "{it{s{{s[v]}{s[v]}}}}",
+		   msgid, LDAP_RES_SEARCH_ENTRY, dn,
+		   ad1, values1, ad2, values2);
+	send_message(sb, ber);
+}
+
+static void
+send_result(Sockbuf *sb, ber_int_t msgid)
+{
+	BerElement *ber = ber_alloc_t(LBER_USE_DER);
+
+	ber_printf(ber, "{it{ess}}",
+		   msgid, LDAP_RES_SEARCH_RESULT, LDAP_SUCCESS, "", "");
+	send_message(sb, ber);
+}
+
+/*
+ * Answer searches until the client unbinds: the root DSE, the subschema
+ * entry, and one person entry for any other base.
+ */
+static void *
+serve(void *arg)
+{
+	Sockbuf *sb = ber_sockbuf_alloc();
+
+	ber_sockbuf_add_io(sb, &ber_sockbuf_io_fd, LBER_SBIOD_LEVEL_PROVIDER,
+			   arg);
+	for (;;) {
+		BerElement *ber = ber_alloc_t(LBER_USE_DER);
+		ber_len_t len;
+		ber_int_t msgid;
+		struct berval base;
+
+		if (ber_get_next(sb, &len, ber) == LBER_ERROR
+		    || ber_scanf(ber, "i", &msgid) == LBER_ERROR
+		    || ber_peek_tag(ber, &len) != LDAP_REQ_SEARCH
+		    || ber_scanf(ber, "{m", &base) == LBER_ERROR)
+		{
+			ber_free(ber, 1);
+			break;
+		}
+		if (!base.bv_len)
+			send_entry(sb, msgid, "",
+				   "objectClass", person_values,
+				   "subschemaSubentry", subschema_values);
+		else if (base.bv_len == 12
+			 && !strncasecmp(base.bv_val, "cn=Subschema", 12))
+			send_entry(sb, msgid, "cn=Subschema",
+				   "objectClasses", class_values,
+				   "attributeTypes", type_values);
+		else
+			send_entry(sb, msgid, "cn=x,dc=example,dc=com",
+				   "objectClass", person_values,
+				   "cn", cn_values);
+		send_result(sb, msgid);
+		ber_free(ber, 1);
+	}
+	ber_sockbuf_free(sb);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int fds[2];
+	int version = LDAP_VERSION3;
+	pthread_t server;
+	LDAP *ld;
+	tschema *schema;
+	cmdline cmdline;
+	FILE *s;
+	char line[256];
+	int structural = 0;
+	int failures = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		perror("socketpair");
+		return 1;
+	}
+	if (pthread_create(&server, 0, serve, &fds[1])) {
+		perror("pthread_create");
+		return 1;
+	}
+	if (ldap_init_fd(fds[0], LDAP_PROTO_IPC, "ldapi://", &ld)
+	    || ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version))
+	{
+		fputs("ldap_init_fd failed\n", stderr);
+		return 1;
+	}
+	if ( !(schema = schema_new(ld)))
+		return 1;
+
+	memset(&cmdline, 0, sizeof(cmdline));
+	cmdline.basedns = g_ptr_array_new();
+	g_ptr_array_add(cmdline.basedns, "dc=example,dc=com");
+	cmdline.scope = LDAP_SCOPE_SUBTREE;
+	cmdline.filter = "(objectclass=*)";
+	cmdline.quiet = 1;
+	cmdline.noninteractive = 1;
+	if ( !(s = tmpfile())) {
+		perror("tmpfile");
+		return 1;
+	}
+	g_array_free(search(s, ld, &cmdline, 0, 1, 0, 0, schema), 1);
+	ldap_unbind_ext(ld, 0, 0);
+	pthread_join(server, 0);
+
+	rewind(s);
+	while (fgets(line, sizeof(line), s)) {
+		if (strstr(line, "ERROR")) {
+			printf("FAIL: schema comment: %s", line);
+			failures++;
+		}
+		if (!strcmp(line, "# structural object class: person\n"))
+			structural = 1;
+	}
+	if (!structural) {
+		puts("FAIL: schema comment for the structural class missing");
+		failures++;
+	}
+	fclose(s);
+	schema_free(schema);
+	if (failures)
+		return 1;
+	puts("search tests passed");
+	return 0;
+}
+#endif